@@ -11,33 +11,77 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <map>
-#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <cstdint>
+#include <type_traits>
 #include <algorithm>
-#include <iomanip>
-#include <fstream>
-#include <sstream>
+#include <array>
 #include <memory>
 #include <ctime>
 #include <cstring>
+#include <cstdlib>
+#include <new>
+#include <csignal>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <regex>
+#include <charconv>
+#include <string_view>
+#include <utility>
 
 // Platform-specific includes
 #ifdef _WIN32
     #include <windows.h>
     #include <tlhelp32.h>
     #include <psapi.h>
+    #include <evntrace.h>
+    #include <evntcons.h>
+    #include <condition_variable>
     #pragma comment(lib, "psapi.lib")
+    #pragma comment(lib, "advapi32.lib")
 #elif defined(__APPLE__)
     #include <sys/sysctl.h>
+    #include <pwd.h>
     #include <libproc.h>
     #include <sys/proc_info.h>
+    #include <mach/mach_time.h>
+    #include <mach/thread_info.h>
+    #include <sys/resource.h>
+    #include <sys/event.h>
+    #include <sys/ioctl.h>
+    #include <dirent.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <poll.h>
+    #include <fcntl.h>
     #include <unistd.h>
 #else  // Linux
     #include <dirent.h>
     #include <unistd.h>
+    #include <pwd.h>
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <sys/ioctl.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <cerrno>
     #include <cstdlib>
+    #include <climits>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <linux/netlink.h>
+    #include <linux/connector.h>
+    #include <linux/cn_proc.h>
 #endif
 
 // ANSI color codes for terminal output
@@ -54,442 +98,7168 @@ namespace Color {
 }
 
 /**
- * Structure to hold process information
+ * Self-instrumentation counters for --stats. `enabled` is set once before
+ * any collection starts; while it is false nothing below is touched, so
+ * each hook costs one predictable branch.
  */
-struct ProcessInfo {
-    int pid;
-    int ppid;
-    std::string name;
-    std::string status;
-    double cpu_percent;
-    size_t memory_kb;
-    int num_threads;
-    std::string username;
-    std::vector<ProcessInfo*> children;
-    
-    ProcessInfo() : pid(0), ppid(0), cpu_percent(0.0), memory_kb(0), num_threads(0) {}
+namespace Stats {
+    static bool enabled = false;
+    static std::atomic<uint64_t> filesOpened(0);
+    static std::atomic<uint64_t> bytesRead(0);
+    static std::atomic<uint64_t> dirEntries(0);
+    static std::atomic<uint64_t> ioNanos(0);      // open/read/close, summed over threads
+    static std::atomic<uint64_t> allocations(0);
+    static std::atomic<uint64_t> allocatedBytes(0);
+    static std::atomic<uint64_t> frees(0);
+    static std::atomic<uint64_t> userLookups(0);  // getpwuid_r / LookupAccountSid calls
+    static uint64_t ticks = 0;                    // watch/daemon refreshes
+    static uint64_t warmAllocations = 0;          // allocations before the first refresh
+    static uint64_t startResidentKb = 0;
     
     /**
-     * Format memory in human-readable form
+     * Resident set size and its peak so far, in KB (0 if unknown)
      */
-    std::string formatMemory() const {
-        if (memory_kb >= 1024 * 1024) {
-            return std::to_string(memory_kb / (1024 * 1024)) + "GB";
-        } else if (memory_kb >= 1024) {
-            return std::to_string(memory_kb / 1024) + "MB";
+    inline void memoryUsage(uint64_t& residentKb, uint64_t& peakKb) {
+        residentKb = 0;
+        peakKb = 0;
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+            residentKb = counters.WorkingSetSize / 1024;
+            peakKb = counters.PeakWorkingSetSize / 1024;
+        }
+#elif defined(__APPLE__)
+        struct proc_taskinfo task;
+        if (proc_pidinfo(getpid(), PROC_PIDTASKINFO, 0, &task, sizeof(task)) > 0) {
+            residentKb = task.pti_resident_size / 1024;
         }
-        return std::to_string(memory_kb) + "KB";
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            peakKb = static_cast<uint64_t>(usage.ru_maxrss) / 1024;  // bytes on macOS
+        }
+#else
+        FILE* status = std::fopen("/proc/self/status", "r");
+        if (!status) return;
+        char line[128];
+        while (std::fgets(line, sizeof(line), status)) {
+            if (std::strncmp(line, "VmRSS:", 6) == 0) {
+                residentKb = std::strtoull(line + 6, nullptr, 10);
+            } else if (std::strncmp(line, "VmHWM:", 6) == 0) {
+                peakKb = std::strtoull(line + 6, nullptr, 10);
+            }
+        }
+        std::fclose(status);
+#endif
     }
-};
+    
+    inline void countRead(uint64_t bytes, std::chrono::steady_clock::time_point start) {
+        filesOpened.fetch_add(1, std::memory_order_relaxed);
+        bytesRead.fetch_add(bytes, std::memory_order_relaxed);
+        ioNanos.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+    }
+}
+
+// Global allocation hooks, so --stats can count heap allocations. The
+// deletes stay out of line: GCC otherwise sees free() paired with
+// operator new at every inlined call site and warns.
+#if defined(__GNUC__)
+#define STATS_NOINLINE __attribute__((noinline))
+#else
+#define STATS_NOINLINE
+#endif
+
+void* operator new(std::size_t size) {
+    if (Stats::enabled) {
+        Stats::allocations.fetch_add(1, std::memory_order_relaxed);
+        Stats::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+STATS_NOINLINE void operator delete(void* p) noexcept {
+    if (Stats::enabled && p) {
+        Stats::frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::free(p);
+}
+
+STATS_NOINLINE void operator delete[](void* p) noexcept {
+    if (Stats::enabled && p) {
+        Stats::frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::free(p);
+}
+
+STATS_NOINLINE void operator delete(void* p, std::size_t) noexcept {
+    if (Stats::enabled && p) {
+        Stats::frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::free(p);
+}
+
+STATS_NOINLINE void operator delete[](void* p, std::size_t) noexcept {
+    if (Stats::enabled && p) {
+        Stats::frees.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::free(p);
+}
 
 /**
- * Main ProcessTree class for collecting and displaying process information
+ * Growable output buffer for the tree renderer. Text accumulates in one
+ * buffer and is written to the underlying file descriptor (HANDLE on
+ * Windows) with write(2)/WriteFile in large chunks, instead of a flush per
+ * line. A buffer constructed without a target just collects text.
  */
-class ProcessTree {
-private:
-    std::map<int, ProcessInfo> processes;
-    std::vector<ProcessInfo*> rootProcesses;
-    bool showResources;
-    bool verbose;
-    int totalProcesses;
-    int collectionErrors;
+class OutputBuffer {
+public:
+#ifdef _WIN32
+    typedef HANDLE Handle;
+#else
+    typedef int Handle;
+#endif
+    
+    static constexpr size_t flushThreshold = 256 * 1024;
+    
+    OutputBuffer() : handle(invalidHandle()), ownsHandle(false), failed(false) {}
+    
+    explicit OutputBuffer(Handle h) : handle(h), ownsHandle(false), failed(false) {
+        data.reserve(flushThreshold + 4096);
+    }
+    
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    
+    ~OutputBuffer() {
+        flush();
+        if (ownsHandle) {
+#ifdef _WIN32
+            CloseHandle(handle);
+#else
+            close(handle);
+#endif
+        }
+    }
+    
+    static Handle standardOutput() {
+#ifdef _WIN32
+        return GetStdHandle(STD_OUTPUT_HANDLE);
+#else
+        return STDOUT_FILENO;
+#endif
+    }
     
     /**
-     * Linux-specific: Read process information from /proc filesystem
+     * Create/truncate a file and write to it; returns false on failure
      */
-#ifdef __linux__
-    bool readProcessInfo(int pid, ProcessInfo& info) {
-        info.pid = pid;
-        
-        // Read /proc/[pid]/stat for basic process info
-        std::string statPath = "/proc/" + std::to_string(pid) + "/stat";
-        std::ifstream statFile(statPath);
-        if (!statFile.is_open()) {
+    bool openFile(const std::string& filename) {
+#ifdef _WIN32
+        Handle h = CreateFileA(filename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+        Handle h = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+        if (h == invalidHandle()) {
             return false;
         }
-        
-        std::string line;
-        std::getline(statFile, line);
-        
-        // Parse the stat file (format: pid (name) state ppid ...)
-        size_t nameStart = line.find('(');
-        size_t nameEnd = line.rfind(')');
-        if (nameStart != std::string::npos && nameEnd != std::string::npos) {
-            info.name = line.substr(nameStart + 1, nameEnd - nameStart - 1);
-        }
-        
-        // Get PPID (4th field after name)
-        std::istringstream iss(line.substr(nameEnd + 2));
-        std::string state;
-        iss >> state >> info.ppid;
-        info.status = state;
-        
-        // Read /proc/[pid]/status for additional info
-        std::string statusPath = "/proc/" + std::to_string(pid) + "/status";
-        std::ifstream statusFile(statusPath);
-        if (statusFile.is_open()) {
-            std::string statusLine;
-            while (std::getline(statusFile, statusLine)) {
-                if (statusLine.find("VmRSS:") == 0) {
-                    std::istringstream vmrss(statusLine);
-                    std::string label;
-                    vmrss >> label >> info.memory_kb;
-                } else if (statusLine.find("Threads:") == 0) {
-                    std::istringstream threads(statusLine);
-                    std::string label;
-                    threads >> label >> info.num_threads;
-                } else if (statusLine.find("Uid:") == 0) {
-                    // Could extract UID here
-                }
-            }
-        }
-        
+        flush();
+        handle = h;
+        ownsHandle = true;
+        data.reserve(flushThreshold + 4096);
         return true;
     }
     
-    void collectProcesses() {
-        std::cout << Color::CYAN << "Collecting process information..." << Color::RESET << std::endl;
-        
-        DIR* procDir = opendir("/proc");
-        if (!procDir) {
-            std::cerr << Color::RED << "Error: Cannot open /proc directory" << Color::RESET << std::endl;
-            return;
+    void append(const char* str, size_t len) {
+        data.append(str, len);
+        if (data.size() >= flushThreshold) flush();
+    }
+    
+    void append(const char* str) {
+        append(str, std::strlen(str));
+    }
+    
+    void append(const std::string& str) {
+        append(str.data(), str.size());
+    }
+    
+    void append(std::string_view str) {
+        append(str.data(), str.size());
+    }
+    
+    void append(char c) {
+        data.push_back(c);
+    }
+    
+    void appendNumber(long long value) {
+        char buf[24];
+        char* end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        append(buf, static_cast<size_t>(end - buf));
+    }
+    
+    /**
+     * Same text as `std::fixed << std::setprecision(1) << value`
+     */
+    void appendFixed1(double value) {
+        char buf[32];
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+        char* end = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, 1).ptr;
+        size_t len = static_cast<size_t>(end - buf);
+#else
+        // No floating-point to_chars in this standard library
+        size_t len = static_cast<size_t>(snprintf(buf, sizeof(buf), "%.1f", value));
+#endif
+        append(buf, len);
+    }
+    
+    /**
+     * Append a JSON string literal, escaping quotes, backslashes and
+     * control characters
+     */
+    void appendJsonString(const char* str) {
+        static const char hex[] = "0123456789abcdef";
+        data.push_back('"');
+        const char* run = str;
+        for (const char* p = str; *p; p++) {
+            unsigned char c = static_cast<unsigned char>(*p);
+            char escape = jsonEscapes[c];
+            if (escape == 0) continue;
+            
+            // Copy the unescaped run in one go, then the escape
+            data.append(run, static_cast<size_t>(p - run));
+            run = p + 1;
+            data.push_back('\\');
+            data.push_back(escape);
+            if (escape == 'u') {
+                const char digits[4] = {'0', '0', hex[c >> 4], hex[c & 15]};
+                data.append(digits, sizeof(digits));
+            }
         }
+        data.append(run);
+        data.push_back('"');
+        if (data.size() >= flushThreshold) flush();
+    }
+    
+    const std::string& str() const {
+        return data;
+    }
+    
+    /**
+     * Drop everything collected so far but keep the memory, for a buffer
+     * that is refilled every tick (collect-only buffers)
+     */
+    void clear() {
+        data.clear();
+    }
+    
+    /**
+     * Collect into `storage`'s memory from now on, dropping its contents;
+     * with release() this recycles one buffer across snapshots
+     */
+    void reuse(std::string&& storage) {
+        flush();
+        data = std::move(storage);
+        data.clear();
+    }
+    
+    /**
+     * Hand over everything collected so far (collect-only buffers)
+     */
+    std::string release() {
+        std::string text;
+        text.swap(data);
+        return text;
+    }
+    
+    /**
+     * False once a write has failed
+     */
+    bool good() const {
+        return !failed;
+    }
+    
+    /**
+     * Write everything buffered so far; no-op for collect-only buffers
+     */
+    void flush() {
+        if (handle == invalidHandle() || data.empty()) return;
         
-        struct dirent* entry;
-        while ((entry = readdir(procDir)) != nullptr) {
-            // Check if directory name is a number (PID)
-            if (entry->d_type == DT_DIR) {
-                int pid = atoi(entry->d_name);
-                if (pid > 0) {
-                    ProcessInfo info;
-                    if (readProcessInfo(pid, info)) {
-                        processes[pid] = info;
-                        totalProcesses++;
-                    } else {
-                        collectionErrors++;
-                    }
-                }
+        const char* p = data.data();
+        size_t remaining = data.size();
+        while (remaining > 0 && !failed) {
+#ifdef _WIN32
+            DWORD written = 0;
+            if (!WriteFile(handle, p, static_cast<DWORD>(std::min<size_t>(remaining, 1 << 30)), &written, nullptr)) {
+                failed = true;
+                break;
             }
+#else
+            ssize_t written = write(handle, p, remaining);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                break;
+            }
+#endif
+            p += written;
+            remaining -= static_cast<size_t>(written);
         }
-        closedir(procDir);
-        
-        std::cout << Color::GREEN << "Collected " << processes.size() << " processes" << Color::RESET << std::endl;
+        data.clear();
     }
+    
+private:
+    std::string data;
+    Handle handle;
+    bool ownsHandle;
+    bool failed;
+    
+    // Per byte: 0 if it is copied as is, else the character that follows
+    // the backslash ('u' for a \u00XX escape)
+    static constexpr std::array<char, 256> jsonEscapes = [] {
+        std::array<char, 256> table{};
+        for (int c = 0; c < 0x20; c++) table[c] = 'u';
+        table['"'] = '"';
+        table['\\'] = '\\';
+        return table;
+    }();
+    
+    static Handle invalidHandle() {
+#ifdef _WIN32
+        return INVALID_HANDLE_VALUE;
+#else
+        return -1;
 #endif
+    }
+};
+
+/**
+ * Work-partitioned parallel loop. Splits [0, count) into fixed-size chunks
+ * that worker threads claim from a shared atomic cursor, and calls
+ * fn(worker, begin, end) for each chunk. Worker 0 is the calling thread,
+ * so jobs <= 1 runs inline without spawning anything.
+ */
+template <typename Fn>
+void parallelFor(size_t count, unsigned jobs, Fn fn) {
+    const size_t chunk = 64;
+    size_t maxWorkers = (count + chunk - 1) / chunk;
+    if (jobs > maxWorkers) jobs = static_cast<unsigned>(maxWorkers);
+    if (jobs <= 1) {
+        if (count > 0) fn(0u, size_t(0), count);
+        return;
+    }
+    
+    std::atomic<size_t> cursor(0);
+    auto worker = [&](unsigned id) {
+        for (;;) {
+            size_t begin = cursor.fetch_add(chunk, std::memory_order_relaxed);
+            if (begin >= count) break;
+            fn(id, begin, std::min(begin + chunk, count));
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    threads.reserve(jobs - 1);
+    for (unsigned id = 1; id < jobs; id++) {
+        threads.emplace_back(worker, id);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
 
+/**
+ * Append-only pool of interned strings. Each distinct string is stored
+ * once, NUL-terminated, in a single buffer and identified by its byte
+ * offset. Handle 0 is always the empty string.
+ */
+class StringPool {
+private:
+    // Open-addressing index of handles (linear probing; 0 marks a free
+    // slot, as the empty string is never indexed). It is one flat array,
+    // so clear() frees nothing and a pool refilled with the same strings
+    // every tick allocates nothing.
+    std::string data;
+    std::vector<uint32_t> slots;
+    size_t used;
+    uint64_t gen;
+    
+    static size_t hashOf(const char* str, size_t len) {
+        return std::hash<std::string_view>()(std::string_view(str, len));
+    }
+    
+    bool equals(uint32_t id, const char* str, size_t len) const {
+        return id + len < data.size() && data[id + len] == '\0' && std::memcmp(data.data() + id, str, len) == 0;
+    }
+    
+    void grow() {
+        std::vector<uint32_t> old(std::max<size_t>(64, slots.size() * 2), 0);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id : old) {
+            if (id == 0) continue;
+            size_t pos = hashOf(data.c_str() + id, std::strlen(data.c_str() + id)) & mask;
+            while (slots[pos] != 0) pos = (pos + 1) & mask;
+            slots[pos] = id;
+        }
+    }
+    
+    // Generations are unique across pools, so swapped pools never share
+    // one, and start from the clock so those published in daemon
+    // snapshots don't repeat across runs
+    static uint64_t nextGeneration() {
+        static std::atomic<uint64_t> counter(static_cast<uint64_t>(
+            std::chrono::system_clock::now().time_since_epoch().count()));
+        return ++counter;
+    }
+    
+public:
+    StringPool() : data(1, '\0'), used(0), gen(nextGeneration()) {}
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    
     /**
-     * macOS-specific: Use libproc APIs
+     * Return the handle for a string, adding it on first use. Looking up
+     * a string that is already pooled costs no allocation.
      */
-#ifdef __APPLE__
-    bool readProcessInfo(int pid, ProcessInfo& info) {
-        info.pid = pid;
-        
-        struct proc_bsdinfo proc;
-        if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &proc, sizeof(proc)) <= 0) {
-            return false;
+    uint32_t intern(const char* str, size_t len) {
+        if (len == 0) return 0;
+        if ((used + 1) * 2 > slots.size()) grow();
+        size_t mask = slots.size() - 1;
+        size_t pos = hashOf(str, len) & mask;
+        while (uint32_t existing = slots[pos]) {
+            if (equals(existing, str, len)) return existing;
+            pos = (pos + 1) & mask;
         }
-        
-        info.ppid = proc.pbi_ppid;
-        info.name = proc.pbi_comm;
-        info.status = proc.pbi_status == SRUN ? "R" : "S";
-        
-        // Get task info for memory
-        struct proc_taskinfo task;
-        if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &task, sizeof(task)) > 0) {
-            info.memory_kb = task.pti_resident_size / 1024;
-            info.num_threads = task.pti_threadnum;
+        uint32_t id = static_cast<uint32_t>(data.size());
+        data.append(str, len);
+        data.push_back('\0');
+        slots[pos] = id;
+        used++;
+        return id;
+    }
+    
+    uint32_t intern(const char* str) {
+        return intern(str, std::strlen(str));
+    }
+    
+    uint32_t intern(const std::string& str) {
+        return intern(str.data(), str.size());
+    }
+    
+    const char* get(uint32_t id) const {
+        return data.c_str() + id;
+    }
+    
+    /**
+     * The raw pool: NUL-separated strings, addressed by handle
+     */
+    const std::string& buffer() const {
+        return data;
+    }
+    
+    size_t bytes() const {
+        return data.capacity() + slots.capacity() * sizeof(uint32_t);
+    }
+    
+    /**
+     * Changes whenever existing handles become invalid (clear(), swap());
+     * between changes the pool only grows at the end
+     */
+    uint64_t generation() const {
+        return gen;
+    }
+    
+    void clear() {
+        std::fill(slots.begin(), slots.end(), 0);
+        used = 0;
+        data.assign(1, '\0');
+        gen = nextGeneration();
+    }
+    
+    void swap(StringPool& other) {
+        data.swap(other.data);
+        slots.swap(other.slots);
+        std::swap(used, other.used);
+        std::swap(gen, other.gen);
+    }
+};
+
+/**
+ * Process state. The enumerators are the single-letter codes Linux uses in
+ * /proc/[pid]/stat, so a state is one byte in ProcessInfo and in binary
+ * snapshots, and exports print it unchanged. Codes without a name here
+ * pass through as-is.
+ */
+enum ProcessState : char {
+    STATE_UNKNOWN    = '\0',
+    STATE_RUNNING    = 'R',
+    STATE_SLEEPING   = 'S',
+    STATE_DISK_SLEEP = 'D',
+    STATE_STOPPED    = 'T',
+    STATE_TRACED     = 't',
+    STATE_ZOMBIE     = 'Z',
+    STATE_DEAD       = 'X',
+    STATE_IDLE       = 'I'
+};
+
+/**
+ * The Color codes as one rendering pass uses them: COLORED_PALETTE for a
+ * terminal, PLAIN_PALETTE (all empty) for files, pipes and sockets, where
+ * escape codes are junk
+ */
+struct Palette {
+    std::string_view reset, red, green, yellow, blue, magenta, cyan, white, bright;
+    
+    /**
+     * Name color for a process state: running green, zombie red, else cyan
+     */
+    constexpr std::string_view state(ProcessState status) const;
+};
+
+/**
+ * The Palette member state() picks, looked up by state byte
+ */
+static constexpr std::array<std::string_view Palette::*, 256> STATE_COLORS = [] {
+    std::array<std::string_view Palette::*, 256> table{};
+    for (auto& color : table) color = &Palette::cyan;
+    table[static_cast<unsigned char>(STATE_RUNNING)] = &Palette::green;
+    table[static_cast<unsigned char>(STATE_ZOMBIE)] = &Palette::red;
+    return table;
+}();
+
+constexpr std::string_view Palette::state(ProcessState status) const {
+    return this->*STATE_COLORS[static_cast<unsigned char>(status)];
+}
+
+static constexpr Palette COLORED_PALETTE = {
+    "\033[0m", "\033[31m", "\033[32m", "\033[33m", "\033[34m", "\033[35m", "\033[36m", "\033[37m", "\033[1m"
+};
+static constexpr Palette PLAIN_PALETTE = {"", "", "", "", "", "", "", "", ""};
+
+/**
+ * Whether output to stdout should be colored: only when it is a terminal,
+ * and not if NO_COLOR is set
+ */
+static bool colorTerminal() {
+    if (std::getenv("NO_COLOR")) return false;
+#ifdef _WIN32
+    DWORD mode;
+    return GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode) != 0;
+#else
+    return isatty(STDOUT_FILENO) != 0;
+#endif
+}
+
+/**
+ * A timestamp as "YYYY-MM-DD HH:MM:SS" local time. Converted into a
+ * local struct tm: localtime()'s buffer is shared by every thread.
+ */
+static std::string formatLocalTime(time_t when) {
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &when);
+#else
+    localtime_r(&when, &local);
+#endif
+    char buf[80];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+    return buf;
+}
+
+/**
+ * Structure to hold process information. Kept trivially copyable so the
+ * process table can store records in one contiguous array; strings live
+ * in the table's StringPool and are referenced by handle.
+ */
+struct ProcessInfo {
+    int32_t pid;
+    int32_t ppid;
+    uint32_t name;        // StringPool handle
+    uint32_t username;    // StringPool handle, 0 if unknown
+    uint32_t cmdline;     // StringPool handle, 0 unless FIELD_CMDLINE
+    int32_t num_threads;
+    ProcessState status;  // STATE_UNKNOWN if the platform doesn't report it
+    char reserved[3];     // explicit padding, always zero (snapshot layout)
+    uint32_t cgroup;      // StringPool handle, 0 unless FIELD_CGROUP
+    double cpu_percent;
+    uint64_t memory_kb;
+    uint64_t cpu_time_us; // accumulated user + system CPU time
+    uint64_t start_time;  // platform start-time stamp, detects PID reuse
+    
+    ProcessInfo() : pid(0), ppid(0), name(0), username(0), cmdline(0), num_threads(0), status(STATE_UNKNOWN),
+                    reserved{}, cgroup(0), cpu_percent(0.0), memory_kb(0), cpu_time_us(0), start_time(0) {}
+    
+    /**
+     * Format memory in human-readable form
+     */
+    std::string formatMemory() const {
+        return formatKb(memory_kb);
+    }
+    
+    static std::string formatKb(uint64_t kb) {
+        if (kb >= 1024 * 1024) {
+            return std::to_string(kb / (1024 * 1024)) + "GB";
+        } else if (kb >= 1024) {
+            return std::to_string(kb / 1024) + "MB";
         }
-        
-        return true;
+        return std::to_string(kb) + "KB";
     }
     
-    void collectProcesses() {
-        std::cout << Color::CYAN << "Collecting process information..." << Color::RESET << std::endl;
-        
-        int numPids = proc_listpids(PROC_ALL_PIDS, 0, nullptr, 0);
-        std::vector<int> pids(numPids * 2);
-        
-        numPids = proc_listpids(PROC_ALL_PIDS, 0, pids.data(), pids.size() * sizeof(int));
+    /**
+     * formatKb straight into a buffer, without a temporary string
+     */
+    static void appendKb(uint64_t kb, OutputBuffer& out) {
+        if (kb >= 1024 * 1024) {
+            out.appendNumber(static_cast<long long>(kb / (1024 * 1024)));
+            out.append("GB", 2);
+        } else if (kb >= 1024) {
+            out.appendNumber(static_cast<long long>(kb / 1024));
+            out.append("MB", 2);
+        } else {
+            out.appendNumber(static_cast<long long>(kb));
+            out.append("KB", 2);
+        }
+    }
+};
+
+static_assert(std::is_trivially_copyable<ProcessInfo>::value && sizeof(ProcessInfo) == 64,
+              "ProcessInfo is written to binary snapshots as-is");
+
+/**
+ * One thread of a --threads process; the name is a StringPool handle
+ */
+struct ThreadInfo {
+    uint64_t tid = 0;
+    uint32_t name = 0;
+    ProcessState status = STATE_UNKNOWN;
+    uint64_t cpu_time_us = 0;
+    double cpu_percent = 0.0;
+};
+
+/**
+ * Resource use a cgroup accounts for itself (all its processes and child
+ * groups together)
+ */
+struct CgroupStats {
+    bool hasMemory = false;
+    bool hasCpu = false;
+    uint64_t memory_bytes = 0;
+    uint64_t cpu_usage_us = 0;
+};
+
+/**
+ * --rollup totals of a process and all its descendants, kept parallel to
+ * the records (same index)
+ */
+struct Rollup {
+    uint64_t memory_kb = 0;
+    double cpu_percent = 0.0;
+    int64_t num_threads = 0;
+    uint32_t processes = 0;
+    uint32_t reserved = 0;  // explicit padding (snapshot layout)
+    
+    void add(const Rollup& other) {
+        memory_kb += other.memory_kb;
+        cpu_percent += other.cpu_percent;
+        num_threads += other.num_threads;
+        processes += other.processes;
+    }
+};
+
+static_assert(std::is_trivially_copyable<Rollup>::value && sizeof(Rollup) == 32,
+              "Rollup is written to binary snapshots as-is");
+
+/**
+ * Binary snapshot layout (--format bin), version 2 (1 had no cmdline). Integers are in host
+ * byte order; byteOrder lets a reader reject a snapshot from a host of the
+ * other endianness.
+ *
+ *   SnapshotHeader
+ *   sectionCount x { SnapshotSection, payload padded to 8 bytes }
+ *
+ * Sections carry their own length, so readers skip types they don't know.
+ * Records, the string pool and the CSR arrays are stored exactly as
+ * ProcessTable holds them, so a memory-mapped file can be used in place.
+ */
+namespace Snapshot {
+    const char MAGIC[8] = {'P', 'T', 'R', 'E', 'E', 'S', 'N', 'P'};
+    const uint32_t VERSION = 2;
+    const uint32_t ORDER_MARK = 0x01020304;
+    
+    enum SectionType : uint32_t {
+        SECTION_RECORDS = 1,      // ProcessInfo[recordCount], sorted by PID
+        SECTION_STRINGS = 2,      // StringPool bytes; handles are offsets
+        SECTION_CHILD_START = 3,  // uint32_t[recordCount + 1]
+        SECTION_CHILD_INDEX = 4,  // uint32_t[childStart[recordCount]]
+        SECTION_ROOTS = 5,        // uint32_t[]
+        SECTION_ROLLUPS = 6,      // Rollup[recordCount], optional (--rollup)
+        SECTION_COLLECTION = 7,   // Collection, optional (--cache files)
+        SECTION_GENERATION = 8    // uint64_t StringPool::generation(), optional (daemon)
+    };
+    
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint64_t timestamp;       // seconds since the epoch
+        uint32_t recordSize;      // sizeof(ProcessInfo)
+        uint32_t recordCount;
+        uint32_t host;            // string handle of the host name
+        uint32_t sectionCount;
+    };
+    
+    struct Section {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t length;          // payload bytes, excluding padding
+    };
+    
+    /**
+     * How the records of a --cache file were read: a later run can only
+     * reuse them if they carry the fields it needs and were read since
+     * the same boot (start times are relative to it on Linux)
+     */
+    struct Collection {
+        uint32_t fields;          // CollectField bits
+        uint32_t reserved;
+        uint64_t bootTime;        // ProcessCollector::bootTime() of the writer
+    };
+    
+    static_assert(sizeof(Header) == 40 && sizeof(Section) == 16 && sizeof(Collection) == 16,
+                  "fixed on-disk layout");
+}
+
+/**
+ * Read-only view of a process table's arrays. A live ProcessTable and a
+ * memory-mapped snapshot both expose one, so rendering and queries run on
+ * either without copying records. The adjacency of a mapped file is
+ * validated when it is opened; string handles are bounds-checked on use.
+ */
+struct ProcessTableView {
+    const ProcessInfo* records = nullptr;
+    uint32_t count = 0;
+    const char* strings = nullptr;
+    size_t stringsSize = 0;
+    const uint32_t* childStart = nullptr;
+    const uint32_t* childIndex = nullptr;
+    const uint32_t* roots = nullptr;
+    uint32_t rootCount = 0;
+    const uint32_t* parents = nullptr;  // parent index or npos; not in snapshots
+    const Rollup* rollups = nullptr;    // only in snapshots written with --rollup
+    const Snapshot::Collection* collection = nullptr;  // only in --cache files
+    uint64_t generation = 0;            // writer's pool generation; only in daemon snapshots
+    
+    static constexpr uint32_t npos = UINT32_MAX;
+    
+    size_t size() const {
+        return count;
+    }
+    
+    /**
+     * Binary search for a PID; returns npos if it is not in the table
+     */
+    uint32_t indexOf(int pid) const {
+        const ProcessInfo* end = records + count;
+        const ProcessInfo* it = std::lower_bound(records, end, pid,
+                                                 [](const ProcessInfo& p, int value) { return p.pid < value; });
+        if (it == end || it->pid != pid) return npos;
+        return static_cast<uint32_t>(it - records);
+    }
+    
+    const char* string(uint32_t handle) const {
+        return handle < stringsSize ? strings + handle : "";
+    }
+    
+    const char* name(const ProcessInfo& proc) const {
+        return string(proc.name);
+    }
+    
+    uint32_t childCount(uint32_t index) const {
+        return childStart[index + 1] - childStart[index];
+    }
+    
+    const uint32_t* childrenBegin(uint32_t index) const {
+        return childIndex + childStart[index];
+    }
+};
+
+/**
+ * Which ProcessInfo fields a collection pass has to fill. PID, PPID, name
+ * and state are always read; the other bits let each backend skip whole
+ * files and syscalls that nothing is going to display or export.
+ */
+enum CollectField : uint32_t {
+    FIELD_BASIC   = 0,
+    FIELD_MEMORY  = 1u << 0,  // memory_kb
+    FIELD_THREADS = 1u << 1,  // num_threads
+    FIELD_CPU     = 1u << 2,  // cpu_time_us and start_time
+    FIELD_CMDLINE = 1u << 3,  // cmdline
+    FIELD_USER    = 1u << 4,  // username
+    FIELD_ALL     = FIELD_MEMORY | FIELD_THREADS | FIELD_CPU | FIELD_CMDLINE | FIELD_USER,
+    FIELD_CGROUP  = 1u << 5   // cgroup; only for --group-by, so not in FIELD_ALL
+};
+
+/**
+ * Flat, cache-friendly process table. Records are sorted by PID in one
+ * vector and looked up by binary search; each record's children are an
+ * index range [childStart[i], childStart[i + 1]) into childIndex
+ * (CSR adjacency), already in PID order. parents[i] is the parent's index
+ * (npos for roots).
+ */
+class ProcessTable {
+public:
+    std::vector<ProcessInfo> records;
+    std::vector<uint32_t> childStart;
+    std::vector<uint32_t> childIndex;
+    std::vector<uint32_t> roots;
+    std::vector<uint32_t> parents;
+    StringPool strings;
+    
+    // Bumped by every link(): indices from before it may now mean
+    // different processes
+    uint64_t links = 0;
+    
+    static constexpr uint32_t npos = UINT32_MAX;
+    
+    size_t size() const {
+        return records.size();
+    }
+    
+    /**
+     * Binary search for a PID; returns npos if it is not in the table
+     */
+    uint32_t indexOf(int pid) const {
+        auto it = std::lower_bound(records.begin(), records.end(), pid,
+                                   [](const ProcessInfo& p, int value) { return p.pid < value; });
+        if (it == records.end() || it->pid != pid) return npos;
+        return static_cast<uint32_t>(it - records.begin());
+    }
+    
+    /**
+     * View of the current arrays; invalidated by any modification
+     */
+    ProcessTableView view() const {
+        ProcessTableView v;
+        v.records = records.data();
+        v.count = static_cast<uint32_t>(records.size());
+        v.strings = strings.buffer().data();
+        v.stringsSize = strings.buffer().size();
+        v.childStart = childStart.data();
+        v.childIndex = childIndex.data();
+        v.roots = roots.data();
+        v.rootCount = static_cast<uint32_t>(roots.size());
+        v.parents = parents.size() == records.size() ? parents.data() : nullptr;
+        return v;
+    }
+    
+    /**
+     * Build the hierarchy: one sort by PID, then linear passes to count
+     * children per parent, prefix-sum the counts into childStart and
+     * scatter child indices. Because records are visited in PID order,
+     * every child range and the root list come out sorted.
+     */
+    void build() {
+        std::sort(records.begin(), records.end(),
+                  [](const ProcessInfo& a, const ProcessInfo& b) { return a.pid < b.pid; });
+        records.erase(std::unique(records.begin(), records.end(),
+                                  [](const ProcessInfo& a, const ProcessInfo& b) { return a.pid == b.pid; }),
+                      records.end());
+        link();
+    }
+    
+    /**
+     * Rebuild the CSR adjacency and root list from records that are
+     * already sorted by PID. Linear apart from the parent lookups.
+     */
+    void link() {
+        links++;
+        size_t n = records.size();
+        parents.resize(n);
+        childStart.assign(n + 1, 0);
+        roots.clear();
+        
+        for (size_t i = 0; i < n; i++) {
+            uint32_t p = records[i].ppid != records[i].pid ? indexOf(records[i].ppid) : npos;
+            parents[i] = p;
+            if (p != npos) {
+                childStart[p + 1]++;
+            } else {
+                roots.push_back(static_cast<uint32_t>(i));
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            childStart[i + 1] += childStart[i];
+        }
+        
+        childIndex.resize(childStart[n]);
+        std::vector<uint32_t> fill(childStart.begin(), childStart.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            if (parents[i] != npos) {
+                childIndex[fill[parents[i]]++] = static_cast<uint32_t>(i);
+            }
+        }
+    }
+    
+    /**
+     * Insert a record, or replace the one with the same PID, keeping PID
+     * order. Call link() once a batch of updates is done.
+     */
+    void upsert(const ProcessInfo& info) {
+        auto it = std::lower_bound(records.begin(), records.end(), info.pid,
+                                   [](const ProcessInfo& p, int value) { return p.pid < value; });
+        if (it != records.end() && it->pid == info.pid) {
+            *it = info;
+        } else {
+            records.insert(it, info);
+        }
+    }
+    
+    /**
+     * Drop the record for a PID if present. Call link() afterwards.
+     */
+    bool erase(int pid) {
+        uint32_t i = indexOf(pid);
+        if (i == npos) return false;
+        records.erase(records.begin() + i);
+        return true;
+    }
+    
+    /**
+     * Approximate heap footprint of the table in bytes
+     */
+    size_t bytes() const {
+        return records.capacity() * sizeof(ProcessInfo)
+             + (childStart.capacity() + childIndex.capacity() + roots.capacity() + parents.capacity()) * sizeof(uint32_t)
+             + strings.bytes();
+    }
+    
+    void clear() {
+        records.clear();
+        childStart.clear();
+        childIndex.clear();
+        roots.clear();
+        parents.clear();
+        strings.clear();
+    }
+};
+
+/**
+ * Read-only memory mapping of a whole file
+ */
+class MappedFile {
+public:
+    MappedFile() : base(nullptr), length(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#endif
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    ~MappedFile() {
+        unmap();
+    }
+    
+    bool map(const std::string& filename) {
+        unmap();
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!base) return false;
+        length = static_cast<size_t>(size.QuadPart);
+#else
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) return false;
+        base = addr;
+        length = static_cast<size_t>(st.st_size);
+#endif
+        return true;
+    }
+    
+    const char* data() const {
+        return static_cast<const char*>(base);
+    }
+    
+    size_t size() const {
+        return length;
+    }
+    
+private:
+    void* base;
+    size_t length;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    
+    void unmap() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (base) munmap(base, length);
+#endif
+        base = nullptr;
+        length = 0;
+    }
+};
+
+/**
+ * Locate the sections of a binary snapshot held in memory and fill a view
+ * over them. Beyond the header and section bounds, one linear pass checks
+ * that every child range and index stays inside the table, so a damaged
+ * or crafted file is rejected rather than read out of bounds. On success
+ * `host` and `timestamp` are set from the header.
+ */
+static bool openSnapshot(const char* data, size_t size, ProcessTableView& view,
+                         uint32_t& host, uint64_t& timestamp, std::string& error) {
+    if (size < sizeof(Snapshot::Header)) {
+        error = "file too small";
+        return false;
+    }
+    Snapshot::Header header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, Snapshot::MAGIC, sizeof(header.magic)) != 0) {
+        error = "not a process tree snapshot";
+        return false;
+    }
+    if (header.byteOrder != Snapshot::ORDER_MARK) {
+        error = "snapshot was written on a host with different byte order";
+        return false;
+    }
+    if (header.version != Snapshot::VERSION || header.recordSize != sizeof(ProcessInfo)) {
+        error = "unsupported snapshot version " + std::to_string(header.version);
+        return false;
+    }
+    
+    view = ProcessTableView();
+    view.count = header.recordCount;
+    size_t childStartLen = 0, childIndexLen = 0, recordsLen = 0, rootsLen = 0;
+    
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.sectionCount; i++) {
+        Snapshot::Section section;
+        if (size - offset < sizeof(section)) {
+            error = "truncated section table";
+            return false;
+        }
+        std::memcpy(&section, data + offset, sizeof(section));
+        offset += sizeof(section);
+        if (section.length > size - offset) {
+            error = "truncated section";
+            return false;
+        }
+        
+        const char* payload = data + offset;
+        switch (section.type) {
+        case Snapshot::SECTION_RECORDS:
+            view.records = reinterpret_cast<const ProcessInfo*>(payload);
+            recordsLen = section.length;
+            break;
+        case Snapshot::SECTION_STRINGS:
+            view.strings = payload;
+            view.stringsSize = section.length;
+            break;
+        case Snapshot::SECTION_CHILD_START:
+            view.childStart = reinterpret_cast<const uint32_t*>(payload);
+            childStartLen = section.length / sizeof(uint32_t);
+            break;
+        case Snapshot::SECTION_CHILD_INDEX:
+            view.childIndex = reinterpret_cast<const uint32_t*>(payload);
+            childIndexLen = section.length / sizeof(uint32_t);
+            break;
+        case Snapshot::SECTION_ROOTS:
+            view.roots = reinterpret_cast<const uint32_t*>(payload);
+            rootsLen = section.length / sizeof(uint32_t);
+            break;
+        case Snapshot::SECTION_ROLLUPS:
+            if (section.length == static_cast<uint64_t>(header.recordCount) * sizeof(Rollup)) {
+                view.rollups = reinterpret_cast<const Rollup*>(payload);
+            }
+            break;
+        case Snapshot::SECTION_COLLECTION:
+            if (section.length == sizeof(Snapshot::Collection)) {
+                view.collection = reinterpret_cast<const Snapshot::Collection*>(payload);
+            }
+            break;
+        case Snapshot::SECTION_GENERATION:
+            if (section.length == sizeof(uint64_t)) {
+                std::memcpy(&view.generation, payload, sizeof(uint64_t));
+            }
+            break;
+        default:
+            break;  // Unknown section from a newer writer
+        }
+        
+        size_t padded = (section.length + 7) & ~static_cast<uint64_t>(7);
+        offset += std::min(padded, size - offset);
+    }
+    
+    if (!view.records || !view.strings || !view.childStart || !view.roots
+        || recordsLen != static_cast<size_t>(view.count) * sizeof(ProcessInfo)
+        || childStartLen != static_cast<size_t>(view.count) + 1
+        || view.childStart[view.count] != childIndexLen
+        || view.stringsSize == 0 || view.strings[view.stringsSize - 1] != '\0') {
+        error = "corrupt snapshot";
+        return false;
+    }
+    for (uint32_t i = 0; i < view.count; i++) {
+        if (view.childStart[i] > view.childStart[i + 1]) {
+            error = "corrupt snapshot (child ranges)";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < childIndexLen; i++) {
+        if (view.childIndex[i] >= view.count) {
+            error = "corrupt snapshot (child index)";
+            return false;
+        }
+    }
+    for (size_t i = 0; i < rootsLen; i++) {
+        if (view.roots[i] >= view.count) {
+            error = "corrupt snapshot (roots)";
+            return false;
+        }
+    }
+    if (!view.childIndex) {
+        view.childIndex = view.childStart;  // no children anywhere
+    }
+    view.rootCount = static_cast<uint32_t>(rootsLen);
+    host = header.host;
+    timestamp = header.timestamp;
+    return true;
+}
+
+/**
+ * Source of process lifecycle events for watch mode. Each backend turns
+ * its native notifications into fork/exec/exit events in a bounded ring;
+ * if the ring fills up or the backend reports lost events, overflowed()
+ * tells the consumer that the queue is incomplete and it should rescan.
+ */
+class ProcEventSource {
+public:
+    enum Type : uint8_t { FORK, EXEC, EXIT };
+    
+    struct Event {
+        Type type;
+        int pid;   // 0 for a FORK whose child is not reported (kqueue)
+        int ppid;  // FORK only
+    };
+    
+    ProcEventSource(const ProcEventSource&) = delete;
+    ProcEventSource& operator=(const ProcEventSource&) = delete;
+    virtual ~ProcEventSource() {}
+    
+    /**
+     * Subscribe; false if the platform or our privileges don't allow it
+     */
+    virtual bool open() = 0;
+    
+    /**
+     * Wait up to timeoutMs for events and move everything pending into
+     * the ring. Returns true if anything was queued or lost.
+     */
+    virtual bool wait(int timeoutMs) = 0;
+    
+    /**
+     * Start following one process. Only sources that subscribe per PID
+     * (kqueue) need this; system-wide ones ignore it.
+     */
+    virtual void track(int) {}
+    
+    /**
+     * Pop the oldest queued event; false when the ring is empty
+     */
+    bool next(Event& event) {
+        if (count == 0) return false;
+        event = ring[head];
+        head = (head + 1) % ring.size();
+        count--;
+        return true;
+    }
+    
+    /**
+     * True if events were dropped since the last reset
+     */
+    bool overflowed() const {
+        return lost;
+    }
+    
+    void reset() {
+        head = 0;
+        count = 0;
+        lost = false;
+    }
+
+protected:
+    explicit ProcEventSource(size_t capacity = 4096)
+        : ring(capacity), head(0), count(0), lost(false) {}
+    
+    void push(Type type, int pid, int ppid) {
+        if (count == ring.size()) {
+            lost = true;
+            return;
+        }
+        ring[(head + count) % ring.size()] = Event{type, pid, ppid};
+        count++;
+    }
+    
+    void markLost() {
+        lost = true;
+    }
+    
+    size_t pending() const {
+        return count;
+    }
+
+private:
+    std::vector<Event> ring;
+    size_t head;
+    size_t count;
+    bool lost;
+};
+
+#ifdef __linux__
+/**
+ * Linux: the kernel proc connector (NETLINK_CONNECTOR / CN_IDX_PROC).
+ * ENOBUFS on the socket means the kernel dropped events. Subscribing
+ * needs CAP_NET_ADMIN.
+ */
+class NetlinkEventSource : public ProcEventSource {
+public:
+    NetlinkEventSource() : fd(-1) {}
+    
+    ~NetlinkEventSource() override {
+        close();
+    }
+    
+    bool open() override {
+        fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+        if (fd < 0) return false;
+        
+        struct sockaddr_nl addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = CN_IDX_PROC;
+        addr.nl_pid = 0;
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            !sendControl(PROC_CN_MCAST_LISTEN)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    
+    bool wait(int timeoutMs) override {
+        size_t before = pending();
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeoutMs) <= 0) {
+            return false;
+        }
+        
+        alignas(struct nlmsghdr) char buf[8192];
+        for (;;) {
+            ssize_t len = recv(fd, buf, sizeof(buf), 0);
+            if (len < 0) {
+                if (errno == ENOBUFS) {
+                    markLost();
+                    continue;
+                }
+                break;
+            }
+            for (struct nlmsghdr* nlh = reinterpret_cast<struct nlmsghdr*>(buf);
+                 NLMSG_OK(nlh, static_cast<unsigned>(len)); nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_type == NLMSG_NOOP || nlh->nlmsg_type == NLMSG_ERROR) continue;
+                const struct cn_msg* msg = static_cast<const struct cn_msg*>(NLMSG_DATA(nlh));
+                if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC) continue;
+                decode(*reinterpret_cast<const struct proc_event*>(msg->data));
+            }
+        }
+        return pending() > before || overflowed();
+    }
+
+private:
+    int fd;
+    
+    void close() {
+        if (fd >= 0) {
+            sendControl(PROC_CN_MCAST_IGNORE);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    
+    bool sendControl(enum proc_cn_mcast_op op) {
+        // nlmsghdr | cn_msg | op, laid out by hand (cn_msg ends in a
+        // flexible array member)
+        const size_t size = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+        alignas(struct nlmsghdr) char req[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))];
+        std::memset(req, 0, sizeof(req));
+        struct nlmsghdr* nlh = reinterpret_cast<struct nlmsghdr*>(req);
+        nlh->nlmsg_len = static_cast<__u32>(size);
+        nlh->nlmsg_type = NLMSG_DONE;
+        nlh->nlmsg_pid = static_cast<__u32>(getpid());
+        struct cn_msg* msg = static_cast<struct cn_msg*>(NLMSG_DATA(nlh));
+        msg->id.idx = CN_IDX_PROC;
+        msg->id.val = CN_VAL_PROC;
+        msg->len = sizeof(op);
+        std::memcpy(msg->data, &op, sizeof(op));
+        return send(fd, req, size, 0) == static_cast<ssize_t>(size);
+    }
+    
+    /**
+     * Keep whole-process events only: thread creation and thread exit
+     * (pid != tgid) don't change the tree
+     */
+    void decode(const struct proc_event& ev) {
+        switch (ev.what) {
+            case proc_event::PROC_EVENT_FORK:
+                if (ev.event_data.fork.child_pid == ev.event_data.fork.child_tgid) {
+                    push(FORK, ev.event_data.fork.child_tgid, ev.event_data.fork.parent_tgid);
+                }
+                break;
+            case proc_event::PROC_EVENT_EXEC:
+                push(EXEC, ev.event_data.exec.process_tgid, 0);
+                break;
+            case proc_event::PROC_EVENT_EXIT:
+                if (ev.event_data.exit.process_pid == ev.event_data.exit.process_tgid) {
+                    push(EXIT, ev.event_data.exit.process_tgid, 0);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+};
+#endif
+
+#ifdef __APPLE__
+/**
+ * macOS: kqueue EVFILT_PROC with NOTE_FORK/NOTE_EXEC/NOTE_EXIT on every
+ * known process. NOTE_FORK does not say which child was created, so it
+ * is queued with pid 0 and the consumer lists the parent's children.
+ * The kernel removes the knote itself on exit.
+ */
+class KqueueEventSource : public ProcEventSource {
+public:
+    KqueueEventSource() : kq(-1) {}
+    
+    ~KqueueEventSource() override {
+        if (kq >= 0) close(kq);
+    }
+    
+    bool open() override {
+        kq = kqueue();
+        return kq >= 0;
+    }
+    
+    void track(int pid) override {
+        struct kevent change;
+        EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_CLEAR, NOTE_FORK | NOTE_EXEC | NOTE_EXIT, 0, nullptr);
+        // ESRCH just means the process is already gone
+        kevent(kq, &change, 1, nullptr, 0, nullptr);
+    }
+    
+    bool wait(int timeoutMs) override {
+        size_t before = pending();
+        struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+        struct kevent events[256];
+        int n = kevent(kq, nullptr, 0, events, 256, &timeout);
+        while (n > 0) {
+            for (int i = 0; i < n; i++) {
+                int pid = static_cast<int>(events[i].ident);
+                uint32_t flags = events[i].fflags;
+                if (flags & NOTE_FORK) push(FORK, 0, pid);
+                if (flags & NOTE_EXEC) push(EXEC, pid, 0);
+                if (flags & NOTE_EXIT) push(EXIT, pid, 0);
+            }
+            if (n < 256) break;
+            struct timespec zero = { 0, 0 };
+            n = kevent(kq, nullptr, 0, events, 256, &zero);
+        }
+        return pending() > before || overflowed();
+    }
+
+private:
+    int kq;
+};
+#endif
+
+#ifdef _WIN32
+/**
+ * Windows: a real-time ETW session on the Microsoft-Windows-Kernel-Process
+ * provider. ProcessTrace() blocks, so it runs on its own thread and the
+ * callback stages events under a lock; wait() moves them into the ring.
+ * A process start is queued as FORK + EXEC since it always runs a new
+ * image. Needs administrator rights.
+ */
+class EtwEventSource : public ProcEventSource {
+public:
+    EtwEventSource() : session(0), trace(INVALID_PROCESSTRACE_HANDLE), stagedLost(false) {}
+    
+    ~EtwEventSource() override {
+        stop();
+    }
+    
+    bool open() override {
+        ULONG status = StartTraceW(&session, SESSION_NAME, initProperties());
+        if (status == ERROR_ALREADY_EXISTS) {
+            // Left behind by a run that didn't shut down cleanly
+            ControlTraceW(0, SESSION_NAME, initProperties(), EVENT_TRACE_CONTROL_STOP);
+            status = StartTraceW(&session, SESSION_NAME, initProperties());
+        }
+        if (status != ERROR_SUCCESS) {
+            session = 0;
+            return false;
+        }
+        
+        // {22FB2CD6-0E7B-422B-A0C7-2FAD1FD0E716}, WINEVENT_KEYWORD_PROCESS
+        static const GUID kernelProcess =
+            { 0x22fb2cd6, 0x0e7b, 0x422b, { 0xa0, 0xc7, 0x2f, 0xad, 0x1f, 0xd0, 0xe7, 0x16 } };
+        status = EnableTraceEx2(session, &kernelProcess, EVENT_CONTROL_CODE_ENABLE_PROVIDER,
+                                TRACE_LEVEL_INFORMATION, 0x10, 0, 0, nullptr);
+        if (status != ERROR_SUCCESS) {
+            stop();
+            return false;
+        }
+        
+        EVENT_TRACE_LOGFILEW logfile;
+        std::memset(&logfile, 0, sizeof(logfile));
+        logfile.LoggerName = const_cast<LPWSTR>(SESSION_NAME);
+        logfile.ProcessTraceMode = PROCESS_TRACE_MODE_REAL_TIME | PROCESS_TRACE_MODE_EVENT_RECORD;
+        logfile.EventRecordCallback = onEvent;
+        logfile.Context = this;
+        trace = OpenTraceW(&logfile);
+        if (trace == INVALID_PROCESSTRACE_HANDLE) {
+            stop();
+            return false;
+        }
+        consumer = std::thread([this] { ProcessTrace(&trace, 1, nullptr, nullptr); });
+        return true;
+    }
+    
+    bool wait(int timeoutMs) override {
+        std::vector<Event> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                           [this] { return !staged.empty() || stagedLost; });
+            batch.swap(staged);
+            if (stagedLost) {
+                markLost();
+                stagedLost = false;
+            }
+        }
+        for (const Event& event : batch) {
+            push(event.type, event.pid, event.ppid);
+        }
+        return !batch.empty() || overflowed();
+    }
+
+private:
+    static constexpr const wchar_t* SESSION_NAME = L"ProcessTreeVisualizer";
+    static const size_t STAGE_LIMIT = 4096;
+    
+    TRACEHANDLE session;
+    TRACEHANDLE trace;
+    std::vector<unsigned char> properties;
+    std::thread consumer;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<Event> staged;
+    bool stagedLost;
+    
+    EVENT_TRACE_PROPERTIES* initProperties() {
+        properties.assign(sizeof(EVENT_TRACE_PROPERTIES) + (wcslen(SESSION_NAME) + 1) * sizeof(wchar_t), 0);
+        EVENT_TRACE_PROPERTIES* props = reinterpret_cast<EVENT_TRACE_PROPERTIES*>(properties.data());
+        props->Wnode.BufferSize = static_cast<ULONG>(properties.size());
+        props->Wnode.Flags = WNODE_FLAG_TRACED_GUID;
+        props->Wnode.ClientContext = 1;  // QueryPerformanceCounter timestamps
+        props->LogFileMode = EVENT_TRACE_REAL_TIME_MODE;
+        props->LoggerNameOffset = sizeof(EVENT_TRACE_PROPERTIES);
+        return props;
+    }
+    
+    void stop() {
+        if (session) {
+            ControlTraceW(session, nullptr, initProperties(), EVENT_TRACE_CONTROL_STOP);
+            session = 0;
+        }
+        if (trace != INVALID_PROCESSTRACE_HANDLE) {
+            CloseTrace(trace);
+            trace = INVALID_PROCESSTRACE_HANDLE;
+        }
+        if (consumer.joinable()) {
+            consumer.join();
+        }
+    }
+    
+    void stage(Type type, int pid, int ppid) {
+        if (staged.size() >= STAGE_LIMIT) {
+            stagedLost = true;
+            return;
+        }
+        staged.push_back(Event{type, pid, ppid});
+    }
+    
+    /**
+     * ProcessStart (id 1) begins ProcessID, CreateTime, ParentProcessID;
+     * ProcessStop (id 2) begins ProcessID
+     */
+    static void WINAPI onEvent(PEVENT_RECORD record) {
+        EtwEventSource* self = static_cast<EtwEventSource*>(record->UserContext);
+        const unsigned char* data = static_cast<const unsigned char*>(record->UserData);
+        USHORT id = record->EventHeader.EventDescriptor.Id;
+        uint32_t pid = 0, ppid = 0;
+        
+        std::lock_guard<std::mutex> lock(self->mutex);
+        if (id == 1 && record->UserDataLength >= 16) {
+            std::memcpy(&pid, data, sizeof(pid));
+            std::memcpy(&ppid, data + 12, sizeof(ppid));
+            self->stage(FORK, static_cast<int>(pid), static_cast<int>(ppid));
+            self->stage(EXEC, static_cast<int>(pid), 0);
+        } else if (id == 2 && record->UserDataLength >= 4) {
+            std::memcpy(&pid, data, sizeof(pid));
+            self->stage(EXIT, static_cast<int>(pid), 0);
+        } else {
+            return;
+        }
+        self->ready.notify_one();
+    }
+};
+#endif
+
+/**
+ * Owner names, resolved once per UID (SID on Windows) and then kept for
+ * the life of the process. A lookup may go through NSS to LDAP or to a
+ * domain controller, so resolving per process would dominate collection.
+ * Shared by all collection workers; the lock is not held while a lookup
+ * runs, so two workers may occasionally resolve the same owner.
+ */
+class UserNames {
+public:
+    static UserNames& instance() {
+        static UserNames names;
+        return names;
+    }
+    
+#ifndef _WIN32
+    const std::string& lookup(uid_t uid) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = names.find(uid);
+            if (it != names.end()) return it->second;
+        }
+        std::string name = resolve(uid);
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.emplace(uid, std::move(name)).first->second;
+    }
+    
+    /**
+     * UID for a --user argument: a user name, or a numeric UID
+     */
+    static bool findUid(const std::string& user, uid_t& uid) {
+        struct passwd entry;
+        struct passwd* result = nullptr;
+        std::vector<char> buf(4096);
+        while (getpwnam_r(user.c_str(), &entry, buf.data(), buf.size(), &result) == ERANGE) {
+            buf.resize(buf.size() * 2);
+        }
+        if (result) {
+            uid = result->pw_uid;
+            return true;
+        }
+        
+        char* end = nullptr;
+        unsigned long value = std::strtoul(user.c_str(), &end, 10);
+        if (user.empty() || *end) return false;
+        uid = static_cast<uid_t>(value);
+        return true;
+    }
+    
+private:
+    std::mutex mutex;
+    std::unordered_map<uid_t, std::string> names;
+    
+    /**
+     * getpwuid_r, or the number itself for a UID with no account
+     */
+    static std::string resolve(uid_t uid) {
+        if (Stats::enabled) Stats::userLookups.fetch_add(1, std::memory_order_relaxed);
+        struct passwd entry;
+        struct passwd* result = nullptr;
+        std::vector<char> buf(1024);
+        while (getpwuid_r(uid, &entry, buf.data(), buf.size(), &result) == ERANGE) {
+            buf.resize(buf.size() * 2);
+        }
+        return result ? std::string(result->pw_name) : std::to_string(uid);
+    }
+#else
+    const std::string& lookup(PSID sid) {
+        std::string key(static_cast<const char*>(sid), GetLengthSid(sid));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = names.find(key);
+            if (it != names.end()) return it->second;
+        }
+        std::string name = resolve(sid);
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.emplace(std::move(key), std::move(name)).first->second;
+    }
+    
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::string> names;  // keyed by the binary SID
+    
+    static std::string resolve(PSID sid) {
+        if (Stats::enabled) Stats::userLookups.fetch_add(1, std::memory_order_relaxed);
+        WCHAR name[256];
+        WCHAR domain[256];
+        DWORD nameLen = 256;
+        DWORD domainLen = 256;
+        SID_NAME_USE use;
+        if (!LookupAccountSidW(nullptr, sid, name, &nameLen, domain, &domainLen, &use)) {
+            return "";
+        }
+        int size = WideCharToMultiByte(CP_UTF8, 0, name, -1, nullptr, 0, nullptr, nullptr);
+        if (size <= 1) return "";
+        std::string result(static_cast<size_t>(size - 1), '\0');
+        WideCharToMultiByte(CP_UTF8, 0, name, -1, &result[0], size, nullptr, nullptr);
+        return result;
+    }
+#endif
+};
+
+/**
+ * Platform backend behind ProcessTree: how processes are listed and read
+ * and where lifecycle events come from. One implementation per OS, so
+ * collection, subtree, sampling and watch logic is written once against
+ * this interface. Reads must be safe to call from several threads at
+ * once, each with its own StringPool.
+ */
+class ProcessCollector {
+public:
+    virtual ~ProcessCollector() {}
+    
+    /**
+     * Append every live PID; false if the listing failed
+     */
+    virtual bool listPids(std::vector<int>& pids) = 0;
+    
+    /**
+     * Append the PIDs of a process's direct children. Returns false if
+     * the platform can't list children (callers then do a full scan); a
+     * process that is gone has no children.
+     */
+    virtual bool listChildren(int pid, std::vector<int>& children) = 0;
+    
+    /**
+     * Full read of one process, skipping anything not in `fields`
+     * (CollectField bits)
+     */
+    virtual bool readProcessInfo(int pid, ProcessInfo& info, StringPool& strings, uint32_t fields) = 0;
+    
+    /**
+     * Watch-mode refresh of a known process: state, parent, CPU time,
+     * threads and memory. The name is re-interned only if it changed.
+     */
+    virtual bool readVolatile(int pid, ProcessInfo& info, StringPool& strings) = 0;
+    
+    /**
+     * Cheap second-pass read for CPU sampling
+     */
+    virtual bool readCpuTimes(int pid, uint64_t& cpuTimeUs, uint64_t& startTime) = 0;
+    
+    /**
+     * Append every process in one system-wide query, where the platform
+     * has one that beats listing plus per-process reads. Returns false if
+     * not available, and the caller falls back to listPids().
+     */
+    virtual bool collectAll(std::vector<ProcessInfo>&, StringPool&, uint32_t) {
+        return false;
+    }
+    
+    /**
+     * Owner UID of a process from one cheap call, so --user can skip other
+     * users' processes before reading them. False where there is no such
+     * call, or where the answer can't be trusted; the filter then checks
+     * the username after the full read.
+     */
+    virtual bool readOwner(int, uint32_t&) {
+        return false;
+    }
+    
+    /**
+     * Memory and CPU use of a cgroup, given its path as collected into
+     * ProcessInfo::cgroup; false where there is no such group
+     */
+    virtual bool readCgroup(const std::string&, CgroupStats&) {
+        return false;
+    }
+    
+    /**
+     * Set ProcessInfo::cgroup alone (as readProcessInfo does for
+     * FIELD_CGROUP), for records whose other fields came from elsewhere
+     */
+    virtual void readCgroupPath(int, ProcessInfo&, StringPool&) {}
+    
+    /**
+     * Append the thread IDs of a process (for --threads); false if the
+     * process is gone or the platform can't list them
+     */
+    virtual bool listThreads(int, std::vector<uint64_t>&) {
+        return false;
+    }
+    
+    /**
+     * Read one thread's name, state and CPU time
+     */
+    virtual bool readThread(int, uint64_t, ThreadInfo&, StringPool&) {
+        return false;
+    }
+    
+    /**
+     * Lifecycle event source for watch mode, or null if there is none
+     */
+    virtual std::unique_ptr<ProcEventSource> eventSource() {
+        return nullptr;
+    }
+    
+    /**
+     * When the system booted, where start_time is counted from it, so
+     * start times from before a reboot can be told apart; 0 where
+     * start_time is absolute already
+     */
+    virtual uint64_t bootTime() {
+        return 0;
+    }
+};
+
+#ifdef __linux__
+/**
+ * Linux backend: everything comes from the /proc filesystem. The root is
+ * configurable so benchmarks and tests can run against a synthetic tree.
+ */
+class LinuxCollector : public ProcessCollector {
+public:
+    explicit LinuxCollector(const std::string& root = "/proc")
+        : procRoot(root), cgroupRoot("/sys/fs/cgroup"),
+          unifiedCgroups(access((cgroupRoot + "/cgroup.controllers").c_str(), F_OK) == 0) {}
+    
+private:
+    std::string procRoot;
+    std::string cgroupRoot;
+    bool unifiedCgroups;  // cgroup v2 only; otherwise v1 (or hybrid)
+    
+    /**
+     * Read a /proc file into the caller's buffer using raw open/read.
+     * Returns the number of bytes read (NUL-terminated), or -1 on failure.
+     */
+    static ssize_t readProcFile(const char* path, char* buf, size_t size) {
+        std::chrono::steady_clock::time_point start;
+        if (Stats::enabled) {
+            start = std::chrono::steady_clock::now();
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        
+        size_t total = 0;
+        while (total < size - 1) {
+            ssize_t n = read(fd, buf + total, size - 1 - total);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                close(fd);
+                return -1;
+            }
+            if (n == 0) break;
+            total += static_cast<size_t>(n);
+        }
+        close(fd);
+        if (Stats::enabled) {
+            Stats::countRead(total, start);
+        }
+        
+        buf[total] = '\0';
+        return static_cast<ssize_t>(total);
+    }
+    
+    /**
+     * Skip spaces, then parse an unsigned decimal field in place
+     */
+    static unsigned long long parseNumber(const char*& p) {
+        while (*p == ' ' || *p == '\t') p++;
+        unsigned long long value = 0;
+        while (*p >= '0' && *p <= '9') {
+            value = value * 10 + static_cast<unsigned long long>(*p - '0');
+            p++;
+        }
+        return value;
+    }
+    
+    /**
+     * Skip `count` space-separated stat fields
+     */
+    static void skipFields(const char*& p, int count) {
+        for (int i = 0; i < count && *p; i++) {
+            while (*p == ' ') p++;
+            while (*p && *p != ' ') p++;
+        }
+    }
+    
+    /**
+     * Fields of /proc/[pid]/stat that follow the ppid
+     */
+    struct StatTail {
+        uint64_t cpuTimeUs = 0;
+        uint64_t startTime = 0;
+        int numThreads = 0;
+        uint64_t rssKb = 0;
+    };
+    
+    /**
+     * Parse utime/stime (fields 14-15), num_threads (20), starttime (22)
+     * and rss (24) from stat, with `p` positioned just after the ppid
+     */
+    static void parseStatTail(const char* p, StatTail& tail) {
+        static const unsigned long long ticksPerSec = static_cast<unsigned long long>(sysconf(_SC_CLK_TCK));
+        static const unsigned long long pageKb = static_cast<unsigned long long>(sysconf(_SC_PAGESIZE)) / 1024;
+        
+        skipFields(p, 9);
+        unsigned long long ticks = parseNumber(p);
+        ticks += parseNumber(p);
+        skipFields(p, 4);
+        tail.numThreads = static_cast<int>(parseNumber(p));
+        skipFields(p, 1);
+        tail.startTime = parseNumber(p);
+        skipFields(p, 1);
+        tail.rssKb = parseNumber(p) * pageKb;
+        tail.cpuTimeUs = ticks * 1000000ULL / ticksPerSec;
+    }
+    
+    /**
+     * Read /proc/[pid]/stat into buf and locate the name and the fields
+     * after it. Returns false if the file is missing or malformed.
+     */
+    bool readStat(int pid, char* buf, size_t size, const char*& nameStart, const char*& nameEnd) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%d/stat", procRoot.c_str(), pid);
+        return readStatFile(path, buf, size, nameStart, nameEnd);
+    }
+    
+    /**
+     * readStat() for a stat file given by path (a process's or a thread's)
+     */
+    static bool readStatFile(const char* path, char* buf, size_t size, const char*& nameStart, const char*& nameEnd) {
+        ssize_t len = readProcFile(path, buf, size);
+        if (len <= 0) {
+            return false;
+        }
+        
+        // Parse the stat file (format: pid (name) state ppid ...)
+        // The name may itself contain ')' so search from the right.
+        nameStart = static_cast<const char*>(memchr(buf, '(', len));
+        nameEnd = static_cast<const char*>(memrchr(buf, ')', len));
+        return nameStart && nameEnd && nameEnd > nameStart && nameEnd + 2 < buf + len;
+    }
+    
+public:
+    /**
+     * Cheap second-pass read for CPU sampling: only /proc/[pid]/stat
+     */
+    bool readCpuTimes(int pid, uint64_t& cpuTimeUs, uint64_t& startTime) override {
+        char buf[1024];
+        const char* nameStart;
+        const char* nameEnd;
+        if (!readStat(pid, buf, sizeof(buf), nameStart, nameEnd)) {
+            return false;
+        }
+        
+        const char* p = nameEnd + 3;
+        parseNumber(p);
+        StatTail tail;
+        parseStatTail(p, tail);
+        cpuTimeUs = tail.cpuTimeUs;
+        startTime = tail.startTime;
+        return true;
+    }
+    
+    /**
+     * Watch-mode refresh of a known process: everything volatile (state,
+     * ppid, CPU time, threads, RSS) comes from the single stat read. The
+     * name is re-interned only if it changed (exec).
+     */
+    bool readVolatile(int pid, ProcessInfo& info, StringPool& strings) override {
+        char buf[1024];
+        const char* nameStart;
+        const char* nameEnd;
+        if (!readStat(pid, buf, sizeof(buf), nameStart, nameEnd)) {
+            return false;
+        }
+        
+        size_t nameLen = nameEnd - nameStart - 1;
+        const char* current = strings.get(info.name);
+        if (strncmp(current, nameStart + 1, nameLen) != 0 || current[nameLen] != '\0') {
+            info.name = strings.intern(nameStart + 1, nameLen);
+        }
+        
+        const char* p = nameEnd + 2;
+        info.status = static_cast<ProcessState>(*p++);
+        info.ppid = static_cast<int>(parseNumber(p));
+        StatTail tail;
+        parseStatTail(p, tail);
+        info.cpu_time_us = tail.cpuTimeUs;
+        info.start_time = tail.startTime;
+        info.num_threads = tail.numThreads;
+        info.memory_kb = tail.rssKb;
+        return true;
+    }
+    
+    bool readProcessInfo(int pid, ProcessInfo& info, StringPool& strings, uint32_t fields) override {
+        info.pid = pid;
+        
+        // Reusable stack buffers: no heap allocation per process
+        char path[PATH_MAX];
+        char buf[4096];
+        
+        // Read /proc/[pid]/stat for basic process info
+        const char* nameStart;
+        const char* nameEnd;
+        if (!readStat(pid, buf, sizeof(buf), nameStart, nameEnd)) {
+            return false;
+        }
+        info.name = strings.intern(nameStart + 1, nameEnd - nameStart - 1);
+        
+        const char* p = nameEnd + 2;
+        info.status = static_cast<ProcessState>(*p++);
+        info.ppid = static_cast<int>(parseNumber(p));
+        StatTail tail;
+        parseStatTail(p, tail);
+        info.cpu_time_us = tail.cpuTimeUs;
+        info.start_time = tail.startTime;
+        info.num_threads = tail.numThreads;
+        
+        if (fields & FIELD_CMDLINE) {
+            snprintf(path, sizeof(path), "%s/%d/cmdline", procRoot.c_str(), pid);
+            ssize_t len = readProcFile(path, buf, sizeof(buf));
+            // Arguments are NUL-separated; kernel threads have none
+            while (len > 0 && buf[len - 1] == '\0') len--;
+            if (len > 0) {
+                std::replace(buf, buf + len, '\0', ' ');
+                info.cmdline = strings.intern(buf, static_cast<size_t>(len));
+            }
+        }
+        
+        // /proc/[pid]/status has VmRSS and the owner: the real UID, the
+        // only source of usernames, so they don't depend on the columns
+        bool haveUid = false;
+        uint32_t uid = 0;
+        if (fields & (FIELD_MEMORY | FIELD_USER)) {
+            snprintf(path, sizeof(path), "%s/%d/status", procRoot.c_str(), pid);
+            ssize_t len = readProcFile(path, buf, sizeof(buf));
+            if (len > 0) {
+                const char* line = buf;
+                const char* end = buf + len;
+                while (line < end) {
+                    if (strncmp(line, "VmRSS:", 6) == 0) {
+                        p = line + 6;
+                        info.memory_kb = parseNumber(p);
+                        break;
+                    } else if (strncmp(line, "Threads:", 8) == 0) {
+                        // Past VmRSS: no memory map (kernel thread)
+                        break;
+                    } else if (strncmp(line, "Uid:", 4) == 0) {
+                        // Real UID, then effective, saved and filesystem
+                        p = line + 4;
+                        uid = static_cast<uint32_t>(parseNumber(p));
+                        haveUid = true;
+                        if (!(fields & FIELD_MEMORY)) break;
+                    }
+                    
+                    const char* next = static_cast<const char*>(memchr(line, '\n', end - line));
+                    if (!next) break;
+                    line = next + 1;
+                }
+            }
+        }
+        
+        if ((fields & FIELD_USER) && haveUid) {
+            info.username = strings.intern(UserNames::instance().lookup(uid));
+        }
+        if (fields & FIELD_CGROUP) {
+            readCgroupPath(pid, info, strings);
+        }
+        return true;
+    }
+    
+    /**
+     * /proc/[pid]/cgroup has one "id:controllers:path" line per hierarchy.
+     * With cgroup v2 the unified "0::" line is the group; on v1 and hybrid
+     * hosts that one is usually just "/", so the memory controller's path
+     * is used, since memory is what the group node reports.
+     */
+    void readCgroupPath(int pid, ProcessInfo& info, StringPool& strings) override {
+        char path[PATH_MAX];
+        char buf[4096];
+        snprintf(path, sizeof(path), "%s/%d/cgroup", procRoot.c_str(), pid);
+        ssize_t len = readProcFile(path, buf, sizeof(buf));
+        if (len <= 0) return;
+        
+        const char* found = nullptr;
+        size_t foundLen = 0;
+        const char* line = buf;
+        const char* end = buf + len;
+        while (line < end) {
+            const char* next = static_cast<const char*>(memchr(line, '\n', end - line));
+            const char* lineEnd = next ? next : end;
+            const char* controllers = static_cast<const char*>(memchr(line, ':', lineEnd - line));
+            const char* group = controllers ? static_cast<const char*>(
+                memchr(controllers + 1, ':', lineEnd - controllers - 1)) : nullptr;
+            if (group) {
+                group++;
+                std::string_view names(controllers + 1, group - controllers - 2);
+                bool unifiedLine = names.empty();
+                bool memoryLine = false;
+                for (size_t pos = 0; pos <= names.size();) {
+                    size_t comma = names.find(',', pos);
+                    if (comma == std::string_view::npos) comma = names.size();
+                    if (names.substr(pos, comma - pos) == "memory") memoryLine = true;
+                    pos = comma + 1;
+                }
+                if (unifiedCgroups ? unifiedLine : memoryLine || (unifiedLine && !found)) {
+                    found = group;
+                    foundLen = static_cast<size_t>(lineEnd - group);
+                }
+            }
+            if (!next) break;
+            line = next + 1;
+        }
+        if (found) {
+            info.cgroup = strings.intern(found, foundLen);
+        }
+    }
+    
+    /**
+     * Read a number from a one-value cgroup file
+     */
+    static bool readCgroupNumber(const std::string& path, uint64_t& value) {
+        char buf[64];
+        if (readProcFile(path.c_str(), buf, sizeof(buf)) <= 0) return false;
+        const char* p = buf;
+        if (*p < '0' || *p > '9') return false;  // "max"
+        value = parseNumber(p);
+        return true;
+    }
+    
+    /**
+     * cgroup v2: memory.current and usage_usec from cpu.stat. v1: the
+     * memory and cpuacct controllers' usage files, for the same path.
+     */
+    bool readCgroup(const std::string& group, CgroupStats& stats) override {
+        if (unifiedCgroups) {
+            std::string dir = cgroupRoot + group;
+            stats.hasMemory = readCgroupNumber(dir + "/memory.current", stats.memory_bytes);
+            
+            char buf[1024];
+            if (readProcFile((dir + "/cpu.stat").c_str(), buf, sizeof(buf)) > 0 &&
+                strncmp(buf, "usage_usec", 10) == 0) {
+                const char* p = buf + 10;
+                stats.cpu_usage_us = parseNumber(p);
+                stats.hasCpu = true;
+            }
+        } else {
+            stats.hasMemory = readCgroupNumber(cgroupRoot + "/memory" + group + "/memory.usage_in_bytes",
+                                               stats.memory_bytes);
+            uint64_t ns = 0;
+            stats.hasCpu = readCgroupNumber(cgroupRoot + "/cpuacct" + group + "/cpuacct.usage", ns);
+            stats.cpu_usage_us = ns / 1000;
+        }
+        return stats.hasMemory || stats.hasCpu;
+    }
+    
+    /**
+     * start_time is in clock ticks since boot; "btime" in /proc/stat is
+     * the boot time in seconds since the epoch
+     */
+    uint64_t bootTime() override {
+        char buf[8192];
+        if (readProcFile((procRoot + "/stat").c_str(), buf, sizeof(buf)) <= 0) return 0;
+        const char* line = strstr(buf, "\nbtime ");
+        if (!line) return 0;
+        const char* p = line + 7;
+        return parseNumber(p);
+    }
+    
+    /**
+     * The owner of /proc/[pid], from one stat() and no file read. That is
+     * the effective UID, and root for any process that isn't dumpable, so
+     * a root owner is reported as unknown: setuid and non-dumpable
+     * processes get the full read, whose real UID decides.
+     */
+    bool readOwner(int pid, uint32_t& uid) override {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%d", procRoot.c_str(), pid);
+        struct stat st;
+        if (stat(path, &st) != 0 || st.st_uid == 0) {
+            return false;
+        }
+        uid = st.st_uid;
+        return true;
+    }
+    
+    bool listPids(std::vector<int>& pids) override {
+        DIR* procDir = opendir(procRoot.c_str());
+        if (!procDir) {
+            std::cerr << Color::RED << "Error: Cannot open " << procRoot << " directory" << Color::RESET << std::endl;
+            return false;
+        }
+        
+        struct dirent* entry;
+        while ((entry = readdir(procDir)) != nullptr) {
+            if (Stats::enabled) Stats::dirEntries.fetch_add(1, std::memory_order_relaxed);
+            // Check if directory name is a number (PID)
+            if (entry->d_type == DT_DIR) {
+                int pid = atoi(entry->d_name);
+                if (pid > 0) {
+                    pids.push_back(pid);
+                }
+            }
+        }
+        closedir(procDir);
+        return true;
+    }
+    
+    /**
+     * Append the PIDs of a process's direct children, read from
+     * /proc/[pid]/task/[tid]/children for each of its threads. Returns
+     * false if the kernel does not provide these files
+     * (CONFIG_PROC_CHILDREN); a process that is gone has no children.
+     */
+    bool listChildren(int pid, std::vector<int>& children) override {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%d/task", procRoot.c_str(), pid);
+        DIR* taskDir = opendir(path);
+        if (!taskDir) {
+            return errno == ENOENT;
+        }
+        
+        bool found = false;
+        std::vector<char> buf(4096);
+        struct dirent* entry;
+        while ((entry = readdir(taskDir)) != nullptr) {
+            if (Stats::enabled) Stats::dirEntries.fetch_add(1, std::memory_order_relaxed);
+            int tid = atoi(entry->d_name);
+            if (tid <= 0) continue;
+            
+            snprintf(path, sizeof(path), "%s/%d/task/%d/children", procRoot.c_str(), pid, tid);
+            ssize_t len;
+            // Grow until the whole list fits; it can be long for big fan-outs
+            while ((len = readProcFile(path, buf.data(), buf.size())) >= static_cast<ssize_t>(buf.size()) - 1) {
+                buf.resize(buf.size() * 2);
+            }
+            if (len < 0) continue;
+            found = true;
+            
+            const char* p = buf.data();
+            const char* end = p + len;
+            while (p < end) {
+                int child = static_cast<int>(parseNumber(p));
+                if (child > 0) children.push_back(child);
+                while (p < end && (*p < '0' || *p > '9')) p++;
+            }
+        }
+        closedir(taskDir);
+        return found;
+    }
+    
+    /**
+     * Thread IDs are the numeric entries of /proc/[pid]/task
+     */
+    bool listThreads(int pid, std::vector<uint64_t>& tids) override {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%d/task", procRoot.c_str(), pid);
+        DIR* taskDir = opendir(path);
+        if (!taskDir) {
+            return false;
+        }
+        
+        struct dirent* entry;
+        while ((entry = readdir(taskDir)) != nullptr) {
+            if (Stats::enabled) Stats::dirEntries.fetch_add(1, std::memory_order_relaxed);
+            int tid = atoi(entry->d_name);
+            if (tid > 0) tids.push_back(static_cast<uint64_t>(tid));
+        }
+        closedir(taskDir);
+        return true;
+    }
+    
+    /**
+     * A thread's stat has the same layout as its process's, so it goes
+     * through the same stack buffer and in-place parser
+     */
+    bool readThread(int pid, uint64_t tid, ThreadInfo& info, StringPool& strings) override {
+        char path[PATH_MAX];
+        char buf[1024];
+        snprintf(path, sizeof(path), "%s/%d/task/%llu/stat", procRoot.c_str(), pid,
+                 static_cast<unsigned long long>(tid));
+        const char* nameStart;
+        const char* nameEnd;
+        if (!readStatFile(path, buf, sizeof(buf), nameStart, nameEnd)) {
+            return false;
+        }
+        
+        info.tid = tid;
+        info.name = strings.intern(nameStart + 1, nameEnd - nameStart - 1);
+        const char* p = nameEnd + 2;
+        info.status = static_cast<ProcessState>(*p++);
+        parseNumber(p);
+        StatTail tail;
+        parseStatTail(p, tail);
+        info.cpu_time_us = tail.cpuTimeUs;
+        return true;
+    }
+    
+    /**
+     * Kernel events describe the live system, so a synthetic root has none
+     */
+    std::unique_ptr<ProcEventSource> eventSource() override {
+        if (procRoot != "/proc") return nullptr;
+        return std::unique_ptr<ProcEventSource>(new NetlinkEventSource());
+    }
+};
+#endif
+
+#ifdef __APPLE__
+/**
+ * macOS backend: libproc APIs
+ */
+class MacCollector : public ProcessCollector {
+public:
+    bool readProcessInfo(int pid, ProcessInfo& info, StringPool& strings, uint32_t fields) override {
+        info.pid = pid;
+        
+        struct proc_bsdinfo proc;
+        if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &proc, sizeof(proc)) <= 0) {
+            return false;
+        }
+        
+        info.ppid = proc.pbi_ppid;
+        info.start_time = proc.pbi_start_tvsec * 1000000ULL + proc.pbi_start_tvusec;
+        info.name = strings.intern(proc.pbi_comm, strnlen(proc.pbi_comm, sizeof(proc.pbi_comm)));
+        info.status = bsdState(proc.pbi_status);
+        
+        // Get task info for memory, threads and CPU time
+        struct proc_taskinfo task;
+        if ((fields & (FIELD_MEMORY | FIELD_THREADS | FIELD_CPU)) &&
+            proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &task, sizeof(task)) > 0) {
+            info.memory_kb = task.pti_resident_size / 1024;
+            info.num_threads = task.pti_threadnum;
+            info.cpu_time_us = machToMicros(task.pti_total_user + task.pti_total_system);
+        }
+        
+        if (fields & FIELD_CMDLINE) {
+            readCommandLine(pid, info, strings);
+        }
+        if (fields & FIELD_USER) {
+            info.username = strings.intern(UserNames::instance().lookup(proc.pbi_uid));
+        }
+        
+        return true;
+    }
+    
+    /**
+     * Owner UID from the short BSD info, the cheapest per-process call
+     */
+    bool readOwner(int pid, uint32_t& uid) override {
+        struct proc_bsdshortinfo info;
+        if (proc_pidinfo(pid, PROC_PIDT_SHORTBSDINFO, 0, &info, sizeof(info)) <= 0) {
+            return false;
+        }
+        uid = info.pbsi_uid;
+        return true;
+    }
+    
+    /**
+     * Arguments from KERN_PROCARGS2: argc, the executable path, padding,
+     * then argc NUL-terminated arguments (followed by the environment)
+     */
+    static void readCommandLine(int pid, ProcessInfo& info, StringPool& strings) {
+        static const size_t argMax = [] {
+            int value = 0;
+            size_t size = sizeof(value);
+            int mib[2] = {CTL_KERN, KERN_ARGMAX};
+            return sysctl(mib, 2, &value, &size, nullptr, 0) == 0 && value > 0 ? static_cast<size_t>(value) : 0;
+        }();
+        static thread_local std::vector<char> buf;
+        static thread_local std::string cmdline;
+        if (argMax == 0) return;
+        buf.resize(argMax);
+        
+        int mib[3] = {CTL_KERN, KERN_PROCARGS2, pid};
+        size_t size = buf.size();
+        if (sysctl(mib, 3, buf.data(), &size, nullptr, 0) != 0 || size < sizeof(int)) return;
+        
+        int argc;
+        std::memcpy(&argc, buf.data(), sizeof(argc));
+        const char* p = buf.data() + sizeof(int);
+        const char* end = buf.data() + size;
+        p = static_cast<const char*>(memchr(p, '\0', end - p));
+        if (!p) return;
+        while (p < end && *p == '\0') p++;
+        
+        cmdline.clear();
+        for (int i = 0; i < argc && p < end; i++) {
+            size_t len = strnlen(p, end - p);
+            if (!cmdline.empty()) cmdline += ' ';
+            cmdline.append(p, len);
+            p += len + 1;
+        }
+        info.cmdline = strings.intern(cmdline);
+    }
+    
+    /**
+     * Map a BSD p_stat value (pbi_status) to our state codes
+     */
+    static ProcessState bsdState(uint32_t stat) {
+        switch (stat) {
+            case SRUN:  return STATE_RUNNING;
+            case SSTOP: return STATE_STOPPED;
+            case SZOMB: return STATE_ZOMBIE;
+            default:    return STATE_SLEEPING;
+        }
+    }
+    
+    /**
+     * Convert mach absolute time units (used by pti_total_*) to microseconds
+     */
+    static uint64_t machToMicros(uint64_t ticks) {
+        static mach_timebase_info_data_t timebase = [] {
+            mach_timebase_info_data_t tb;
+            mach_timebase_info(&tb);
+            return tb;
+        }();
+        return ticks * timebase.numer / timebase.denom / 1000;
+    }
+    
+    /**
+     * Cheap second-pass read for CPU sampling: one PROC_PIDTASKALLINFO call
+     */
+    bool readCpuTimes(int pid, uint64_t& cpuTimeUs, uint64_t& startTime) override {
+        struct proc_taskallinfo all;
+        if (proc_pidinfo(pid, PROC_PIDTASKALLINFO, 0, &all, sizeof(all)) <= 0) {
+            return false;
+        }
+        startTime = all.pbsd.pbi_start_tvsec * 1000000ULL + all.pbsd.pbi_start_tvusec;
+        cpuTimeUs = machToMicros(all.ptinfo.pti_total_user + all.ptinfo.pti_total_system);
+        return true;
+    }
+    
+    /**
+     * Watch-mode refresh of a known process: one PROC_PIDTASKALLINFO call
+     */
+    bool readVolatile(int pid, ProcessInfo& info, StringPool& strings) override {
+        struct proc_taskallinfo all;
+        if (proc_pidinfo(pid, PROC_PIDTASKALLINFO, 0, &all, sizeof(all)) <= 0) {
+            return false;
+        }
+        
+        size_t nameLen = strnlen(all.pbsd.pbi_comm, sizeof(all.pbsd.pbi_comm));
+        if (strncmp(strings.get(info.name), all.pbsd.pbi_comm, nameLen) != 0) {
+            info.name = strings.intern(all.pbsd.pbi_comm, nameLen);
+        }
+        info.ppid = all.pbsd.pbi_ppid;
+        info.status = bsdState(all.pbsd.pbi_status);
+        info.start_time = all.pbsd.pbi_start_tvsec * 1000000ULL + all.pbsd.pbi_start_tvusec;
+        info.memory_kb = all.ptinfo.pti_resident_size / 1024;
+        info.num_threads = all.ptinfo.pti_threadnum;
+        info.cpu_time_us = machToMicros(all.ptinfo.pti_total_user + all.ptinfo.pti_total_system);
+        return true;
+    }
+    
+    /**
+     * Append the PIDs of a process's direct children (proc_listchildpids)
+     */
+    bool listChildren(int pid, std::vector<int>& children) override {
+        int count = proc_listchildpids(pid, nullptr, 0);
+        if (count < 0) {
+            return false;
+        }
+        
+        std::vector<int> buf(static_cast<size_t>(count) + 16);
+        count = proc_listchildpids(pid, buf.data(), static_cast<int>(buf.size() * sizeof(int)));
+        if (count < 0) {
+            return false;
+        }
+        // Older releases return a byte count rather than an entry count
+        if (static_cast<size_t>(count) > buf.size()) {
+            count /= static_cast<int>(sizeof(int));
+        }
+        buf.resize(std::min(buf.size(), static_cast<size_t>(count)));
+        for (int child : buf) {
+            if (child > 0) children.push_back(child);
+        }
+        return true;
+    }
+    
+    bool listPids(std::vector<int>& pids) override {
+        int numPids = proc_listpids(PROC_ALL_PIDS, 0, nullptr, 0);
+        pids.resize(numPids * 2);
+        
+        numPids = proc_listpids(PROC_ALL_PIDS, 0, pids.data(), pids.size() * sizeof(int));
         if (numPids <= 0) {
             std::cerr << Color::RED << "Error getting process list" << Color::RESET << std::endl;
+            return false;
+        }
+        
+        pids.resize(numPids);
+        pids.erase(std::remove(pids.begin(), pids.end(), 0), pids.end());
+        return true;
+    }
+    
+    /**
+     * Thread handles from PROC_PIDLISTTHREADS; these stand in for TIDs
+     */
+    bool listThreads(int pid, std::vector<uint64_t>& tids) override {
+        struct proc_taskinfo task;
+        if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &task, sizeof(task)) <= 0) {
+            return false;
+        }
+        
+        // Room for threads started since the count was taken
+        std::vector<uint64_t> handles(static_cast<size_t>(task.pti_threadnum) + 16);
+        int bytes = proc_pidinfo(pid, PROC_PIDLISTTHREADS, 0, handles.data(),
+                                 static_cast<int>(handles.size() * sizeof(uint64_t)));
+        if (bytes <= 0) {
+            return false;
+        }
+        handles.resize(static_cast<size_t>(bytes) / sizeof(uint64_t));
+        tids.insert(tids.end(), handles.begin(), handles.end());
+        return true;
+    }
+    
+    bool readThread(int pid, uint64_t tid, ThreadInfo& info, StringPool& strings) override {
+        struct proc_threadinfo thread;
+        if (proc_pidinfo(pid, PROC_PIDTHREADINFO, tid, &thread, sizeof(thread)) <= 0) {
+            return false;
+        }
+        
+        info.tid = tid;
+        info.name = strings.intern(thread.pth_name, strnlen(thread.pth_name, sizeof(thread.pth_name)));
+        switch (thread.pth_run_state) {
+            case TH_STATE_RUNNING:         info.status = STATE_RUNNING; break;
+            case TH_STATE_STOPPED:         info.status = STATE_STOPPED; break;
+            case TH_STATE_UNINTERRUPTIBLE: info.status = STATE_DISK_SLEEP; break;
+            default:                       info.status = STATE_SLEEPING; break;
+        }
+        // pth_*_time are in nanoseconds
+        info.cpu_time_us = (thread.pth_user_time + thread.pth_system_time) / 1000;
+        return true;
+    }
+    
+    std::unique_ptr<ProcEventSource> eventSource() override {
+        return std::unique_ptr<ProcEventSource>(new KqueueEventSource());
+    }
+};
+#endif
+
+#ifdef _WIN32
+/**
+ * Windows backend: NtQuerySystemInformation for whole-system collection,
+ * with a CreateToolhelp32Snapshot fallback, and per-process handles for
+ * single reads
+ */
+class WindowsCollector : public ProcessCollector {
+private:
+    static std::string wideToString(const WCHAR* wstr) {
+        if (!wstr) return "";
+        int size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, nullptr, 0, nullptr, nullptr);
+        std::string str(size, 0);
+        WideCharToMultiByte(CP_UTF8, 0, wstr, -1, &str[0], size, nullptr, nullptr);
+        return str;
+    }
+    
+    static uint64_t fileTimeToU64(const FILETIME& ft) {
+        return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+    
+    /**
+     * Leading part of PROCESS_BASIC_INFORMATION, for the parent PID
+     */
+    struct ProcessBasicEntry {
+        LONG ExitStatus;
+        PVOID PebBaseAddress;
+        ULONG_PTR AffinityMask;
+        LONG BasePriority;
+        ULONG_PTR UniqueProcessId;
+        ULONG_PTR InheritedFromUniqueProcessId;
+    };
+    
+    typedef LONG (WINAPI *NtQueryInformationProcessFn)(HANDLE, ULONG, PVOID, ULONG, PULONG);
+    
+    static NtQueryInformationProcessFn ntQueryInformationProcess() {
+        static NtQueryInformationProcessFn query = reinterpret_cast<NtQueryInformationProcessFn>(
+            GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtQueryInformationProcess"));
+        return query;
+    }
+    
+    /**
+     * Parent PID via NtQueryInformationProcess(ProcessBasicInformation)
+     */
+    static bool queryParent(HANDLE hProcess, int32_t& ppid) {
+        NtQueryInformationProcessFn query = ntQueryInformationProcess();
+        ProcessBasicEntry basic;
+        if (!query || query(hProcess, 0, &basic, sizeof(basic), nullptr) < 0) {
+            return false;
+        }
+        ppid = static_cast<int32_t>(basic.InheritedFromUniqueProcessId);
+        return true;
+    }
+    
+    /**
+     * UNICODE_STRING header returned ahead of the text
+     */
+    struct CountedString {
+        USHORT Length;
+        USHORT MaximumLength;
+        PWSTR Buffer;
+    };
+    
+    /**
+     * Command line via NtQueryInformationProcess(ProcessCommandLineInformation),
+     * available from Windows 8.1; needs only limited query rights
+     */
+    static void queryCommandLine(HANDLE hProcess, ProcessInfo& info, StringPool& strings) {
+        const ULONG ProcessCommandLineInformation = 60;
+        NtQueryInformationProcessFn query = ntQueryInformationProcess();
+        ULONG needed = 0;
+        if (!query) return;
+        query(hProcess, ProcessCommandLineInformation, nullptr, 0, &needed);
+        if (needed <= sizeof(CountedString)) return;
+        
+        std::vector<unsigned char> buf(needed);
+        if (query(hProcess, ProcessCommandLineInformation, buf.data(), needed, &needed) < 0) return;
+        const CountedString* text = reinterpret_cast<const CountedString*>(buf.data());
+        if (!text->Buffer || text->Length == 0) return;
+        std::wstring line(text->Buffer, text->Length / sizeof(WCHAR));
+        info.cmdline = strings.intern(wideToString(line.c_str()).c_str());
+    }
+    
+    /**
+     * Owner from the process token's user SID; the SID-to-name lookup is
+     * cached
+     */
+    static void queryUser(HANDLE hProcess, ProcessInfo& info, StringPool& strings) {
+        HANDLE token;
+        if (!OpenProcessToken(hProcess, TOKEN_QUERY, &token)) return;
+        
+        unsigned char buf[256];
+        DWORD needed = 0;
+        if (GetTokenInformation(token, TokenUser, buf, sizeof(buf), &needed)) {
+            const TOKEN_USER* user = reinterpret_cast<const TOKEN_USER*>(buf);
+            info.username = strings.intern(UserNames::instance().lookup(user->User.Sid));
+        }
+        CloseHandle(token);
+    }
+    
+    /**
+     * Command line and owner, where asked for, from one process handle
+     */
+    static void readHandleStrings(DWORD pid, ProcessInfo& info, StringPool& strings, uint32_t fields) {
+        if (!(fields & (FIELD_CMDLINE | FIELD_USER))) return;
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+        if (hProcess) {
+            if (fields & FIELD_CMDLINE) queryCommandLine(hProcess, info, strings);
+            if (fields & FIELD_USER) queryUser(hProcess, info, strings);
+            CloseHandle(hProcess);
+        }
+    }
+    
+public:
+    /**
+     * Cheap second-pass read for CPU sampling: GetProcessTimes only
+     */
+    bool readCpuTimes(int pid, uint64_t& cpuTimeUs, uint64_t& startTime) override {
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid));
+        if (!hProcess) {
+            return false;
+        }
+        
+        FILETIME createTime, exitTime, kernelTime, userTime;
+        bool ok = GetProcessTimes(hProcess, &createTime, &exitTime, &kernelTime, &userTime) != 0;
+        if (ok) {
+            // FILETIME is in 100 ns units
+            startTime = fileTimeToU64(createTime);
+            cpuTimeUs = (fileTimeToU64(kernelTime) + fileTimeToU64(userTime)) / 10;
+        }
+        CloseHandle(hProcess);
+        return ok;
+    }
+    
+    /**
+     * Single-process read (event updates, subtree and watch paths): image
+     * name, parent, memory and CPU times from one process handle. The
+     * thread count is only available from the bulk query.
+     */
+    bool readProcessInfo(int pid, ProcessInfo& info, StringPool& strings, uint32_t fields) override {
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid));
+        if (!hProcess) {
+            return false;
+        }
+        
+        info.pid = pid;
+        WCHAR image[MAX_PATH];
+        DWORD size = MAX_PATH;
+        bool ok = queryParent(hProcess, info.ppid) &&
+                  QueryFullProcessImageNameW(hProcess, 0, image, &size) != 0;
+        if (ok) {
+            const WCHAR* base = image;
+            for (const WCHAR* c = image; *c; c++) {
+                if (*c == L'\\') base = c + 1;
+            }
+            info.name = strings.intern(wideToString(base).c_str());
+            if (fields & FIELD_CMDLINE) {
+                queryCommandLine(hProcess, info, strings);
+            }
+            if (fields & FIELD_USER) {
+                queryUser(hProcess, info, strings);
+            }
+        }
+        CloseHandle(hProcess);
+        
+        if (ok && (fields & (FIELD_MEMORY | FIELD_CPU))) {
+            readHandleInfo(static_cast<DWORD>(pid), info);
+        }
+        return ok;
+    }
+    
+    /**
+     * Watch-mode refresh of a known process: name and parent don't change
+     * on Windows, so only memory and CPU times are re-read
+     */
+    bool readVolatile(int pid, ProcessInfo& info, StringPool&) override {
+        return readHandleInfo(static_cast<DWORD>(pid), info);
+    }
+    
+    bool listPids(std::vector<int>& pids) override {
+        std::vector<DWORD> ids(4096);
+        DWORD bytes = 0;
+        for (;;) {
+            if (!EnumProcesses(ids.data(), static_cast<DWORD>(ids.size() * sizeof(DWORD)), &bytes)) {
+                std::cerr << Color::RED << "Error getting process list" << Color::RESET << std::endl;
+                return false;
+            }
+            if (bytes < ids.size() * sizeof(DWORD)) break;
+            ids.resize(ids.size() * 2);
+        }
+        for (size_t i = 0; i < bytes / sizeof(DWORD); i++) {
+            pids.push_back(static_cast<int>(ids[i]));
+        }
+        return true;
+    }
+    
+    /**
+     * There is no per-process child listing; subtree collection falls
+     * back to the bulk query
+     */
+    bool listChildren(int, std::vector<int>&) override {
+        return false;
+    }
+    
+    bool collectAll(std::vector<ProcessInfo>& records, StringPool& strings, uint32_t fields) override {
+        return collectFromSystemInformation(records, strings, fields) ||
+               collectFromToolhelp(records, strings, fields);
+    }
+    
+    /**
+     * Threads come from a Toolhelp thread snapshot, which covers the whole
+     * system; --threads only asks for a few processes
+     */
+    bool listThreads(int pid, std::vector<uint64_t>& tids) override {
+        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+        if (hSnapshot == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        
+        THREADENTRY32 te32;
+        te32.dwSize = sizeof(te32);
+        bool found = false;
+        if (Thread32First(hSnapshot, &te32)) {
+            do {
+                if (te32.th32OwnerProcessID == static_cast<DWORD>(pid)) {
+                    tids.push_back(te32.th32ThreadID);
+                    found = true;
+                }
+            } while (Thread32Next(hSnapshot, &te32));
+        }
+        CloseHandle(hSnapshot);
+        return found;
+    }
+    
+    /**
+     * CPU times from a thread handle, and the name from
+     * GetThreadDescription where the system has it (Windows 10 1607+).
+     * There is no cheap per-thread state, so it is left unknown.
+     */
+    bool readThread(int, uint64_t tid, ThreadInfo& info, StringPool& strings) override {
+        typedef HRESULT (WINAPI *GetThreadDescriptionFn)(HANDLE, PWSTR*);
+        static GetThreadDescriptionFn describe = reinterpret_cast<GetThreadDescriptionFn>(
+            GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "GetThreadDescription"));
+        
+        HANDLE hThread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(tid));
+        if (!hThread) {
+            return false;
+        }
+        
+        FILETIME createTime, exitTime, kernelTime, userTime;
+        bool ok = GetThreadTimes(hThread, &createTime, &exitTime, &kernelTime, &userTime) != 0;
+        if (ok) {
+            info.tid = tid;
+            info.status = STATE_UNKNOWN;
+            info.cpu_time_us = (fileTimeToU64(kernelTime) + fileTimeToU64(userTime)) / 10;
+            PWSTR description = nullptr;
+            if (describe && SUCCEEDED(describe(hThread, &description)) && description) {
+                info.name = strings.intern(wideToString(description).c_str());
+                LocalFree(description);
+            }
+        }
+        CloseHandle(hThread);
+        return ok;
+    }
+    
+    std::unique_ptr<ProcEventSource> eventSource() override {
+        return std::unique_ptr<ProcEventSource>(new EtwEventSource());
+    }
+    
+private:
+    /**
+     * Memory and CPU times from a process handle. Fails for processes
+     * that have exited, even while someone still holds a handle.
+     */
+    static bool readHandleInfo(DWORD pid, ProcessInfo& info) {
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid);
+        if (!hProcess) {
+            return false;
+        }
+        
+        DWORD exitCode = 0;
+        if (GetExitCodeProcess(hProcess, &exitCode) && exitCode != STILL_ACTIVE) {
+            CloseHandle(hProcess);
+            return false;
+        }
+        
+        // Get memory info
+        PROCESS_MEMORY_COUNTERS pmc;
+        if (GetProcessMemoryInfo(hProcess, &pmc, sizeof(pmc))) {
+            info.memory_kb = pmc.WorkingSetSize / 1024;
+        }
+        
+        // Get CPU times
+        FILETIME createTime, exitTime, kernelTime, userTime;
+        if (GetProcessTimes(hProcess, &createTime, &exitTime, &kernelTime, &userTime)) {
+            info.start_time = fileTimeToU64(createTime);
+            info.cpu_time_us = (fileTimeToU64(kernelTime) + fileTimeToU64(userTime)) / 10;
+        }
+        
+        CloseHandle(hProcess);
+        return true;
+    }
+    
+    /**
+     * Leading part of the native SYSTEM_PROCESS_INFORMATION record; the
+     * winternl.h version hides most of these fields as Reserved.
+     */
+    struct SystemProcessEntry {
+        ULONG NextEntryOffset;
+        ULONG NumberOfThreads;
+        LARGE_INTEGER WorkingSetPrivateSize;
+        ULONG HardFaultCount;
+        ULONG NumberOfThreadsHighWatermark;
+        ULONGLONG CycleTime;
+        LARGE_INTEGER CreateTime;
+        LARGE_INTEGER UserTime;
+        LARGE_INTEGER KernelTime;
+        USHORT ImageNameLength;
+        USHORT ImageNameMaximumLength;
+        PWSTR ImageNameBuffer;
+        LONG BasePriority;
+        HANDLE UniqueProcessId;
+        HANDLE InheritedFromUniqueProcessId;
+        ULONG HandleCount;
+        ULONG SessionId;
+        ULONG_PTR UniqueProcessKey;
+        SIZE_T PeakVirtualSize;
+        SIZE_T VirtualSize;
+        ULONG PageFaultCount;
+        SIZE_T PeakWorkingSetSize;
+        SIZE_T WorkingSetSize;
+    };
+    
+    /**
+     * One NtQuerySystemInformation(SystemProcessInformation) call returns
+     * every process with its threads, working set and CPU times, so the
+     * whole table is filled in a single pass with no per-process handles.
+     * Returns false if the call is unavailable so the caller can fall back.
+     */
+    static bool collectFromSystemInformation(std::vector<ProcessInfo>& records, StringPool& strings,
+                                             uint32_t fields) {
+        typedef LONG (WINAPI *NtQuerySystemInformationFn)(ULONG, PVOID, ULONG, PULONG);
+        static NtQuerySystemInformationFn query = reinterpret_cast<NtQuerySystemInformationFn>(
+            GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtQuerySystemInformation"));
+        if (!query) {
+            return false;
+        }
+        
+        const ULONG SystemProcessInformation = 5;
+        const LONG StatusInfoLengthMismatch = static_cast<LONG>(0xC0000004L);
+        std::vector<unsigned char> buffer(1 << 20);
+        LONG status;
+        for (;;) {
+            ULONG needed = 0;
+            status = query(SystemProcessInformation, buffer.data(), static_cast<ULONG>(buffer.size()), &needed);
+            if (status != StatusInfoLengthMismatch) break;
+            buffer.resize(std::max<size_t>(buffer.size() * 2, needed + (64 << 10)));
+        }
+        if (status < 0) {
+            return false;
+        }
+        
+        size_t offset = 0;
+        for (;;) {
+            const SystemProcessEntry* entry = reinterpret_cast<const SystemProcessEntry*>(buffer.data() + offset);
+            
+            ProcessInfo info;
+            info.pid = static_cast<int32_t>(reinterpret_cast<ULONG_PTR>(entry->UniqueProcessId));
+            info.ppid = static_cast<int32_t>(reinterpret_cast<ULONG_PTR>(entry->InheritedFromUniqueProcessId));
+            if (entry->ImageNameBuffer && entry->ImageNameLength > 0) {
+                std::wstring image(entry->ImageNameBuffer, entry->ImageNameLength / sizeof(WCHAR));
+                info.name = strings.intern(wideToString(image.c_str()).c_str());
+            } else {
+                info.name = strings.intern("[System Process]");
+            }
+            info.num_threads = static_cast<int32_t>(entry->NumberOfThreads);
+            info.memory_kb = entry->WorkingSetSize / 1024;
+            info.start_time = static_cast<uint64_t>(entry->CreateTime.QuadPart);
+            info.cpu_time_us = static_cast<uint64_t>(entry->UserTime.QuadPart + entry->KernelTime.QuadPart) / 10;
+            
+            // Not part of the system query; costs a handle per process
+            readHandleStrings(static_cast<DWORD>(info.pid), info, strings, fields);
+            
+            records.push_back(info);
+            
+            if (entry->NextEntryOffset == 0) break;
+            offset += entry->NextEntryOffset;
+        }
+        return true;
+    }
+    
+    /**
+     * Toolhelp fallback for when the native query is unavailable
+     */
+    static bool collectFromToolhelp(std::vector<ProcessInfo>& records, StringPool& strings, uint32_t fields) {
+        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+        if (hSnapshot == INVALID_HANDLE_VALUE) {
+            std::cerr << Color::RED << "Error: Cannot create process snapshot" << Color::RESET << std::endl;
+            return false;
+        }
+        
+        PROCESSENTRY32W pe32;
+        pe32.dwSize = sizeof(PROCESSENTRY32W);
+        
+        if (Process32FirstW(hSnapshot, &pe32)) {
+            do {
+                ProcessInfo info;
+                info.pid = pe32.th32ProcessID;
+                info.ppid = pe32.th32ParentProcessID;
+                info.name = strings.intern(wideToString(pe32.szExeFile).c_str());
+                info.num_threads = pe32.cntThreads;
+                
+                // Memory and CPU times need a process handle
+                if (fields & (FIELD_MEMORY | FIELD_CPU)) {
+                    readHandleInfo(pe32.th32ProcessID, info);
+                }
+                readHandleStrings(pe32.th32ProcessID, info, strings, fields);
+                
+                records.push_back(info);
+                
+            } while (Process32NextW(hSnapshot, &pe32));
+        }
+        
+        CloseHandle(hSnapshot);
+        return true;
+    }
+};
+#endif
+
+
+/**
+ * The backend for the platform we were built for
+ */
+static std::unique_ptr<ProcessCollector> createPlatformCollector() {
+#ifdef _WIN32
+    return std::unique_ptr<ProcessCollector>(new WindowsCollector());
+#elif defined(__APPLE__)
+    return std::unique_ptr<ProcessCollector>(new MacCollector());
+#else
+    return std::unique_ptr<ProcessCollector>(new LinuxCollector());
+#endif
+}
+
+/**
+ * --find: matches a substring or regex against the strings of a table's
+ * pool, which holds every distinct name and command line once,
+ * NUL-separated in one buffer. A substring search is then one
+ * string_view::find pass (memchr/memcmp underneath) over contiguous
+ * memory, and each distinct string is tested once however many processes
+ * share it. Between clears the pool only grows at the end, so for a pool
+ * already searched only the bytes added since are scanned. Matches are
+ * kept as a bitmap over string handles (pool offsets), so testing a
+ * record is O(1).
+ */
+class NameSearch {
+public:
+    NameSearch() : useRegex(false), cmdlines(false), cachedGeneration(0), scanned(0) {}
+    
+    /**
+     * Set what to look for; returns false with `error` set for a bad regex
+     */
+    bool setPattern(const std::string& text, bool regex, bool searchCmdlines, std::string& error) {
+        if (regex) {
+            try {
+                compiled = std::regex(text, std::regex::ECMAScript | std::regex::optimize);
+            } catch (const std::regex_error& e) {
+                error = e.what();
+                return false;
+            }
+        }
+        pattern = text;
+        useRegex = regex;
+        cmdlines = searchCmdlines;
+        cachedGeneration = 0;
+        return true;
+    }
+    
+    bool active() const {
+        return !pattern.empty();
+    }
+    
+    bool sameQuery(const std::string& text, bool regex, bool searchCmdlines) const {
+        return pattern == text && useRegex == regex && cmdlines == searchCmdlines;
+    }
+    
+    const std::string& text() const {
+        return pattern;
+    }
+    
+    /**
+     * Find the matching strings in `pool`. `generation` identifies the
+     * pool's contents (StringPool::generation()); 0 means unknown, so the
+     * whole pool is scanned.
+     */
+    void match(const char* pool, size_t size, uint64_t generation) {
+        if (generation == 0 || generation != cachedGeneration || size < scanned) {
+            matched.clear();
+            scanned = 1;  // offset 0 is the empty string
+        }
+        matched.resize((size + 63) / 64, 0);
+        if (useRegex) {
+            matchRegex(pool, size);
+        } else {
+            matchSubstring(pool, size);
+        }
+        scanned = std::max<size_t>(scanned, size);
+        cachedGeneration = generation;
+    }
+    
+    /**
+     * Whether a process matched the last match() (name, or command line
+     * if those are searched)
+     */
+    bool matches(const ProcessInfo& proc) const {
+        return isMatch(proc.name) || (cmdlines && isMatch(proc.cmdline));
+    }
+    
+private:
+    std::string pattern;
+    std::regex compiled;
+    bool useRegex;
+    bool cmdlines;
+    
+    // Matches in the first `scanned` bytes of the pool with this generation
+    uint64_t cachedGeneration;
+    size_t scanned;
+    std::vector<uint64_t> matched;
+    
+    bool isMatch(uint32_t handle) const {
+        return handle / 64 < matched.size() && (matched[handle / 64] >> (handle % 64) & 1);
+    }
+    
+    void add(size_t handle) {
+        matched[handle / 64] |= uint64_t(1) << (handle % 64);
+    }
+    
+    void matchSubstring(const char* pool, size_t size) {
+        std::string_view text(pool, size);
+        size_t pos = scanned;
+        while ((pos = text.find(pattern, pos)) != std::string_view::npos) {
+            size_t start = pos;
+            while (start > 0 && pool[start - 1] != '\0') start--;
+            add(start);
+            pos = text.find('\0', pos);
+            if (pos == std::string_view::npos) break;
+            pos++;
+        }
+    }
+    
+    void matchRegex(const char* pool, size_t size) {
+        size_t offset = scanned;
+        while (offset < size) {
+            const char* str = pool + offset;
+            size_t len = strnlen(str, size - offset);
+            if (len > 0 && std::regex_search(str, str + len, compiled)) {
+                add(offset);
+            }
+            offset += len + 1;
+        }
+    }
+};
+
+/**
+ * --top / --sort / --min-mem / --min-cpu: cuts the tree down to the heavy
+ * processes. Thresholds are tested per record; the top N are then picked
+ * with nth_element (linear, no full sort), since the tree shows them in
+ * tree order anyway.
+ */
+class ResourceFilter {
+public:
+    enum SortKey { SORT_MEMORY, SORT_CPU, SORT_THREADS };
+    
+    ResourceFilter() : top(0), key(SORT_MEMORY), minMemoryKb(0), minCpu(0.0) {}
+    
+    size_t top;            // keep the N heaviest by `key` (0 = no limit)
+    SortKey key;
+    uint64_t minMemoryKb;  // 0 = no threshold
+    double minCpu;         // 0 = no threshold
+    
+    bool active() const {
+        return top > 0 || minMemoryKb > 0 || minCpu > 0;
+    }
+    
+    bool passes(const ProcessInfo& proc) const {
+        return proc.memory_kb >= minMemoryKb && proc.cpu_percent >= minCpu;
+    }
+    
+    bool heavier(const ProcessInfo& a, const ProcessInfo& b) const {
+        switch (key) {
+            case SORT_CPU: return a.cpu_percent > b.cpu_percent;
+            case SORT_THREADS: return a.num_threads > b.num_threads;
+            case SORT_MEMORY: break;
+        }
+        return a.memory_kb > b.memory_kb;
+    }
+    
+    /**
+     * Keep the `top` heaviest of `candidates` (indices into `records`), in
+     * no particular order
+     */
+    void pickTop(std::vector<uint32_t>& candidates, const ProcessInfo* records) const {
+        if (top == 0 || candidates.size() <= top) return;
+        std::nth_element(candidates.begin(), candidates.begin() + (top - 1), candidates.end(),
+                         [&](uint32_t a, uint32_t b) { return heavier(records[a], records[b]); });
+        candidates.resize(top);
+    }
+    
+    /**
+     * CollectField bits the filter needs filled
+     */
+    uint32_t fields() const {
+        uint32_t needed = 0;
+        if (top > 0) {
+            needed |= key == SORT_CPU ? FIELD_CPU : key == SORT_THREADS ? FIELD_THREADS : FIELD_MEMORY;
+        }
+        if (minMemoryKb > 0) needed |= FIELD_MEMORY;
+        if (minCpu > 0) needed |= FIELD_CPU;
+        return needed;
+    }
+    
+    /**
+     * e.g. "top 10 by memory, MEM >= 100MB"
+     */
+    std::string describe() const {
+        std::string text;
+        auto part = [&](const std::string& item) {
+            if (!text.empty()) text += ", ";
+            text += item;
+        };
+        if (top > 0) {
+            part("top " + std::to_string(top) + " by " + keyName(key));
+        }
+        if (minMemoryKb > 0) {
+            part("MEM >= " + ProcessInfo::formatKb(minMemoryKb));
+        }
+        if (minCpu > 0) {
+            char cpu[32];
+            snprintf(cpu, sizeof(cpu), "CPU >= %.1f%%", minCpu);
+            part(cpu);
+        }
+        return text;
+    }
+    
+    static const char* keyName(SortKey key) {
+        switch (key) {
+            case SORT_CPU: return "cpu";
+            case SORT_THREADS: return "threads";
+            case SORT_MEMORY: break;
+        }
+        return "memory";
+    }
+    
+    /**
+     * Parse a --sort name; returns false if it is not recognized
+     */
+    static bool parseKey(const std::string& name, SortKey& key) {
+        if (name == "mem" || name == "memory") key = SORT_MEMORY;
+        else if (name == "cpu") key = SORT_CPU;
+        else if (name == "threads") key = SORT_THREADS;
+        else return false;
+        return true;
+    }
+    
+    /**
+     * Parse a --min-mem size: KB by default, or with a K, M or G suffix
+     */
+    static bool parseSize(const std::string& text, uint64_t& kb) {
+        char* end = nullptr;
+        double value = std::strtod(text.c_str(), &end);
+        if (end == text.c_str() || value < 0) return false;
+        
+        std::string unit(end);
+        double scale = 1;
+        if (unit == "M" || unit == "MB") scale = 1024;
+        else if (unit == "G" || unit == "GB") scale = 1024 * 1024;
+        else if (!unit.empty() && unit != "K" && unit != "KB") return false;
+        kb = static_cast<uint64_t>(value * scale);
+        return true;
+    }
+};
+
+/**
+ * Double buffer between the daemon's writer and its reader threads. The
+ * writer fills the slot that is not current and then flips `current`. A
+ * reader pins the current slot by bumping its reader count and checking
+ * that it is still current, so readers never lock and never see a
+ * half-written snapshot; the writer only waits when readers are still on
+ * the snapshot before last.
+ */
+class SnapshotExchange {
+    struct Slot {
+        std::string data;
+        std::atomic<unsigned> readers;
+    };
+    
+public:
+    SnapshotExchange() : current(0) {
+        slots[0].readers = 0;
+        slots[1].readers = 0;
+    }
+    
+    SnapshotExchange(const SnapshotExchange&) = delete;
+    SnapshotExchange& operator=(const SnapshotExchange&) = delete;
+    
+    /**
+     * Make `blob` the snapshot new readers get. `blob` is handed back
+     * holding the snapshot before the previous one, which no reader can
+     * see any more, so its memory can be reused for the next publish.
+     */
+    void publish(std::string& blob) {
+        unsigned next = current.load() ^ 1;
+        while (slots[next].readers.load() != 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        slots[next].data.swap(blob);
+        current.store(next);
+    }
+    
+    /**
+     * Keeps one published snapshot alive while a reader uses it
+     */
+    class Pin {
+    public:
+        explicit Pin(SnapshotExchange& exchange) {
+            for (;;) {
+                unsigned index = exchange.current.load();
+                slot = &exchange.slots[index];
+                slot->readers.fetch_add(1);
+                if (exchange.current.load() == index) break;
+                slot->readers.fetch_sub(1);
+            }
+        }
+        
+        ~Pin() {
+            slot->readers.fetch_sub(1);
+        }
+        
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+        
+        const std::string& data() const {
+            return slot->data;
+        }
+        
+    private:
+        Slot* slot;
+    };
+    
+private:
+    Slot slots[2];
+    std::atomic<unsigned> current;
+};
+
+#ifndef _WIN32
+/**
+ * Layout of the daemon's POSIX shared-memory segment (--shm): this
+ * header, then the latest snapshot in the binary format at dataOffset.
+ * `sequence` is a seqlock: odd while the writer updates the segment,
+ * even again once it is done. A reader loads it (waiting while it is
+ * odd), copies the snapshot out and keeps the copy only if `sequence` is
+ * unchanged afterwards: no system calls per read. RETIRED means the
+ * segment was replaced (the snapshot outgrew it, or the daemon exited)
+ * and should be opened again by name.
+ */
+namespace SharedSegment {
+    const char MAGIC[8] = {'P', 'T', 'R', 'E', 'E', 'S', 'H', 'M'};
+    const uint32_t VERSION = 1;
+    const uint32_t DATA_OFFSET = 64;
+    const uint64_t RETIRED = UINT64_MAX;
+    
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t dataOffset;
+        std::atomic<uint64_t> sequence;
+        uint64_t capacity;        // snapshot bytes the segment can hold
+        std::atomic<uint64_t> length;  // bytes of the current snapshot
+    };
+    
+    static_assert(sizeof(Header) <= DATA_OFFSET, "header must fit before the data");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "seqlock needs lock-free 64-bit atomics");
+}
+
+/**
+ * Writer side of --shm: owns the named segment and republishes into it
+ */
+class SharedSnapshotWriter {
+public:
+    SharedSnapshotWriter() : fd(-1), base(nullptr), mapped(0) {}
+    
+    SharedSnapshotWriter(const SharedSnapshotWriter&) = delete;
+    SharedSnapshotWriter& operator=(const SharedSnapshotWriter&) = delete;
+    
+    ~SharedSnapshotWriter() {
+        retire();
+        if (!name.empty()) shm_unlink(name.c_str());
+    }
+    
+    /**
+     * Create the segment. It must not exist yet: another daemon may be
+     * serving it, so an existing name is an error rather than replaced.
+     */
+    bool open(const std::string& segmentName, std::string& error) {
+        name = segmentName;
+        if (!create(1 << 20)) {
+            error = "shm " + name + ": " + std::strerror(errno);
+            if (errno == EEXIST) {
+                error += " (in use by another daemon, or left by one that was killed: remove /dev/shm" +
+                         std::string(name[0] == '/' ? "" : "/") + name + ")";
+            }
+            name.clear();
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     * Copy a snapshot into the segment under the seqlock. A snapshot
+     * that doesn't fit moves to a new, bigger segment under the same
+     * name (some systems can size a segment only once). If that segment
+     * can't be created, false with errno set; the next publish tries
+     * again.
+     */
+    bool publish(const std::string& blob) {
+        if (name.empty()) return false;
+        if (base && blob.size() > header()->capacity) {
+            retire();
+            shm_unlink(name.c_str());
+        }
+        if (!base && !create(blob.size() * 2)) return false;
+        
+        SharedSegment::Header* h = header();
+        uint64_t writing = h->sequence.load(std::memory_order_relaxed) | 1;
+        h->sequence.store(writing, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(base + SharedSegment::DATA_OFFSET, blob.data(), blob.size());
+        h->length.store(blob.size(), std::memory_order_relaxed);
+        h->sequence.store(writing + 1, std::memory_order_release);
+        return true;
+    }
+    
+    const std::string& segmentName() const {
+        return name;
+    }
+    
+private:
+    std::string name;
+    int fd;
+    char* base;
+    size_t mapped;
+    
+    SharedSegment::Header* header() {
+        return reinterpret_cast<SharedSegment::Header*>(base);
+    }
+    
+    bool create(size_t capacity) {
+        capacity = (capacity + 0xFFFF) & ~static_cast<size_t>(0xFFFF);
+        size_t total = SharedSegment::DATA_OFFSET + capacity;
+        
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) return false;
+        void* addr = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(total)) == 0) {
+            addr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (addr == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            fd = -1;
+            shm_unlink(name.c_str());  // ours: created just above
+            errno = saved;
+            return false;
+        }
+        
+        base = static_cast<char*>(addr);
+        mapped = total;
+        SharedSegment::Header* h = new (base) SharedSegment::Header;
+        std::memcpy(h->magic, SharedSegment::MAGIC, sizeof(h->magic));
+        h->version = SharedSegment::VERSION;
+        h->dataOffset = SharedSegment::DATA_OFFSET;
+        h->capacity = capacity;
+        h->length.store(0, std::memory_order_relaxed);
+        h->sequence.store(1, std::memory_order_release);  // nothing published yet
+        return true;
+    }
+    
+    /**
+     * Tell readers to reopen, then let go of the current segment
+     */
+    void retire() {
+        if (!base) return;
+        header()->sequence.store(SharedSegment::RETIRED, std::memory_order_release);
+        munmap(base, mapped);
+        close(fd);
+        base = nullptr;
+        fd = -1;
+    }
+};
+
+/**
+ * Reader side of --shm, for local consumers: maps the segment read-only
+ * and hands out consistent copies of the snapshot. Include this file with
+ * PROCESS_TREE_NO_MAIN to use it.
+ */
+class SharedSnapshotReader {
+public:
+    SharedSnapshotReader() : base(nullptr), mapped(0) {}
+    
+    SharedSnapshotReader(const SharedSnapshotReader&) = delete;
+    SharedSnapshotReader& operator=(const SharedSnapshotReader&) = delete;
+    
+    ~SharedSnapshotReader() {
+        unmap();
+    }
+    
+    bool open(const std::string& segmentName) {
+        unmap();
+        name = segmentName;
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        void* addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > SharedSegment::DATA_OFFSET) {
+            addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED) return false;
+        
+        base = static_cast<const char*>(addr);
+        mapped = static_cast<size_t>(st.st_size);
+        if (std::memcmp(header()->magic, SharedSegment::MAGIC, sizeof(SharedSegment::MAGIC)) != 0 ||
+            header()->version != SharedSegment::VERSION) {
+            unmap();
+            errno = EINVAL;
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     * Call use(data, size) on the current snapshot until one call ran
+     * without the writer publishing in between; only that call's result
+     * may be trusted. The bytes can change under `use` at any point, so
+     * it should only copy them out; validate the copy (openSnapshot does)
+     * before using it, as attachShared() does. A retired segment is
+     * reopened by name, retrying while the writer replaces it. Returns
+     * false if nothing became readable within `timeoutMs`.
+     */
+    template <typename Use>
+    bool read(Use use, unsigned timeoutMs = 1000) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (!base) {
+                // Mid-replacement the name can be missing, empty or not
+                // yet initialized
+                if (name.empty() || !open(name)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            const SharedSegment::Header* h = header();
+            uint64_t seq = h->sequence.load(std::memory_order_acquire);
+            if (seq == SharedSegment::RETIRED) {
+                unmap();
+                continue;
+            }
+            // 0: a new segment whose header is still being filled in
+            if (seq == 0 || (seq & 1)) {
+                std::this_thread::yield();
+                continue;
+            }
+            
+            size_t length = std::min<size_t>(h->length.load(std::memory_order_relaxed),
+                                             mapped - SharedSegment::DATA_OFFSET);
+            use(base + SharedSegment::DATA_OFFSET, length);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (h->sequence.load(std::memory_order_relaxed) == seq) return true;
+        }
+        return false;
+    }
+    
+private:
+    std::string name;
+    const char* base;
+    size_t mapped;
+    
+    const SharedSegment::Header* header() const {
+        return reinterpret_cast<const SharedSegment::Header*>(base);
+    }
+    
+    void unmap() {
+        if (base) munmap(const_cast<char*>(base), mapped);
+        base = nullptr;
+        mapped = 0;
+    }
+};
+
+/**
+ * Fill in a Unix domain socket address; false if the path is too long
+ */
+static bool unixAddress(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+/**
+ * Connect to a Unix domain stream socket; returns the descriptor or -1
+ */
+static int connectUnixSocket(const std::string& path) {
+    sockaddr_un addr;
+    if (!unixAddress(path, addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Bind a non-blocking listening socket at `path`, replacing a stale
+ * socket file left behind by a daemon that is gone. Returns the
+ * descriptor, or -1 with `error` set.
+ */
+static int listenUnixSocket(const std::string& path, std::string& error) {
+    sockaddr_un addr;
+    if (!unixAddress(path, addr)) {
+        error = "socket path too long: " + path;
+        return -1;
+    }
+    
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            error = path + " exists and is not a socket";
+            return -1;
+        }
+        int other = connectUnixSocket(path);
+        if (other >= 0) {
+            close(other);
+            error = "a daemon is already listening on " + path;
+            return -1;
+        }
+        unlink(path.c_str());
+    }
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error = std::string("socket: ") + std::strerror(errno);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        error = path + ": " + std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/**
+ * Bind a non-blocking TCP listening socket at "[HOST]:PORT" (all
+ * interfaces when HOST is empty). Returns the descriptor, or -1 with
+ * `error` set.
+ */
+static int listenTcpSocket(const std::string& address, std::string& error) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon + 1 == address.size()) {
+        error = "expected [HOST]:PORT, got " + address;
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* found = nullptr;
+    int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+    if (status != 0) {
+        error = address + ": " + gai_strerror(status);
+        return -1;
+    }
+    
+    int fd = -1;
+    error = address + ": no usable address";
+    for (struct addrinfo* ai = found; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 128) == 0) break;
+        error = address + ": " + std::strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    if (fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+#endif
+
+/**
+ * --diff A B and --merge DIR: compare binary snapshots without building a
+ * tree. Files are memory-mapped and compared in place; records are sorted
+ * by PID in both, so one sorted-merge pass joins them on
+ * (pid, start_time). A PID whose start time differs was reused and counts
+ * as one process removed and another added; a kept process is "changed"
+ * when it was reparented or exec'd (name or command line differs).
+ */
+class SnapshotDiff {
+public:
+    SnapshotDiff() : json(false), jobs(1), palette(&COLORED_PALETTE) {}
+    
+    /**
+     * Report only changes to processes whose name (or, with `cmdlines`,
+     * command line) matches, or whose parent's does: "new sshd children"
+     * with --find sshd. Returns false with a message for a bad regex.
+     */
+    bool setSearch(const std::string& text, bool regex, bool cmdlines) {
+        std::string error;
+        if (!search.setPattern(text, regex, cmdlines, error)) {
+            std::cerr << Color::RED << "Error: bad --find pattern: " << error << Color::RESET << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    void setJson(bool enabled) {
+        json = enabled;
+    }
+    
+    void setColor(bool enabled) {
+        palette = enabled ? &COLORED_PALETTE : &PLAIN_PALETTE;
+    }
+    
+    void setJobs(unsigned n) {
+        jobs = n > 0 ? n : std::max(1u, std::thread::hardware_concurrency());
+    }
+    
+    /**
+     * Changes from snapshot `before` to snapshot `after`; returns the
+     * process exit status
+     */
+    int diff(const std::string& before, const std::string& after) {
+        std::vector<Loaded> files(2);
+        files[0].path = before;
+        files[1].path = after;
+        for (Loaded& file : files) {
+            if (!open(file)) {
+                std::cerr << Color::RED << "Error: " << file.path << ": " << file.error << Color::RESET << std::endl;
+                return 1;
+            }
+        }
+        
+        OutputBuffer out(OutputBuffer::standardOutput());
+        Filters filters = {search, search};
+        report(files[0], files[1], filters, out);
+        return finish(out);
+    }
+    
+    /**
+     * Every snapshot in `dir`, grouped by the host that wrote it: for each
+     * host, the changes from its oldest snapshot to its newest. Opening
+     * and diffing run on `jobs` threads; hosts are reported in name order.
+     */
+    int merge(const std::string& dir) {
+        std::vector<std::string> paths;
+        if (!listDirectory(dir, paths)) {
+            std::cerr << Color::RED << "Error: Cannot read directory " << dir << Color::RESET << std::endl;
+            return 1;
+        }
+        
+        // Opening maps the file and checks it in one pass, no parsing
+        std::vector<Loaded> files(paths.size());
+        parallelFor(files.size(), jobs, [&](unsigned, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                files[i].path = std::move(paths[i]);
+                open(files[i]);
+            }
+        });
+        
+        std::vector<uint32_t> order;
+        order.reserve(files.size());
+        for (uint32_t i = 0; i < files.size(); i++) {
+            if (files[i].ok) {
+                order.push_back(i);
+            } else {
+                std::cerr << Color::YELLOW << "Skipping " << files[i].path << ": " << files[i].error
+                          << Color::RESET << std::endl;
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            int byHost = std::strcmp(files[a].hostName, files[b].hostName);
+            if (byHost != 0) return byHost < 0;
+            if (files[a].timestamp != files[b].timestamp) return files[a].timestamp < files[b].timestamp;
+            return files[a].path < files[b].path;
+        });
+        
+        // One (oldest, newest) pair per host with at least two snapshots
+        std::vector<std::pair<uint32_t, uint32_t>> pairs;
+        size_t singles = 0;
+        for (size_t k = 0; k < order.size();) {
+            size_t next = k + 1;
+            while (next < order.size() && std::strcmp(files[order[next]].hostName, files[order[k]].hostName) == 0) {
+                next++;
+            }
+            if (next - k >= 2) {
+                pairs.push_back({order[k], order[next - 1]});
+            } else {
+                singles++;
+            }
+            k = next;
+        }
+        
+        // Each host's report is built off to the side, then written in order
+        std::vector<std::string> reports(pairs.size());
+        std::vector<Filters> filters(jobs, Filters{search, search});
+        std::atomic<size_t> changedHosts(0);
+        parallelFor(pairs.size(), jobs, [&](unsigned worker, size_t begin, size_t end) {
+            for (size_t p = begin; p < end; p++) {
+                OutputBuffer text;
+                if (report(files[pairs[p].first], files[pairs[p].second], filters[worker], text) > 0) {
+                    changedHosts.fetch_add(1, std::memory_order_relaxed);
+                    reports[p] = text.release();
+                }
+            }
+        });
+        
+        OutputBuffer out(OutputBuffer::standardOutput());
+        for (const std::string& text : reports) {
+            out.append(text);
+        }
+        if (!json) {
+            out.append(palette->cyan);
+            out.appendNumber(static_cast<long long>(order.size()));
+            out.append(" snapshots, ");
+            out.appendNumber(static_cast<long long>(pairs.size() + singles));
+            out.append(" hosts, ");
+            out.appendNumber(static_cast<long long>(changedHosts.load()));
+            out.append(" with changes");
+            if (singles > 0) {
+                out.append(", ");
+                out.appendNumber(static_cast<long long>(singles));
+                out.append(" with only one snapshot");
+            }
+            out.append(palette->reset);
+            out.append('\n');
+        }
+        return finish(out);
+    }
+    
+private:
+    /**
+     * Flush a report to stdout; the exit status, 1 if it couldn't be written
+     */
+    static int finish(OutputBuffer& out) {
+        out.flush();
+        if (out.good()) return 0;
+        std::cerr << Color::RED << "Error: Cannot write output: " << std::strerror(errno)
+                  << Color::RESET << std::endl;
+        return 1;
+    }
+    
+    struct Loaded {
+        std::string path;
+        MappedFile file;
+        ProcessTableView view;
+        const char* hostName = "";
+        uint64_t timestamp = 0;
+        bool ok = false;
+        std::string error;
+    };
+    
+    enum Change { ADDED, REMOVED, CHANGED };
+    
+    // --find state for each side of a pair; one per worker
+    struct Filters {
+        NameSearch before;
+        NameSearch after;
+    };
+    
+    NameSearch search;
+    bool json;
+    unsigned jobs;
+    const Palette* palette;
+    
+    static bool open(Loaded& file) {
+        if (!file.file.map(file.path)) {
+            file.error = "cannot open snapshot";
+            return false;
+        }
+        uint32_t host = 0;
+        if (!openSnapshot(file.file.data(), file.file.size(), file.view, host, file.timestamp, file.error)) {
+            return false;
+        }
+        file.hostName = file.view.string(host);
+        file.ok = true;
+        return true;
+    }
+    
+    /**
+     * Regular files in `dir`, in name order
+     */
+    static bool listDirectory(const std::string& dir, std::vector<std::string>& paths) {
+#ifdef _WIN32
+        WIN32_FIND_DATAA entry;
+        HANDLE find = FindFirstFileA((dir + "\\*").c_str(), &entry);
+        if (find == INVALID_HANDLE_VALUE) return false;
+        do {
+            if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                paths.push_back(dir + "\\" + entry.cFileName);
+            }
+        } while (FindNextFileA(find, &entry));
+        FindClose(find);
+#else
+        DIR* handle = opendir(dir.c_str());
+        if (!handle) return false;
+        struct dirent* entry;
+        while ((entry = readdir(handle)) != nullptr) {
+            if (entry->d_name[0] == '.') continue;
+            std::string path = dir + "/" + entry->d_name;
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                paths.push_back(std::move(path));
+            }
+        }
+        closedir(handle);
+#endif
+        std::sort(paths.begin(), paths.end());
+        return true;
+    }
+    
+    /**
+     * Sorted-merge join of two PID-ordered record arrays; calls
+     * emit(change, beforeIndex, afterIndex) with npos for the missing side
+     */
+    template <typename Emit>
+    static void join(const ProcessTableView& a, const ProcessTableView& b, Emit emit) {
+        const uint32_t npos = ProcessTableView::npos;
+        uint32_t i = 0, j = 0;
+        while (i < a.count || j < b.count) {
+            if (j == b.count || (i < a.count && a.records[i].pid < b.records[j].pid)) {
+                emit(REMOVED, i++, npos);
+            } else if (i == a.count || b.records[j].pid < a.records[i].pid) {
+                emit(ADDED, npos, j++);
+            } else {
+                const ProcessInfo& old = a.records[i];
+                const ProcessInfo& now = b.records[j];
+                if (old.start_time != now.start_time) {
+                    emit(REMOVED, i, npos);
+                    emit(ADDED, npos, j);
+                } else if (old.ppid != now.ppid || differs(a, old.name, b, now.name)
+                           || (old.cmdline && now.cmdline && differs(a, old.cmdline, b, now.cmdline))) {
+                    emit(CHANGED, i, j);
+                }
+                i++;
+                j++;
+            }
+        }
+    }
+    
+    static bool differs(const ProcessTableView& a, uint32_t x, const ProcessTableView& b, uint32_t y) {
+        return std::strcmp(a.string(x), b.string(y)) != 0;
+    }
+    
+    /**
+     * Whether a change passes --find: the process or its parent matches
+     */
+    static bool selected(const NameSearch& filter, const ProcessTableView& view, uint32_t index) {
+        if (index == ProcessTableView::npos) return false;
+        const ProcessInfo& proc = view.records[index];
+        if (filter.matches(proc)) return true;
+        uint32_t parent = view.indexOf(proc.ppid);
+        return parent != ProcessTableView::npos && filter.matches(view.records[parent]);
+    }
+    
+    /**
+     * Append the changes from `before` to `after`; returns how many were
+     * reported (none means nothing is appended)
+     */
+    size_t report(const Loaded& before, const Loaded& after, Filters& filters, OutputBuffer& out) {
+        bool filtering = search.active();
+        if (filtering) {
+            filters.before.match(before.view.strings, before.view.stringsSize, 0);
+            filters.after.match(after.view.strings, after.view.stringsSize, 0);
+        }
+        
+        size_t counts[3] = {0, 0, 0};
+        OutputBuffer lines;
+        join(before.view, after.view, [&](Change change, uint32_t i, uint32_t j) {
+            if (filtering && !selected(filters.before, before.view, i) && !selected(filters.after, after.view, j)) {
+                return;
+            }
+            counts[change]++;
+            if (json) {
+                appendJsonChange(change, before, i, after, j, lines);
+            } else {
+                appendTextChange(change, before.view, i, after.view, j, lines);
+            }
+        });
+        
+        size_t total = counts[ADDED] + counts[REMOVED] + counts[CHANGED];
+        if (total == 0 && filtering) return 0;
+        if (!json) {
+            out.append(palette->cyan);
+            out.append(palette->bright);
+            out.append(*after.hostName ? after.hostName : "(unknown host)");
+            out.append(palette->reset);
+            out.append(palette->cyan);
+            out.append(' ');
+            out.append(formatLocalTime(static_cast<time_t>(before.timestamp)));
+            out.append(" -> ");
+            out.append(formatLocalTime(static_cast<time_t>(after.timestamp)));
+            out.append(palette->reset);
+            out.append(": ");
+            out.append(palette->green);
+            out.appendNumber(static_cast<long long>(counts[ADDED]));
+            out.append(" added");
+            out.append(palette->reset);
+            out.append(", ");
+            out.append(palette->red);
+            out.appendNumber(static_cast<long long>(counts[REMOVED]));
+            out.append(" removed");
+            out.append(palette->reset);
+            out.append(", ");
+            out.append(palette->yellow);
+            out.appendNumber(static_cast<long long>(counts[CHANGED]));
+            out.append(" changed");
+            out.append(palette->reset);
+            out.append('\n');
+        }
+        out.append(lines.str());
+        return total;
+    }
+    
+    void appendProcess(const ProcessTableView& view, const ProcessInfo& proc, OutputBuffer& out) {
+        out.append(view.name(proc));
+        out.append(palette->yellow);
+        out.append(" [PID: ");
+        out.appendNumber(proc.pid);
+        out.append(']');
+        out.append(palette->reset);
+    }
+    
+    void appendTextChange(Change change, const ProcessTableView& a, uint32_t i,
+                          const ProcessTableView& b, uint32_t j, OutputBuffer& out) {
+        const ProcessTableView& view = change == REMOVED ? a : b;
+        const ProcessInfo& proc = view.records[change == REMOVED ? i : j];
+        static const char* const marks[] = {"  + ", "  - ", "  ~ "};
+        out.append(change == ADDED ? palette->green : change == REMOVED ? palette->red : palette->yellow);
+        out.append(marks[change]);
+        out.append(palette->reset);
+        appendProcess(view, proc, out);
+        
+        if (change == CHANGED) {
+            const ProcessInfo& old = a.records[i];
+            if (differs(a, old.name, b, proc.name)) {
+                out.append(" name: ");
+                out.append(a.name(old));
+                out.append(" -> ");
+                out.append(b.name(proc));
+            }
+            if (old.ppid != proc.ppid) {
+                out.append(" parent: ");
+                out.appendNumber(old.ppid);
+                out.append(" -> ");
+                out.appendNumber(proc.ppid);
+            }
+            if (old.cmdline && proc.cmdline && differs(a, old.cmdline, b, proc.cmdline)) {
+                out.append(" cmdline: ");
+                out.append(b.string(proc.cmdline));
+            }
+        } else {
+            uint32_t parent = view.indexOf(proc.ppid);
+            if (parent != ProcessTableView::npos) {
+                out.append(" under ");
+                appendProcess(view, view.records[parent], out);
+            }
+        }
+        out.append('\n');
+    }
+    
+    static void appendJsonChange(Change change, const Loaded& before, uint32_t i,
+                                 const Loaded& after, uint32_t j, OutputBuffer& out) {
+        static const char* const names[] = {"added", "removed", "changed"};
+        const ProcessTableView& view = change == REMOVED ? before.view : after.view;
+        const ProcessInfo& proc = view.records[change == REMOVED ? i : j];
+        out.append("{\"host\":");
+        out.appendJsonString(after.hostName);
+        out.append(",\"change\":\"");
+        out.append(names[change]);
+        out.append("\",\"pid\":");
+        out.appendNumber(proc.pid);
+        out.append(",\"ppid\":");
+        out.appendNumber(proc.ppid);
+        out.append(",\"name\":");
+        out.appendJsonString(view.name(proc));
+        out.append(",\"cmdline\":");
+        out.appendJsonString(view.string(proc.cmdline));
+        out.append(",\"start_time\":");
+        out.appendNumber(static_cast<long long>(proc.start_time));
+        uint32_t parent = view.indexOf(proc.ppid);
+        if (parent != ProcessTableView::npos) {
+            out.append(",\"parent\":");
+            out.appendJsonString(view.name(view.records[parent]));
+        }
+        if (change == CHANGED) {
+            const ProcessInfo& old = before.view.records[i];
+            out.append(",\"was\":{\"ppid\":");
+            out.appendNumber(old.ppid);
+            out.append(",\"name\":");
+            out.appendJsonString(before.view.name(old));
+            out.append(",\"cmdline\":");
+            out.appendJsonString(before.view.string(old.cmdline));
+            out.append('}');
+        }
+        out.append("}\n");
+    }
+};
+
+/**
+ * Main ProcessTree class for collecting and displaying process information
+ */
+class ProcessTree {
+private:
+    // process_tree_bench.cpp times the private phases one by one
+    friend struct ProcessTreeBench;
+    
+    ProcessTable table;
+    
+    // What rendering and queries read: either table.view() (re-synced
+    // after every table change) or a memory-mapped snapshot
+    ProcessTableView view;
+    std::unique_ptr<MappedFile> loaded;
+    std::string attached;
+    bool snapshotView;
+    uint32_t loadedHost;
+    uint64_t loadedTimestamp;
+    bool showResources;
+    bool verbose;
+    
+    // Escape codes for the current render; plain for files and sockets
+    const Palette* palette;
+    
+    // Columns of a process line. Each combination (with or without color)
+    // is its own formatProcessLine instantiation, picked once per render.
+    enum LineColumns : unsigned {
+        COLUMN_RESOURCES = 1u << 0,  // -r
+        COLUMN_VERBOSE   = 1u << 1,  // -v
+        COLUMN_ROLLUP    = 1u << 2,  // --rollup
+        COLUMN_COMBINATIONS = 8
+    };
+    typedef void (ProcessTree::*LineFormatter)(uint32_t, OutputBuffer&);
+    LineFormatter lineFormatter;
+    
+    unsigned jobs;
+    unsigned sampleMs;
+    uint32_t fields;
+    int totalProcesses;
+    int collectionErrors;
+    
+    // --cache: static fields of processes seen by an earlier run, mapped
+    // for the duration of one collection
+    std::string cachePath;
+    std::unique_ptr<MappedFile> cacheFile;
+    ProcessTableView cacheView;
+    int cachedProcesses;
+    
+    // Traversal state reused across walks: visitMark[i] == visitEpoch
+    // means record i was already printed in the current walk
+    std::vector<uint32_t> visitMark;
+    uint32_t visitEpoch;
+    
+    struct WalkFrame {
+        uint32_t index;
+        uint32_t nextChild;
+        uint32_t prefixLen;
+        bool isLast;
+    };
+    std::vector<WalkFrame> walkStack;
+    std::string walkPrefix;
+    
+    // --find pattern and matches; findMark[i] is set for matches and
+    // their ancestors. findParents stands in for view.parents on
+    // snapshots, which don't store them.
+    NameSearch search;
+    ResourceFilter filter;
+    std::vector<char> findMark;
+    std::vector<uint32_t> findParents;
+    std::vector<uint32_t> selected;
+    
+    // Daemon readers: the last few find patterns with their matches, so
+    // a repeated query only scans strings added since the snapshot it
+    // last ran on (see Snapshot::SECTION_GENERATION)
+    std::vector<NameSearch> recentSearches;
+    
+    // --rollup subtree totals for the live table, maintained by
+    // rollupDelta() along ancestor paths between full passes
+    // (computeRollups) after topology changes. shownRollups is what the
+    // current render uses: these, a snapshot's section, or nothing.
+    bool rollupEnabled;
+    std::vector<Rollup> rollups;
+    uint64_t rollupLinks;
+    bool rollupsDirty;
+    size_t rollupUpdates;
+    const Rollup* shownRollups;
+    std::vector<uint32_t> rollupOrder;
+    std::vector<uint32_t> rollupParent;
+    
+    // --threads drill-down: the selected PIDs (sorted) and their threads,
+    // grouped per PID (threadStart[k]..threadStart[k + 1]) and sorted by
+    // TID within each group so the next read can be diffed for CPU%
+    std::vector<int> threadPids;
+    std::vector<ThreadInfo> threadRecords;
+    std::vector<uint32_t> threadStart;
+    std::chrono::steady_clock::time_point threadSampleTime;
+    
+    // --group-by cgroup: one node per cgroup holding processes, plus the
+    // groups above them, sorted by path (so each parent precedes its
+    // children). Stats are read once per group, not summed per process;
+    // cpuPercent is the usage since the previous read.
+    struct CgroupNode {
+        std::string path;
+        uint32_t parent;
+        uint32_t processes;  // in this group and the groups below it
+        CgroupStats stats;
+        double cpuPercent;
+        bool sampled;
+    };
+    bool groupByCgroup;
+    std::vector<CgroupNode> cgroups;
+    std::chrono::steady_clock::time_point cgroupSampleTime;
+    std::string groupPrefix;
+    
+    // --user: only this owner's processes are read. ownerUid is set where
+    // the UID is known, so collectors with readOwner() can skip the rest
+    // before reading them.
+    std::string ownerFilter;
+    bool ownerHasUid;
+    uint32_t ownerUid;
+    
+    // Progress messages; sent to stderr when stdout carries data
+    std::ostream* log;
+    
+    // The daemon's snapshot buffer retired by the last publish, reused
+    // for the next one, and whether the last one missed the --shm segment
+    std::string retiredSnapshot;
+    bool segmentFailing;
+    
+    // --serve-metrics: how long the last collection or refresh took, and
+    // the per-render grouping of records into labelled series (reused)
+    double refreshSeconds;
+    struct MetricGroup {
+        uint32_t first;   // record whose name/user/cgroup labels the series
+        Rollup own;       // the members themselves
+        Rollup subtree;   // subtrees of members with no member above them
+    };
+    std::vector<MetricGroup> metricGroups;
+    std::vector<uint32_t> metricOrder;
+    std::vector<uint32_t> metricGroupOf;
+    std::vector<uint32_t> metricOpen;
+    std::vector<std::pair<uint32_t, uint32_t>> metricStack;
+    
+    // Watch and daemon ticks: the pool size after the last compaction,
+    // and the pool the next one interns into (kept for its buffers)
+    size_t compactedStrings;
+    StringPool spareStrings;
+    
+    // Platform backend for every process read
+    std::unique_ptr<ProcessCollector> collector;
+    
+    // --stats phase timings in milliseconds, in the order they ran
+    std::vector<std::pair<const char*, double>> phases;
+    
+    /**
+     * Scoped phase timer for --stats; a no-op unless stats are enabled
+     */
+    class PhaseTimer {
+    public:
+        PhaseTimer(ProcessTree& owner, const char* phaseName) : tree(owner), name(phaseName) {
+            if (Stats::enabled) start = std::chrono::steady_clock::now();
+        }
+        
+        /**
+         * Don't record this phase after all (it turned out not to run)
+         */
+        void cancel() {
+            name = nullptr;
+        }
+        
+        ~PhaseTimer() {
+            if (Stats::enabled && name) {
+                tree.phases.emplace_back(name, std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        
+    private:
+        ProcessTree& tree;
+        const char* name;
+        std::chrono::steady_clock::time_point start;
+    };
+    
+    /**
+     * Per-worker result buffer used by collectFromPids()
+     */
+    struct CollectBuffer {
+        std::vector<ProcessInfo> records;
+        StringPool localStrings;
+        StringPool* strings = &localStrings;
+        int errors = 0;
+        int cached = 0;
+    };
+    
+    /**
+     * Whether --user rules a process out from its owner UID alone (false
+     * when that can't be told before reading it)
+     */
+    bool foreignOwner(int pid) {
+        uint32_t uid;
+        return ownerHasUid && collector->readOwner(pid, uid) && uid != ownerUid;
+    }
+    
+    /**
+     * Whether --user rules out a record that has been read
+     */
+    bool foreignOwner(const ProcessInfo& info, const StringPool& strings) const {
+        return !ownerFilter.empty() && ownerFilter != strings.get(info.username);
+    }
+    
+    /**
+     * Drop the records from `from` on that --user rules out (after a bulk
+     * query, which has no per-process step to skip)
+     */
+    void dropForeign(std::vector<ProcessInfo>& records, size_t from) {
+        if (ownerFilter.empty()) return;
+        records.erase(std::remove_if(records.begin() + from, records.end(), [&](const ProcessInfo& info) {
+            return foreignOwner(info, table.strings);
+        }), records.end());
+    }
+    
+    /**
+     * Read every PID in the list, spread across `jobs` worker threads.
+     * Each worker fills its own buffer and string pool; the buffers are
+     * merged into the table afterwards on the calling thread, so no lock
+     * is needed. Worker 0 runs on the calling thread and interns straight
+     * into the table's pool.
+     */
+    void collectFromPids(const std::vector<int>& pids) {
+        unsigned workers = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<CollectBuffer> buffers(workers);
+        buffers[0].strings = &table.strings;
+        
+        parallelFor(pids.size(), workers, [&](unsigned id, size_t begin, size_t end) {
+            CollectBuffer& out = buffers[id];
+            for (size_t i = begin; i < end; i++) {
+                if (foreignOwner(pids[i])) continue;
+                ProcessInfo info;
+                if (readCached(pids[i], info, *out.strings)) {
+                    out.cached++;
+                    if (foreignOwner(info, *out.strings)) continue;
+                    out.records.push_back(info);
+                } else if (collector->readProcessInfo(pids[i], info, *out.strings, fields)) {
+                    if (foreignOwner(info, *out.strings)) continue;
+                    out.records.push_back(info);
+                } else {
+                    out.errors++;
+                }
+            }
+        });
+        
+        table.records.reserve(table.records.size() + pids.size());
+        for (auto& buffer : buffers) {
+            for (auto& info : buffer.records) {
+                if (buffer.strings != &table.strings) {
+                    info.name = table.strings.intern(buffer.strings->get(info.name));
+                    info.username = table.strings.intern(buffer.strings->get(info.username));
+                    info.cmdline = table.strings.intern(buffer.strings->get(info.cmdline));
+                    info.cgroup = table.strings.intern(buffer.strings->get(info.cgroup));
+                }
+                table.records.push_back(info);
+            }
+            totalProcesses += static_cast<int>(buffer.records.size());
+            collectionErrors += buffer.errors;
+            cachedProcesses += buffer.cached;
+        }
+    }
+    
+    /**
+     * Fill a record from the --cache entry for this PID: name, owner and
+     * command line are copied, everything volatile is read with
+     * readVolatile() (on Linux one stat read instead of stat, status and
+     * cmdline). The cgroup is re-read, since processes are moved between
+     * groups while they run. False
+     * if there is no entry, or if the process isn't the one cached: a
+     * different start time means the PID was reused, a different name
+     * that it exec'd. Safe to call from the collection workers.
+     */
+    bool readCached(int pid, ProcessInfo& info, StringPool& strings) {
+        if (!cacheView.records) return false;
+        uint32_t index = cacheView.indexOf(pid);
+        if (index == ProcessTableView::npos) return false;
+        const ProcessInfo& cached = cacheView.records[index];
+        if (cached.start_time == 0) return false;
+        
+        info = ProcessInfo();
+        info.pid = pid;
+        info.name = strings.intern(cacheView.name(cached));
+        uint32_t name = info.name;
+        if (!collector->readVolatile(pid, info, strings) ||
+            info.start_time != cached.start_time || info.name != name) {
+            info = ProcessInfo();
+            return false;
+        }
+        info.username = cached.username ? strings.intern(cacheView.string(cached.username)) : 0;
+        info.cmdline = cached.cmdline ? strings.intern(cacheView.string(cached.cmdline)) : 0;
+        if (fields & FIELD_CGROUP) {
+            collector->readCgroupPath(pid, info, strings);
+        }
+        return true;
+    }
+    
+    /**
+     * Map the --cache file for the next collection. It is ignored if it
+     * was written on another host, before the last boot, or without a
+     * field this run needs; a missing file just means a cold start.
+     */
+    void openCache() {
+        PhaseTimer timer(*this, "cache");
+        cacheView = ProcessTableView();
+        cacheFile.reset(new MappedFile());
+        if (!cacheFile->map(cachePath)) return;
+        
+        ProcessTableView mapped;
+        uint32_t host = 0;
+        uint64_t timestamp = 0;
+        std::string error;
+        if (!openSnapshot(cacheFile->data(), cacheFile->size(), mapped, host, timestamp, error)) {
+            std::cerr << Color::YELLOW << "Warning: ignoring cache " << cachePath << ": " << error
+                      << Color::RESET << std::endl;
+            return;
+        }
+        const uint32_t staticFields = FIELD_CMDLINE | FIELD_USER;
+        if (!mapped.collection || (fields & staticFields & ~mapped.collection->fields) != 0 ||
+            mapped.collection->bootTime != collector->bootTime() || hostName() != mapped.string(host)) {
+            return;
+        }
+        cacheView = mapped;
+    }
+    
+    /**
+     * Replace the --cache file with the table just collected. It is
+     * written to a new, uniquely named file next to it and renamed over
+     * it, so overlapping runs never share a half-written file and a
+     * planted symlink is never followed.
+     */
+    void saveCache() {
+        PhaseTimer timer(*this, "cache");
+        cacheView = ProcessTableView();
+        cacheFile.reset();
+        
+        std::string temp;
+        OutputBuffer::Handle handle;
+#ifdef _WIN32
+        size_t slash = cachePath.find_last_of("/\\");
+        std::string dir = slash == std::string::npos ? "." : cachePath.substr(0, slash + 1);
+        char name[MAX_PATH];
+        handle = INVALID_HANDLE_VALUE;
+        if (GetTempFileNameA(dir.c_str(), "ptc", 0, name)) {
+            temp = name;
+            handle = CreateFileA(name, GENERIC_WRITE, 0, nullptr, TRUNCATE_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        }
+        if (handle == INVALID_HANDLE_VALUE) {
+#else
+        temp = cachePath + ".XXXXXX";
+        handle = mkstemp(&temp[0]);
+        if (handle < 0) {
+#endif
+            std::cerr << Color::YELLOW << "Warning: cannot write cache " << cachePath << ": "
+                      << std::strerror(errno) << Color::RESET << std::endl;
+            if (!temp.empty()) std::remove(temp.c_str());
+            return;
+        }
+        
+        bool written;
+        {
+            OutputBuffer out(handle);
+            Snapshot::Collection collection = {fields, 0, collector->bootTime()};
+            writeBinarySnapshot(out, &collection);
+            out.flush();
+            written = out.good();
+        }
+#ifdef _WIN32
+        written = CloseHandle(handle) && written;
+        bool replaced = written && MoveFileExA(temp.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+        written = close(handle) == 0 && written;
+        bool replaced = written && std::rename(temp.c_str(), cachePath.c_str()) == 0;
+#endif
+        if (!replaced) {
+            std::remove(temp.c_str());
+            std::cerr << Color::YELLOW << "Warning: cannot write cache " << cachePath
+                      << Color::RESET << std::endl;
+        }
+    }
+    
+    /**
+     * Collect every process: one system-wide query where the backend has
+     * one, otherwise list PIDs once and read them (possibly in parallel)
+     */
+    void collectProcesses() {
+        *log << palette->cyan << "Collecting process information..." << palette->reset << std::endl;
+        
+        size_t before = table.records.size();
+        bool bulk;
+        {
+            PhaseTimer timer(*this, "collect");
+            bulk = collector->collectAll(table.records, table.strings, fields);
+            if (!bulk) timer.cancel();
+        }
+        if (bulk) {
+            dropForeign(table.records, before);
+        }
+        if (bulk) {
+            totalProcesses += static_cast<int>(table.records.size() - before);
+        } else {
+            std::vector<int> pids;
+            {
+                PhaseTimer timer(*this, "list");
+                if (!collector->listPids(pids)) {
+                    return;
+                }
+            }
+            PhaseTimer timer(*this, "read");
+            collectFromPids(pids);
+        }
+        
+        *log << palette->green << "Collected " << table.size() << " processes" << palette->reset << std::endl;
+    }
+    
+    /**
+     * Build the hierarchical tree structure
+     */
+    void buildTree() {
+        PhaseTimer timer(*this, "build");
+        table.build();
+        view = table.view();
+    }
+    
+    /**
+     * Collect only the subtree rooted at rootPid: breadth-first from the
+     * target, asking each level for its children directly, so the cost is
+     * O(subtree) rather than O(system). Returns false if child listing is
+     * unavailable, in which case nothing has been collected.
+     */
+    bool collectSubtree(int rootPid) {
+        PhaseTimer timer(*this, "subtree");
+        std::vector<int> level(1, rootPid);
+        std::vector<int> nextLevel;
+        bool first = true;
+        
+        while (!level.empty()) {
+            nextLevel.clear();
+            for (int pid : level) {
+                if (!collector->listChildren(pid, nextLevel) && first) {
+                    return false;
+                }
+            }
+            first = false;
+            collectFromPids(level);
+            level.swap(nextLevel);
+        }
+        return true;
+    }
+    
+    /**
+     * Read the threads of every --threads PID. The thread IDs are listed
+     * per process, then read spread across the collection workers, each
+     * interning into its own pool as collectFromPids() does. CPU% is the
+     * CPU time each thread used since the previous call, so a first call
+     * only takes the baseline.
+     */
+    void collectThreads() {
+        if (threadPids.empty() || snapshotView) return;
+        PhaseTimer timer(*this, "threads");
+        
+        auto now = std::chrono::steady_clock::now();
+        double elapsedUs = threadStart.empty() ? 0.0 :
+            std::chrono::duration<double, std::micro>(now - threadSampleTime).count();
+        
+        std::vector<uint64_t> tids;
+        std::vector<uint32_t> groupStart(1, 0);
+        for (int pid : threadPids) {
+            size_t begin = tids.size();
+            if (!collector->listThreads(pid, tids)) {
+                tids.resize(begin);
+            }
+            std::sort(tids.begin() + begin, tids.end());
+            groupStart.push_back(static_cast<uint32_t>(tids.size()));
+        }
+        
+        unsigned workers = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<StringPool> pools(workers);
+        std::vector<ThreadInfo> read(tids.size());
+        std::vector<uint32_t> readBy(tids.size(), 0);  // worker + 1, 0 = failed
+        parallelFor(tids.size(), workers, [&](unsigned id, size_t begin, size_t end) {
+            StringPool& strings = id == 0 ? table.strings : pools[id];
+            size_t k = 0;
+            for (size_t i = begin; i < end; i++) {
+                while (groupStart[k + 1] <= i) k++;
+                if (collector->readThread(threadPids[k], tids[i], read[i], strings)) {
+                    readBy[i] = id + 1;
+                }
+            }
+        });
+        
+        std::vector<ThreadInfo> previous;
+        std::vector<uint32_t> previousStart;
+        previous.swap(threadRecords);
+        previousStart.swap(threadStart);
+        threadStart.push_back(0);
+        for (size_t k = 0; k < threadPids.size(); k++) {
+            auto oldBegin = previous.begin() + (previousStart.empty() ? 0 : previousStart[k]);
+            auto oldEnd = previous.begin() + (previousStart.empty() ? 0 : previousStart[k + 1]);
+            for (uint32_t i = groupStart[k]; i < groupStart[k + 1]; i++) {
+                if (!readBy[i]) continue;
+                ThreadInfo info = read[i];
+                if (readBy[i] > 1) {
+                    info.name = table.strings.intern(pools[readBy[i] - 1].get(info.name));
+                }
+                auto old = std::lower_bound(oldBegin, oldEnd, info.tid,
+                                            [](const ThreadInfo& t, uint64_t tid) { return t.tid < tid; });
+                if (elapsedUs > 0 && old != oldEnd && old->tid == info.tid && info.cpu_time_us >= old->cpu_time_us) {
+                    info.cpu_percent = (info.cpu_time_us - old->cpu_time_us) * 100.0 / elapsedUs;
+                }
+                threadRecords.push_back(info);
+            }
+            threadStart.push_back(static_cast<uint32_t>(threadRecords.size()));
+        }
+        threadSampleTime = now;
+        
+        // Interning may have moved the pool
+        view = table.view();
+    }
+    
+    /**
+     * Compute cpu_percent for every collected process. The full collection
+     * is the first sample; after intervalMs the second pass re-reads only
+     * the CPU times (and start time, so a PID reused in between is not
+     * charged to the old process) and divides the delta by wall time.
+     */
+    void sampleCpu(unsigned intervalMs, std::chrono::steady_clock::time_point firstSample) {
+        std::this_thread::sleep_until(firstSample + std::chrono::milliseconds(intervalMs));
+        PhaseTimer timer(*this, "sample");
+        
+        auto secondStart = std::chrono::steady_clock::now();
+        std::vector<uint64_t> cpuTimes(table.records.size(), 0);
+        std::vector<char> valid(table.records.size(), 0);
+        
+        unsigned workers = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        parallelFor(table.records.size(), workers, [&](unsigned, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const ProcessInfo& proc = table.records[i];
+                uint64_t startTime = 0;
+                if (collector->readCpuTimes(proc.pid, cpuTimes[i], startTime) && startTime == proc.start_time) {
+                    valid[i] = 1;
+                }
+            }
+        });
+        auto secondEnd = std::chrono::steady_clock::now();
+        
+        // Both passes take time, so measure between their midpoints
+        double wallUs = std::chrono::duration<double, std::micro>(
+            secondStart + (secondEnd - secondStart) / 2 - firstSample).count();
+        if (wallUs <= 0) return;
+        
+        for (size_t i = 0; i < table.records.size(); i++) {
+            ProcessInfo& proc = table.records[i];
+            if (valid[i] && cpuTimes[i] >= proc.cpu_time_us) {
+                proc.cpu_percent = (cpuTimes[i] - proc.cpu_time_us) * 100.0 / wallUs;
+                proc.cpu_time_us = cpuTimes[i];
+            }
+        }
+    }
+    
+    /**
+     * Start a new walk: bumping the epoch forgets every previous visit in
+     * O(1); the mark array is only cleared when the epoch wraps around
+     */
+    void beginWalk() {
+        if (visitMark.size() != view.size()) {
+            visitMark.assign(view.size(), 0);
+            visitEpoch = 0;
+        }
+        if (++visitEpoch == 0) {
+            std::fill(visitMark.begin(), visitMark.end(), 0);
+            visitEpoch = 1;
+        }
+    }
+    
+    /**
+     * Pre-order walk of the subtree at `root` with an explicit stack, so
+     * deep PID chains cannot overflow the call stack. Calls
+     * visit(index, prefix, isLast) for each process not yet visited in
+     * the current walk; `prefix` is the tree-drawing indentation.
+     */
+    template <typename Visit>
+    void walkTree(uint32_t root, Visit visit) {
+        walkTree(root, visit, [](uint32_t) { return true; });
+    }
+    
+    /**
+     * Position of the first child at or after `from` that `keep` accepts
+     */
+    template <typename Keep>
+    uint32_t nextKept(uint32_t index, uint32_t from, Keep& keep) const {
+        uint32_t count = view.childCount(index);
+        const uint32_t* children = view.childrenBegin(index);
+        while (from < count && !keep(children[from])) from++;
+        return from;
+    }
+    
+    /**
+     * walkTree limited to the children `keep` accepts; isLast is decided
+     * among those. `rootLast` is passed for the root, for walks drawn
+     * under an outer entry that has more after it.
+     */
+    template <typename Visit, typename Keep>
+    void walkTree(uint32_t root, Visit visit, Keep keep, bool rootLast = true) {
+        if (visitMark[root] == visitEpoch) return;
+        visitMark[root] = visitEpoch;
+        
+        walkPrefix.clear();
+        walkStack.clear();
+        visit(root, walkPrefix, rootLast);
+        walkStack.push_back({root, nextKept(root, 0, keep), 0, rootLast});
+        
+        while (!walkStack.empty()) {
+            WalkFrame& frame = walkStack.back();
+            uint32_t count = view.childCount(frame.index);
+            if (frame.nextChild == count) {
+                walkStack.pop_back();
+                continue;
+            }
+            
+            uint32_t child = view.childrenBegin(frame.index)[frame.nextChild];
+            frame.nextChild = nextKept(frame.index, frame.nextChild + 1, keep);
+            bool isLastChild = frame.nextChild == count;
+            if (child >= view.size() || visitMark[child] == visitEpoch) continue;
+            visitMark[child] = visitEpoch;
+            
+            // Children are indented by this level's segment
+            walkPrefix.resize(frame.prefixLen);
+            walkPrefix.append(frame.isLast ? "    " : "│   ");
+            uint32_t childPrefixLen = static_cast<uint32_t>(walkPrefix.size());
+            visit(child, walkPrefix, isLastChild);
+            walkStack.push_back({child, nextKept(child, 0, keep), childPrefixLen, isLastChild});
+        }
+    }
+    
+    /**
+     * Display one process line of the tree
+     */
+    void displayTree(uint32_t index, const std::string& prefix, bool isLast, OutputBuffer& out) {
+        const char* connector = isLast ? "└── " : "├── ";
+        
+        out.append(prefix);
+        out.append(connector);
+        appendProcessLine(index, out);
+        
+        if (!threadPids.empty()) {
+            appendThreads(index, prefix, isLast, out);
+        }
+    }
+    
+    /**
+     * List a --threads process's threads as the first entries under it,
+     * ahead of its children
+     */
+    void appendThreads(uint32_t index, const std::string& prefix, bool isLast, OutputBuffer& out) {
+        int pid = view.records[index].pid;
+        auto it = std::lower_bound(threadPids.begin(), threadPids.end(), pid);
+        if (it == threadPids.end() || *it != pid || threadStart.empty()) return;
+        size_t k = static_cast<size_t>(it - threadPids.begin());
+        
+        bool hasChildren = view.childCount(index) > 0;
+        for (uint32_t i = threadStart[k]; i < threadStart[k + 1]; i++) {
+            const ThreadInfo& thread = threadRecords[i];
+            bool lastEntry = i + 1 == threadStart[k + 1] && !hasChildren;
+            out.append(prefix);
+            out.append(isLast ? "    " : "│   ");
+            out.append(lastEntry ? "└── " : "├── ");
+            out.append(palette->state(thread.status));
+            out.append('{');
+            out.append(view.string(thread.name));
+            out.append('}');
+            out.append(palette->reset);
+            out.append(palette->yellow);
+            out.append(" [TID: ");
+            out.appendNumber(static_cast<long long>(thread.tid));
+            out.append(']');
+            out.append(palette->reset);
+            out.append(' ');
+            out.append(thread.cpu_percent > 50 ? palette->red : palette->green);
+            out.append("CPU: ");
+            out.appendFixed1(thread.cpu_percent);
+            out.append('%');
+            out.append(palette->reset);
+            out.append('\n');
+        }
+    }
+    
+    /**
+     * Append one process (name colored by state, PID and the selected
+     * columns) and end the line
+     */
+    void appendProcessLine(uint32_t index, OutputBuffer& out) {
+        (this->*lineFormatter)(index, out);
+    }
+    
+    template <bool Colored>
+    static void paint(OutputBuffer& out, std::string_view code) {
+        if constexpr (Colored) out.append(code);
+    }
+    
+    /**
+     * appendProcessLine for one color/column combination: the column
+     * checks are resolved at compile time and, without color, no escape
+     * code is written at all
+     */
+    template <bool Colored, unsigned Columns>
+    void formatProcessLine(uint32_t index, OutputBuffer& out) {
+        const Palette& ink = COLORED_PALETTE;
+        const ProcessInfo& proc = view.records[index];
+        paint<Colored>(out, ink.state(proc.status));
+        paint<Colored>(out, ink.bright);
+        out.append(view.name(proc));
+        paint<Colored>(out, ink.reset);
+        paint<Colored>(out, ink.yellow);
+        out.append(" [PID: ", 7);
+        out.appendNumber(proc.pid);
+        out.append(']');
+        paint<Colored>(out, ink.reset);
+        
+        if constexpr ((Columns & COLUMN_RESOURCES) != 0) {
+            out.append(' ');
+            paint<Colored>(out, proc.cpu_percent > 50 ? ink.red : ink.green);
+            out.append("CPU: ", 5);
+            out.appendFixed1(proc.cpu_percent);
+            out.append('%');
+            paint<Colored>(out, ink.reset);
+            out.append(' ');
+            paint<Colored>(out, proc.memory_kb > 500*1024 ? ink.red : ink.yellow);
+            out.append("MEM: ", 5);
+            ProcessInfo::appendKb(proc.memory_kb, out);
+            paint<Colored>(out, ink.reset);
+        }
+        
+        if constexpr ((Columns & COLUMN_VERBOSE) != 0) {
+            out.append(' ');
+            paint<Colored>(out, ink.blue);
+            if (proc.username) {
+                out.append("User: ", 6);
+                out.append(view.string(proc.username));
+                out.append(' ');
+            }
+            out.append("Threads: ", 9);
+            out.appendNumber(proc.num_threads);
+            paint<Colored>(out, ink.reset);
+        }
+        
+        // Subtree totals, for processes that have descendants
+        if constexpr ((Columns & COLUMN_ROLLUP) != 0) {
+            const Rollup& total = shownRollups[index];
+            if (total.processes > 1) {
+                out.append(' ');
+                paint<Colored>(out, ink.magenta);
+                out.append("[subtree: ", 10);
+                out.appendNumber(total.processes);
+                out.append(" procs, CPU: ", 13);
+                out.appendFixed1(total.cpu_percent);
+                out.append("%, MEM: ", 8);
+                ProcessInfo::appendKb(total.memory_kb, out);
+                out.append(", Threads: ", 11);
+                out.appendNumber(total.num_threads);
+                out.append(']');
+                paint<Colored>(out, ink.reset);
+            }
+        }
+        
+        out.append('\n');
+    }
+    
+    template <bool Colored, unsigned... Columns>
+    static constexpr std::array<LineFormatter, sizeof...(Columns)>
+    lineFormatters(std::integer_sequence<unsigned, Columns...>) {
+        return {{&ProcessTree::formatProcessLine<Colored, Columns>...}};
+    }
+    
+    /**
+     * Set up for a render: rollups for the view, then the line formatter
+     * for the palette and the columns that are shown
+     */
+    void beginRender() {
+        prepareRollups();
+        static constexpr std::array<LineFormatter, COLUMN_COMBINATIONS> plain =
+            lineFormatters<false>(std::make_integer_sequence<unsigned, COLUMN_COMBINATIONS>());
+        static constexpr std::array<LineFormatter, COLUMN_COMBINATIONS> colored =
+            lineFormatters<true>(std::make_integer_sequence<unsigned, COLUMN_COMBINATIONS>());
+        unsigned columns = (showResources ? COLUMN_RESOURCES : 0u) | (verbose ? COLUMN_VERBOSE : 0u) |
+                           (shownRollups ? COLUMN_ROLLUP : 0u);
+        lineFormatter = (palette == &COLORED_PALETTE ? colored : plain)[columns];
+    }
+    
+    /**
+     * A process's own values as a one-process Rollup
+     */
+    static Rollup ownRollup(const ProcessInfo& proc) {
+        Rollup own;
+        own.memory_kb = proc.memory_kb;
+        own.cpu_percent = proc.cpu_percent;
+        own.num_threads = proc.num_threads;
+        own.processes = 1;
+        return own;
+    }
+    
+    /**
+     * Fill rollups for the whole view in one pass: a breadth-first sweep
+     * of the children arrays lists every parent before its children, so
+     * walking that order backwards is a post-order in which each total is
+     * complete when it is added to its parent's
+     */
+    void computeRollups() {
+        uint32_t n = static_cast<uint32_t>(view.size());
+        rollups.resize(n);
+        for (uint32_t i = 0; i < n; i++) {
+            rollups[i] = ownRollup(view.records[i]);
+        }
+        
+        rollupOrder.clear();
+        rollupParent.clear();
+        for (uint32_t r = 0; r < view.rootCount; r++) {
+            if (view.roots[r] >= n) continue;
+            rollupOrder.push_back(view.roots[r]);
+            rollupParent.push_back(ProcessTableView::npos);
+        }
+        // Bounded by n so a corrupt snapshot can't loop
+        for (size_t k = 0; k < rollupOrder.size() && rollupOrder.size() <= n; k++) {
+            uint32_t index = rollupOrder[k];
+            const uint32_t* children = view.childrenBegin(index);
+            for (uint32_t c = 0; c < view.childCount(index); c++) {
+                if (children[c] >= n) continue;
+                rollupOrder.push_back(children[c]);
+                rollupParent.push_back(index);
+            }
+        }
+        
+        for (size_t k = rollupOrder.size(); k-- > 0;) {
+            if (rollupParent[k] != ProcessTableView::npos) {
+                rollups[rollupParent[k]].add(rollups[rollupOrder[k]]);
+            }
+        }
+    }
+    
+    /**
+     * Pick the rollups for the render about to start; recomputes them if
+     * the topology changed or too many records did since the last pass
+     */
+    void prepareRollups() {
+        shownRollups = nullptr;
+        if (!rollupEnabled) return;
+        if (snapshotView && view.rollups) {
+            shownRollups = view.rollups;
+            return;
+        }
+        
+        bool current = !snapshotView && !rollupsDirty && rollupLinks == table.links &&
+                       rollups.size() == view.size();
+        if (!current) {
+            computeRollups();
+            rollupLinks = table.links;
+            rollupsDirty = snapshotView;
+        }
+        rollupUpdates = 0;
+        shownRollups = rollups.data();
+    }
+    
+    /**
+     * One live record changed in place (same index, same parent): add the
+     * difference to it and each of its ancestors. Once a large share of
+     * the table has changed since the last pass, a full pass is cheaper,
+     * so the totals are just marked stale.
+     */
+    void rollupDelta(uint32_t index, const ProcessInfo& before, const ProcessInfo& after) {
+        if (!rollupEnabled || rollupsDirty || rollupLinks != table.links || rollups.size() != table.size()) return;
+        if (before.memory_kb == after.memory_kb && before.num_threads == after.num_threads &&
+            before.cpu_percent == after.cpu_percent) return;
+        if (++rollupUpdates > table.size() / 8 + 16) {
+            rollupsDirty = true;
+            return;
+        }
+        
+        int64_t memory = static_cast<int64_t>(after.memory_kb) - static_cast<int64_t>(before.memory_kb);
+        int64_t threads = static_cast<int64_t>(after.num_threads) - before.num_threads;
+        double cpu = after.cpu_percent - before.cpu_percent;
+        for (uint32_t j = index; j != ProcessTable::npos; j = table.parents[j]) {
+            rollups[j].memory_kb += static_cast<uint64_t>(memory);
+            rollups[j].num_threads += threads;
+            rollups[j].cpu_percent += cpu;
+        }
+    }
+    
+    /**
+     * Render every root's tree into the buffer
+     */
+    void renderForest(OutputBuffer& out) {
+        beginRender();
+        if (groupByCgroup) {
+            renderCgroups(out);
+            return;
+        }
+        beginWalk();
+        for (uint32_t r = 0; r < view.rootCount; r++) {
+            if (view.roots[r] >= view.size()) continue;
+            walkTree(view.roots[r], [&](uint32_t index, const std::string& prefix, bool isLast) {
+                displayTree(index, prefix, isLast, out);
+            });
+        }
+    }
+    
+    /**
+     * Rebuild the cgroup nodes for the processes in `records`: every group
+     * path that holds a process, plus each ancestor path up to "/". Stats
+     * already read for a path are kept.
+     */
+    void buildCgroupNodes(const ProcessTableView& records) {
+        std::vector<std::string> paths;
+        uint32_t last = 0;
+        for (uint32_t i = 0; i < records.size(); i++) {
+            uint32_t handle = records.records[i].cgroup;
+            if (handle == 0 || handle == last) continue;
+            last = handle;
+            std::string path = records.string(handle);
+            while (!path.empty()) {
+                paths.push_back(path);
+                size_t slash = path.find_last_of('/');
+                if (slash == std::string::npos || path == "/") break;
+                path.resize(slash == 0 ? 1 : slash);
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        
+        std::vector<CgroupNode> previous;
+        previous.swap(cgroups);
+        for (std::string& path : paths) {
+            CgroupNode node;
+            auto old = std::lower_bound(previous.begin(), previous.end(), path,
+                                        [](const CgroupNode& n, const std::string& p) { return n.path < p; });
+            if (old != previous.end() && old->path == path) {
+                node = *old;
+            } else {
+                node.stats = CgroupStats();
+                node.cpuPercent = 0.0;
+                node.sampled = false;
+                node.path = std::move(path);
+            }
+            node.processes = 0;
+            
+            // The parent path is a prefix, so it sorts (and was added)
+            // earlier. It is looked up rather than tracked on a stack:
+            // "/a-b" and "/a.slice" sort between "/a" and "/a/b".
+            node.parent = ProcessTableView::npos;
+            if (node.path != "/") {
+                size_t slash = node.path.find_last_of('/');
+                if (slash != std::string::npos) {
+                    node.parent = cgroupIndex(node.path.substr(0, slash == 0 ? 1 : slash).c_str());
+                }
+            }
+            cgroups.push_back(std::move(node));
+        }
+    }
+    
+    /**
+     * Node index for a process's cgroup handle, or npos
+     */
+    uint32_t cgroupIndex(const char* path) const {
+        auto it = std::lower_bound(cgroups.begin(), cgroups.end(), path,
+                                   [](const CgroupNode& n, const char* p) { return n.path.compare(p) < 0; });
+        if (it == cgroups.end() || it->path != path) return ProcessTableView::npos;
+        return static_cast<uint32_t>(it - cgroups.begin());
+    }
+    
+    /**
+     * Read memory and CPU use once per cgroup (spread across the
+     * collection workers) for the live table. CPU% is the usage since the
+     * previous call, so a first call only takes the baseline.
+     */
+    void collectCgroups() {
+        if (!groupByCgroup || snapshotView) return;
+        PhaseTimer timer(*this, "cgroups");
+        buildCgroupNodes(table.view());
+        
+        auto now = std::chrono::steady_clock::now();
+        double elapsedUs = std::chrono::duration<double, std::micro>(now - cgroupSampleTime).count();
+        unsigned workers = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        parallelFor(cgroups.size(), workers, [&](unsigned, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                CgroupNode& node = cgroups[i];
+                CgroupStats previous = node.stats;
+                bool hadSample = node.sampled;
+                node.stats = CgroupStats();
+                node.sampled = collector->readCgroup(node.path, node.stats);
+                if (hadSample && previous.hasCpu && node.stats.hasCpu && elapsedUs > 0 &&
+                    node.stats.cpu_usage_us >= previous.cpu_usage_us) {
+                    node.cpuPercent = (node.stats.cpu_usage_us - previous.cpu_usage_us) * 100.0 / elapsedUs;
+                }
+            }
+        });
+        cgroupSampleTime = now;
+    }
+    
+    /**
+     * --group-by cgroup: the cgroup hierarchy, each group with its own
+     * memory and CPU use, and under it the process trees of its members
+     * (a process whose parent is in another group starts a tree)
+     */
+    void renderCgroups(OutputBuffer& out) {
+        buildCgroupNodes(view);
+        uint32_t n = static_cast<uint32_t>(view.size());
+        const uint32_t* parents = view.parents ? view.parents : parentsFromChildren();
+        
+        // Group of each process; processes with no cgroup share one
+        // extra bucket at the end
+        uint32_t unknown = static_cast<uint32_t>(cgroups.size());
+        std::vector<uint32_t> groupOf(n, unknown);
+        uint32_t lastHandle = 0;
+        uint32_t lastGroup = unknown;
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t handle = view.records[i].cgroup;
+            if (handle == 0) continue;
+            if (handle != lastHandle) {
+                lastHandle = handle;
+                lastGroup = cgroupIndex(view.string(handle));
+                if (lastGroup == ProcessTableView::npos) lastGroup = unknown;
+            }
+            groupOf[i] = lastGroup;
+        }
+        
+        // Per group: tree roots (PID order) and child groups, as ranges
+        std::vector<uint32_t> rootStart(cgroups.size() + 2, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            if (parents[i] == ProcessTableView::npos || groupOf[parents[i]] != groupOf[i]) {
+                rootStart[groupOf[i] + 1]++;
+            }
+        }
+        for (size_t g = 1; g < rootStart.size(); g++) rootStart[g] += rootStart[g - 1];
+        std::vector<uint32_t> groupRoots(rootStart.back());
+        std::vector<uint32_t> fill(rootStart.begin(), rootStart.end() - 1);
+        for (uint32_t i = 0; i < n; i++) {
+            if (parents[i] == ProcessTableView::npos || groupOf[parents[i]] != groupOf[i]) {
+                groupRoots[fill[groupOf[i]]++] = i;
+            }
+            if (groupOf[i] != unknown) cgroups[groupOf[i]].processes++;
+        }
+        // Parents precede children, so one reverse pass totals the counts
+        for (size_t g = cgroups.size(); g-- > 0;) {
+            if (cgroups[g].parent != ProcessTableView::npos) {
+                cgroups[cgroups[g].parent].processes += cgroups[g].processes;
+            }
+        }
+        std::vector<std::vector<uint32_t>> subgroups(cgroups.size());
+        std::vector<uint32_t> topGroups;
+        for (uint32_t g = 0; g < cgroups.size(); g++) {
+            (cgroups[g].parent == ProcessTableView::npos ? topGroups : subgroups[cgroups[g].parent]).push_back(g);
+        }
+        
+        beginRender();
+        beginWalk();
+        auto sameGroup = [&](uint32_t g) {
+            return [&groupOf, g](uint32_t index) { return index < groupOf.size() && groupOf[index] == g; };
+        };
+        
+        // Explicit stack of (group, prefix, isLast), children pushed in
+        // reverse so they come out in path order
+        struct Pending { uint32_t group; std::string prefix; bool isLast; };
+        std::vector<Pending> pending;
+        bool hasUnknown = rootStart[unknown + 1] > rootStart[unknown];
+        if (hasUnknown) pending.push_back({unknown, "", true});
+        for (size_t k = topGroups.size(); k-- > 0;) {
+            pending.push_back({topGroups[k], "", k + 1 == topGroups.size() && !hasUnknown});
+        }
+        
+        while (!pending.empty()) {
+            Pending entry = std::move(pending.back());
+            pending.pop_back();
+            uint32_t g = entry.group;
+            
+            out.append(entry.prefix);
+            out.append(entry.isLast ? "└── " : "├── ");
+            appendCgroupLine(g, out);
+            
+            std::string inner = entry.prefix + (entry.isLast ? "    " : "│   ");
+            const std::vector<uint32_t>* below = g < cgroups.size() ? &subgroups[g] : nullptr;
+            bool anyBelow = below && !below->empty();
+            for (uint32_t r = rootStart[g]; r < rootStart[g + 1]; r++) {
+                bool lastEntry = r + 1 == rootStart[g + 1] && !anyBelow;
+                walkTree(groupRoots[r], [&](uint32_t index, const std::string& prefix, bool isLast) {
+                    groupPrefix.assign(inner).append(prefix);
+                    displayTree(index, groupPrefix, isLast, out);
+                }, sameGroup(g), lastEntry);
+            }
+            if (anyBelow) {
+                for (size_t k = below->size(); k-- > 0;) {
+                    pending.push_back({(*below)[k], inner, k + 1 == below->size()});
+                }
+            }
+        }
+    }
+    
+    /**
+     * One group node: last path component, container ID if the name
+     * carries one, process count and the group's own accounting
+     */
+    void appendCgroupLine(uint32_t g, OutputBuffer& out) {
+        out.append(palette->magenta);
+        out.append(palette->bright);
+        if (g >= cgroups.size()) {
+            out.append("(no cgroup)");
+            out.append(palette->reset);
+            out.append('\n');
+            return;
+        }
+        
+        const CgroupNode& node = cgroups[g];
+        size_t slash = node.path.find_last_of('/');
+        std::string name = node.path == "/" || slash == std::string::npos ? node.path : node.path.substr(slash + 1);
+        out.append(name);
+        out.append(palette->reset);
+        
+        std::string container = containerId(name);
+        if (!container.empty()) {
+            out.append(palette->yellow);
+            out.append(" [container: ");
+            out.append(container);
+            out.append(']');
+            out.append(palette->reset);
+        }
+        out.append(palette->cyan);
+        out.append(" (");
+        out.appendNumber(node.processes);
+        out.append(node.processes == 1 ? " process)" : " processes)");
+        out.append(palette->reset);
+        
+        if (node.stats.hasMemory) {
+            out.append(' ');
+            out.append(palette->yellow);
+            out.append("MEM: ");
+            out.append(ProcessInfo::formatKb(node.stats.memory_bytes / 1024));
+            out.append(palette->reset);
+        }
+        if (node.stats.hasCpu && node.cpuPercent > 0) {
+            out.append(' ');
+            out.append(palette->green);
+            out.append("CPU: ");
+            out.appendFixed1(node.cpuPercent);
+            out.append('%');
+            out.append(palette->reset);
+        }
+        out.append('\n');
+    }
+    
+    /**
+     * Short container ID from a group name such as
+     * "cri-containerd-<64 hex>.scope", "docker-<64 hex>.scope" or a bare
+     * 64-digit ID; empty if there is none
+     */
+    static std::string containerId(const std::string& name) {
+        size_t run = 0;
+        for (size_t i = 0; i <= name.size(); i++) {
+            if (i < name.size() && std::isxdigit(static_cast<unsigned char>(name[i]))) {
+                run++;
+                continue;
+            }
+            if (run == 64) return name.substr(i - 64, 12);
+            run = 0;
+        }
+        return "";
+    }
+    
+    /**
+     * Render the subtree rooted at pid, with its title
+     */
+    void renderSubtree(int pid, OutputBuffer& out) {
+        beginRender();
+        uint32_t index = view.indexOf(pid);
+        if (index == ProcessTableView::npos) {
+            out.append(palette->red);
+            out.append("Process with PID ");
+            out.appendNumber(pid);
+            out.append(" not found");
+            out.append(palette->reset);
+            out.append('\n');
+            return;
+        }
+        
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append("Process Subtree for: ");
+        out.append(palette->bright);
+        out.append(view.name(view.records[index]));
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append("======================================================================");
+        out.append(palette->reset);
+        out.append("\n\n");
+        
+        beginWalk();
+        walkTree(index, [&](uint32_t node, const std::string& prefix, bool isLast) {
+            displayTree(node, prefix, isLast, out);
+        });
+    }
+    
+    /**
+     * Whether the tree is cut down to --find matches and/or --top and
+     * threshold picks
+     */
+    bool selecting() const {
+        return search.active() || filter.active();
+    }
+    
+    /**
+     * Select the processes that match --find and pass the filter, and mark
+     * each of them and its ancestors in findMark; returns the number
+     * selected. A walk that only enters marked children never visits a
+     * subtree without a selection.
+     */
+    size_t markMatches() {
+        PhaseTimer timer(*this, "find");
+        if (search.active()) {
+            search.match(view.strings, view.stringsSize, snapshotView ? view.generation : table.strings.generation());
+        }
+        selected.clear();
+        for (uint32_t i = 0; i < view.size(); i++) {
+            const ProcessInfo& proc = view.records[i];
+            if (search.active() && !search.matches(proc)) continue;
+            if (!filter.passes(proc)) continue;
+            selected.push_back(i);
+        }
+        filter.pickTop(selected, view.records);
+        
+        findMark.assign(view.size(), 0);
+        const uint32_t* parents = view.parents;
+        if (!parents && !selected.empty()) {
+            parents = parentsFromChildren();
+        }
+        for (uint32_t i : selected) {
+            for (uint32_t j = i; j != ProcessTableView::npos && !findMark[j]; j = parents[j]) {
+                findMark[j] = 1;
+            }
+        }
+        return selected.size();
+    }
+    
+    /**
+     * Invert the view's CSR child lists into findParents
+     */
+    const uint32_t* parentsFromChildren() {
+        findParents.assign(view.size(), ProcessTableView::npos);
+        for (uint32_t p = 0; p < view.size(); p++) {
+            const uint32_t* children = view.childrenBegin(p);
+            for (uint32_t k = 0; k < view.childCount(p); k++) {
+                if (children[k] < view.size()) findParents[children[k]] = p;
+            }
+        }
+        return findParents.data();
+    }
+    
+    /**
+     * Render the --find matches / --top picks with their ancestor chains,
+     * under a title
+     */
+    void renderMatches(OutputBuffer& out) {
+        beginRender();
+        size_t matched = markMatches();
+        std::string filters = filter.describe();
+        if (matched == 0) {
+            out.append(palette->red);
+            if (search.active()) {
+                out.append("No process matches ");
+                out.append(search.text());
+                if (!filters.empty()) out.append(" with " + filters);
+            } else {
+                out.append("No process with " + filters);
+            }
+            out.append(palette->reset);
+            out.append('\n');
+            return;
+        }
+        
+        out.append("\n");
+        out.append(palette->cyan);
+        if (search.active()) {
+            out.append("Processes matching: ");
+            out.append(palette->bright);
+            out.append(search.text());
+            out.append(palette->reset);
+            out.append(palette->cyan);
+            if (!filters.empty()) out.append(", " + filters);
+        } else {
+            out.append("Processes: " + filters);
+        }
+        out.append(" (");
+        out.appendNumber(static_cast<long long>(matched));
+        out.append(')');
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append("======================================================================");
+        out.append(palette->reset);
+        out.append("\n\n");
+        
+        auto keep = [&](uint32_t index) { return index < findMark.size() && findMark[index]; };
+        beginWalk();
+        for (uint32_t r = 0; r < view.rootCount; r++) {
+            if (!keep(view.roots[r])) continue;
+            walkTree(view.roots[r], [&](uint32_t index, const std::string& prefix, bool isLast) {
+                displayTree(index, prefix, isLast, out);
+            }, keep);
+        }
+    }
+    
+    /**
+     * Replace the table with a fresh system-wide collection, turning each
+     * surviving process's CPU time delta into cpu_percent
+     */
+    void adoptCollection(std::vector<ProcessInfo>& fresh, double elapsedUs) {
+        dropForeign(fresh, 0);
+        std::sort(fresh.begin(), fresh.end(),
+                  [](const ProcessInfo& a, const ProcessInfo& b) { return a.pid < b.pid; });
+        for (ProcessInfo& info : fresh) {
+            uint32_t i = table.indexOf(info.pid);
+            if (i == ProcessTable::npos) continue;
+            const ProcessInfo& old = table.records[i];
+            if (elapsedUs > 0 && info.start_time == old.start_time && info.cpu_time_us >= old.cpu_time_us) {
+                info.cpu_percent = (info.cpu_time_us - old.cpu_time_us) * 100.0 / elapsedUs;
+            }
+        }
+        table.records.swap(fresh);
+        table.link();
+        view = table.view();
+    }
+    
+    /**
+     * Incrementally update the table for one watch tick. The sorted PID
+     * list is merge-joined against the existing (sorted) records: known
+     * processes get a cheap readVolatile(), new ones and reused PIDs
+     * (start time changed) get a full readProcessInfo(), and vanished ones
+     * drop out. The merge keeps records in PID order, so no sort is needed
+     * and the CSR links are only redone when the topology changed. Where
+     * one system-wide query returns everything, that is used instead.
+     */
+    void refreshProcesses(double elapsedUs) {
+        auto readListed = [&](int pid, ProcessInfo& info) {
+            if (foreignOwner(pid)) return false;
+            if (!collector->readProcessInfo(pid, info, table.strings, fields)) {
+                collectionErrors++;
+                return false;
+            }
+            return !foreignOwner(info, table.strings);
+        };
+        std::vector<ProcessInfo> fresh;
+        if (collector->collectAll(fresh, table.strings, fields)) {
+            adoptCollection(fresh, elapsedUs);
+            return;
+        }
+        
+        std::vector<int> pids;
+        if (!collector->listPids(pids)) {
+            return;
+        }
+        std::sort(pids.begin(), pids.end());
+        
+        std::vector<ProcessInfo> next;
+        next.reserve(pids.size());
+        const std::vector<ProcessInfo>& prev = table.records;
+        bool topologyChanged = false;
+        size_t j = 0;
+        
+        for (int pid : pids) {
+            while (j < prev.size() && prev[j].pid < pid) {
+                j++;
+                topologyChanged = true;
+            }
+            
+            ProcessInfo info;
+            if (j < prev.size() && prev[j].pid == pid) {
+                const ProcessInfo& old = prev[j++];
+                info = old;
+                if (!collector->readVolatile(pid, info, table.strings)) {
+                    collectionErrors++;
+                    topologyChanged = true;
+                    continue;
+                }
+                if (info.start_time != old.start_time) {
+                    // Same PID, different process
+                    topologyChanged = true;
+                    info = ProcessInfo();
+                    if (!readListed(pid, info)) continue;
+                } else {
+                    if (info.name != old.name) {
+                        // A new name means an exec: the command line and
+                        // owner may have changed with it
+                        info = ProcessInfo();
+                        if (!readListed(pid, info)) {
+                            topologyChanged = true;
+                            continue;
+                        }
+                    }
+                    if (info.ppid != old.ppid) topologyChanged = true;
+                    if (elapsedUs > 0 && info.cpu_time_us >= old.cpu_time_us) {
+                        info.cpu_percent = (info.cpu_time_us - old.cpu_time_us) * 100.0 / elapsedUs;
+                    }
+                }
+            } else {
+                if (!readListed(pid, info)) continue;
+                topologyChanged = true;
+            }
+            next.push_back(info);
+        }
+        if (j < prev.size()) {
+            topologyChanged = true;
+        }
+        if (!topologyChanged) {
+            // Same processes at the same indices
+            for (size_t k = 0; k < next.size(); k++) {
+                rollupDelta(static_cast<uint32_t>(k), prev[k], next[k]);
+            }
+        }
+        
+        table.records.swap(next);
+        if (topologyChanged) {
+            table.link();
+        }
+        view = table.view();
+    }
+    
+    /**
+     * Watch tick when topology comes from lifecycle events: only the
+     * known records are re-read, nothing is listed (unless one
+     * system-wide query is cheaper anyway). A process that vanished
+     * without an event just drops out.
+     */
+    void refreshVolatile(double elapsedUs) {
+        std::vector<ProcessInfo> fresh;
+        if (collector->collectAll(fresh, table.strings, fields)) {
+            adoptCollection(fresh, elapsedUs);
+            return;
+        }
+        
+        bool topologyChanged = false;
+        size_t kept = 0;
+        for (size_t i = 0; i < table.records.size(); i++) {
+            ProcessInfo info = table.records[i];
+            if (!collector->readVolatile(info.pid, info, table.strings)) {
+                collectionErrors++;
+                topologyChanged = true;
+                continue;
+            }
+            const ProcessInfo& old = table.records[i];
+            if (info.ppid != old.ppid) topologyChanged = true;
+            if (elapsedUs > 0 && info.cpu_time_us >= old.cpu_time_us) {
+                info.cpu_percent = (info.cpu_time_us - old.cpu_time_us) * 100.0 / elapsedUs;
+            }
+            if (!topologyChanged) {
+                rollupDelta(static_cast<uint32_t>(i), old, info);
+            }
+            table.records[kept++] = info;
+        }
+        table.records.resize(kept);
+        if (topologyChanged) {
+            table.link();
+        }
+        view = table.view();
+    }
+    
+    /**
+     * Start following every process in the table (for per-PID sources)
+     */
+    void trackAll(ProcEventSource& events) {
+        for (const ProcessInfo& info : table.records) {
+            events.track(info.pid);
+        }
+    }
+    
+    /**
+     * Add a process that was just forked and we have no record of yet
+     */
+    bool addForked(ProcEventSource& events, int pid, int ppid) {
+        ProcessInfo info;
+        uint32_t parent = table.indexOf(ppid);
+        if (parent != ProcessTable::npos) {
+            info = table.records[parent];
+            info.pid = pid;
+            info.ppid = ppid;
+            info.num_threads = 1;
+            info.cpu_percent = 0.0;
+            info.cpu_time_us = 0;
+        } else if (foreignOwner(pid) || !collector->readProcessInfo(pid, info, table.strings, fields) ||
+                   foreignOwner(info, table.strings)) {
+            return false;
+        }
+        table.upsert(info);
+        events.track(pid);
+        return true;
+    }
+    
+    /**
+     * Apply queued lifecycle events. A fork copies the parent's record
+     * (same image until it execs), an exec re-reads the process, an exit
+     * drops it. Orphans are reparented before the exit is reported, so
+     * children of exited processes get their PPID re-read in one pass at
+     * the end. A fork with no child PID (kqueue) lists the parent's
+     * children instead. If events were lost, rescan everything.
+     * Returns true if the table changed.
+     */
+    bool applyEvents(ProcEventSource& events) {
+        if (events.overflowed()) {
+            events.reset();
+            table.clear();
+            collectProcesses();
+            buildTree();
+            trackAll(events);
+            return true;
+        }
+        
+        std::vector<int> exited;
+        std::vector<int> children;
+        ProcEventSource::Event ev;
+        bool changed = false;
+        while (events.next(ev)) {
+            ProcessInfo info;
+            switch (ev.type) {
+                case ProcEventSource::FORK:
+                    if (ev.pid != 0) {
+                        changed |= addForked(events, ev.pid, ev.ppid);
+                        break;
+                    }
+                    children.clear();
+                    collector->listChildren(ev.ppid, children);
+                    for (int child : children) {
+                        if (table.indexOf(child) == ProcessTable::npos) {
+                            changed |= addForked(events, child, ev.ppid);
+                        }
+                    }
+                    break;
+                case ProcEventSource::EXEC:
+                    // A setuid binary can change the owner, so --user is
+                    // checked again and a process it rules out dropped
+                    if (foreignOwner(ev.pid)) {
+                        changed |= table.erase(ev.pid);
+                        break;
+                    }
+                    if (!collector->readProcessInfo(ev.pid, info, table.strings, fields)) break;
+                    if (foreignOwner(info, table.strings)) {
+                        changed |= table.erase(ev.pid);
+                        break;
+                    }
+                    table.upsert(info);
+                    changed = true;
+                    break;
+                case ProcEventSource::EXIT:
+                    if (table.erase(ev.pid)) {
+                        exited.push_back(ev.pid);
+                        changed = true;
+                    }
+                    break;
+            }
+        }
+        
+        if (!exited.empty()) {
+            std::sort(exited.begin(), exited.end());
+            size_t kept = 0;
+            for (size_t i = 0; i < table.records.size(); i++) {
+                ProcessInfo info = table.records[i];
+                if (std::binary_search(exited.begin(), exited.end(), info.ppid) &&
+                    !collector->readVolatile(info.pid, info, table.strings)) {
+                    continue;
+                }
+                table.records[kept++] = info;
+            }
+            table.records.resize(kept);
+        }
+        
+        if (changed) {
+            table.link();
+            view = table.view();
+        }
+        return changed;
+    }
+    
+    /**
+     * Keep the table current for one step of watch or serve. Lifecycle
+     * events (with a source) are applied as they arrive, returning as
+     * soon as one changed the table; the tick schedule is kept. Otherwise
+     * waits for the next tick and refreshes: only the volatile fields when
+     * events keep the topology current (and only if any are collected),
+     * else with a rescan. Returns false once a stop is requested.
+     */
+    bool advance(ProcEventSource* events, std::chrono::steady_clock::duration interval,
+                 std::chrono::steady_clock::time_point& lastTick) {
+        if (Stats::enabled && Stats::ticks++ == 0) {
+            Stats::warmAllocations = Stats::allocations.load();
+        }
+        auto nextTick = lastTick + interval;
+        while (!stopRequested && std::chrono::steady_clock::now() < nextTick) {
+            auto wait = std::min<std::chrono::steady_clock::duration>(
+                nextTick - std::chrono::steady_clock::now(), std::chrono::milliseconds(100));
+            if (events) {
+                int ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count());
+                if (events->wait(ms)) {
+                    auto start = std::chrono::steady_clock::now();
+                    if (applyEvents(*events)) {
+                        refreshSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                        return true;
+                    }
+                }
+                continue;
+            }
+            std::this_thread::sleep_for(wait);
+        }
+        if (stopRequested) return false;
+        
+        auto now = std::chrono::steady_clock::now();
+        double elapsedUs = std::chrono::duration<double, std::micro>(now - lastTick).count();
+        if (!events) {
+            refreshProcesses(elapsedUs);
+        } else if (fields & (FIELD_MEMORY | FIELD_CPU)) {
+            refreshVolatile(elapsedUs);
+        }
+        collectThreads();
+        collectCgroups();
+        compactStrings();
+        lastTick = now;
+        refreshSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+        return true;
+    }
+    
+    /**
+     * Rebuild the string pool from the live handles once it has doubled
+     * since the last rebuild, so names and command lines of exited
+     * processes don't pile up over a long watch or daemon run
+     */
+    void compactStrings() {
+        size_t size = table.strings.buffer().size();
+        if (size < 64 * 1024 || size < 2 * compactedStrings) return;
+        
+        spareStrings.clear();
+        auto move = [&](uint32_t& handle) {
+            if (handle) handle = spareStrings.intern(table.strings.get(handle));
+        };
+        for (ProcessInfo& info : table.records) {
+            move(info.name);
+            move(info.username);
+            move(info.cmdline);
+            move(info.cgroup);
+        }
+        for (ThreadInfo& thread : threadRecords) {
+            move(thread.name);
+        }
+        table.strings.swap(spareStrings);
+        compactedStrings = table.strings.buffer().size();
+        view = table.view();
+    }
+    
+#ifndef _WIN32
+    /**
+     * Reader thread of serve(): accept connections on the shared
+     * non-blocking listener and answer one query per connection. Each
+     * reader renders with its own ProcessTree over the pinned snapshot,
+     * into memory: the pin is dropped before anything is sent, so a
+     * client that reads slowly holds up only its own reader, never
+     * publish(). Each connection gets a fixed time in all.
+     */
+    static void serveQueries(int listener, SnapshotExchange& exchange) {
+        ProcessTree reader;
+        OutputBuffer reply;
+        while (!stopRequested) {
+            struct pollfd pfd = {listener, POLLIN, 0};
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) continue;
+            
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            
+            std::string query;
+            if (readQuery(client, query, deadline)) {
+                {
+                    SnapshotExchange::Pin pin(exchange);
+                    reader.answer(query, pin.data(), reply);
+                }
+                std::string text = reply.release();
+                sendAll(client, text.data(), text.size(), deadline);
+                reply.reuse(std::move(text));
+            }
+            close(client);
+        }
+    }
+    
+    /**
+     * Milliseconds left until `deadline`, for poll(); 0 once it passed
+     */
+    static int remainingMs(std::chrono::steady_clock::time_point deadline) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        return left > 0 ? static_cast<int>(left) : 0;
+    }
+    
+    /**
+     * Write all of `data` to a non-blocking socket; false if the peer
+     * went away or `deadline` passed first
+     */
+    static bool sendAll(int fd, const char* data, size_t size, std::chrono::steady_clock::time_point deadline) {
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n > 0) {
+                data += n;
+                size -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return false;
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, remainingMs(deadline)) <= 0) return false;
+        }
+        return true;
+    }
+    
+    /**
+     * Read one request line (up to 4 KiB) from a non-blocking socket,
+     * giving up at `deadline`
+     */
+    static bool readQuery(int fd, std::string& query, std::chrono::steady_clock::time_point deadline) {
+        char buf[4096];
+        size_t used = 0;
+        while (used < sizeof(buf)) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, remainingMs(deadline)) <= 0) return false;
+            ssize_t n = read(fd, buf + used, sizeof(buf) - used);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (n <= 0) break;
+            used += static_cast<size_t>(n);
+            if (std::memchr(buf, '\n', used)) break;
+        }
+        query.assign(buf, used);
+        size_t end = query.find_first_of("\r\n");
+        if (end != std::string::npos) query.resize(end);
+        return !query.empty();
+    }
+    
+    /**
+     * Answer one daemon query from a published snapshot:
+     *   tree [--format FMT]   the whole tree (text, json, ndjson or bin)
+     *   subtree PID           one process and its descendants
+     *   find PATTERN [--regex] [--cmdline]
+     *                         matches with their ancestors, as --find
+     *   top N [--sort KEY]    the N heaviest processes (memory by default)
+     * Each also takes -r, -v, --rollup, --min-mem and --min-cpu as on the
+     * command line, and tree takes --top N --sort KEY
+     */
+    void answer(const std::string& query, const std::string& blob, OutputBuffer& out) {
+        std::vector<std::string> words;
+        size_t pos = 0;
+        while ((pos = query.find_first_not_of(' ', pos)) != std::string::npos) {
+            size_t end = query.find(' ', pos);
+            if (end == std::string::npos) end = query.size();
+            words.push_back(query.substr(pos, end - pos));
+            pos = end;
+        }
+        
+        showResources = false;
+        verbose = false;
+        palette = &PLAIN_PALETTE;
+        search = NameSearch();
+        filter = ResourceFilter();
+        ExportFormat format = FORMAT_TEXT;
+        bool regex = false;
+        bool cmdlines = false;
+        bool rollup = false;
+        std::vector<std::string> args;
+        for (size_t i = 0; i < words.size(); i++) {
+            if (words[i] == "--regex") {
+                regex = true;
+            } else if (words[i] == "--cmdline") {
+                cmdlines = true;
+            } else if (words[i] == "-r" || words[i] == "--resources") {
+                showResources = true;
+            } else if (words[i] == "-v" || words[i] == "--verbose") {
+                verbose = true;
+            } else if (words[i] == "--rollup") {
+                rollup = true;
+            } else if (words[i] == "--color") {
+                palette = &COLORED_PALETTE;
+            } else if (words[i] == "--top" && i + 1 < words.size()) {
+                filter.top = static_cast<size_t>(std::max(0, std::atoi(words[++i].c_str())));
+            } else if (words[i] == "--sort" && i + 1 < words.size() && ResourceFilter::parseKey(words[i + 1], filter.key)) {
+                i++;
+            } else if (words[i] == "--min-mem" && i + 1 < words.size() &&
+                       ResourceFilter::parseSize(words[i + 1], filter.minMemoryKb)) {
+                i++;
+            } else if (words[i] == "--min-cpu" && i + 1 < words.size()) {
+                filter.minCpu = std::max(0.0, std::atof(words[++i].c_str()));
+            } else if (words[i] == "--format" && i + 1 < words.size() && parseFormat(words[i + 1], format)) {
+                i++;
+            } else {
+                args.push_back(words[i]);
+            }
+        }
+        setRollups(rollup);
+        
+        ProcessTableView mapped;
+        std::string error;
+        if (!openSnapshot(blob.data(), blob.size(), mapped, loadedHost, loadedTimestamp, error)) {
+            out.append("Error: " + error + "\n");
             return;
         }
+        view = mapped;
+        snapshotView = true;
+        
+        const std::string command = args.empty() ? "tree" : args[0];
+        if (command == "tree" && args.size() <= 1) {
+            if (format == FORMAT_TEXT && filter.active()) {
+                displayHeader(out);
+                renderMatches(out);
+            } else {
+                exportSnapshot(out, format);
+            }
+        } else if (command == "subtree" && args.size() == 2) {
+            renderSubtree(std::atoi(args[1].c_str()), out);
+        } else if (command == "find" && args.size() == 2) {
+            NameSearch* cached = nullptr;
+            for (NameSearch& recent : recentSearches) {
+                if (recent.sameQuery(args[1], regex, cmdlines)) cached = &recent;
+            }
+            if (!cached) {
+                NameSearch fresh;
+                if (!fresh.setPattern(args[1], regex, cmdlines, error)) {
+                    out.append("Error: bad pattern: " + error + "\n");
+                    return;
+                }
+                if (recentSearches.size() >= 8) recentSearches.erase(recentSearches.begin());
+                recentSearches.push_back(std::move(fresh));
+                cached = &recentSearches.back();
+            }
+            std::swap(search, *cached);
+            renderMatches(out);
+            std::swap(search, *cached);
+        } else if (command == "top" && args.size() == 2) {
+            std::vector<uint32_t> order;
+            for (uint32_t i = 0; i < view.size(); i++) {
+                if (filter.passes(view.records[i])) order.push_back(i);
+            }
+            size_t n = std::min(order.size(), static_cast<size_t>(std::max(0, std::atoi(args[1].c_str()))));
+            std::partial_sort(order.begin(), order.begin() + n, order.end(), [&](uint32_t a, uint32_t b) {
+                return filter.heavier(view.records[a], view.records[b]);
+            });
+            beginRender();
+            for (size_t i = 0; i < n; i++) {
+                appendProcessLine(order[i], out);
+            }
+        } else {
+            out.append("Error: unknown query: " + query + "\n");
+        }
+    }
+#endif
+    
+    /**
+     * One rendered watch frame: its text and the lines in it. Watch keeps
+     * two and alternates, so the frame on screen stays intact to compare
+     * against while the next is drawn into the memory of the one before.
+     */
+    struct Frame {
+        OutputBuffer text;
+        std::vector<std::string_view> lines;
+    };
+    
+    /**
+     * Render the header and tree (or one subtree) into `frame`, replacing
+     * what it held
+     */
+    void renderFrame(int pid, Frame& frame) {
+        frame.text.clear();
+        displayHeader(frame.text);
+        if (pid >= 0) {
+            renderSubtree(pid, frame.text);
+        } else if (selecting()) {
+            renderMatches(frame.text);
+        } else {
+            renderForest(frame.text);
+        }
+        
+        frame.lines.clear();
+        std::string_view text(frame.text.str());
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == std::string_view::npos) end = text.size();
+            frame.lines.push_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    
+    static void moveCursor(OutputBuffer& out, size_t row) {
+        out.append("\033[");
+        out.appendNumber(static_cast<long long>(row + 1));
+        out.append(";1H");
+    }
+    
+    static int terminalRows() {
+#ifndef _WIN32
+        struct winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+            return ws.ws_row;
+        }
+#endif
+        return 50;
+    }
+    
+    static volatile std::sig_atomic_t stopRequested;
+    
+    static void handleStopSignal(int) {
+        stopRequested = 1;
+    }
+
+public:
+    ProcessTree(bool resources = false, bool verb = false) 
+        : snapshotView(false), loadedHost(0), loadedTimestamp(0), showResources(resources), verbose(verb),
+          palette(colorTerminal() ? &COLORED_PALETTE : &PLAIN_PALETTE),
+          lineFormatter(&ProcessTree::formatProcessLine<true, 0>), jobs(1), sampleMs(0), fields(FIELD_ALL),
+          totalProcesses(0), collectionErrors(0), cachedProcesses(0), visitEpoch(0),
+          rollupEnabled(false), rollupLinks(0), rollupsDirty(true), rollupUpdates(0), shownRollups(nullptr),
+          groupByCgroup(false), ownerHasUid(false), ownerUid(0),
+          log(&std::cout), segmentFailing(false), refreshSeconds(0.0), compactedStrings(0), collector(createPlatformCollector()) {
+        view = table.view();
+    }
+    
+    /**
+     * Replace the platform backend, e.g. with a LinuxCollector reading a
+     * synthetic /proc
+     */
+    void setCollector(std::unique_ptr<ProcessCollector> backend) {
+        collector = std::move(backend);
+    }
+    
+    /**
+     * Color the tree and messages on stdout (exports to files never are)
+     */
+    void setColor(bool enabled) {
+        palette = enabled ? &COLORED_PALETTE : &PLAIN_PALETTE;
+    }
+    
+    /**
+     * Set the number of collection threads (0 = one per hardware thread)
+     */
+    void setJobs(unsigned n) {
+        jobs = n;
+    }
+    
+    /**
+     * Choose which fields collection fills (CollectField bits). Backends
+     * skip the reads behind any field left out.
+     */
+    void setFields(uint32_t mask) {
+        fields = mask;
+    }
+    
+    /**
+     * Set the CPU sampling interval in milliseconds (0 = no sampling)
+     */
+    void setSampleInterval(unsigned ms) {
+        sampleMs = ms;
+    }
+    
+    /**
+     * Show (and export) --rollup subtree totals
+     */
+    void setRollups(bool enabled) {
+        rollupEnabled = enabled;
+        rollupsDirty = true;
+    }
+    
+    /**
+     * Set the --find pattern (a substring, or an ECMAScript regex) and
+     * whether command lines are searched too. Prints an error and returns
+     * false for a bad regex.
+     */
+    bool setSearch(const std::string& pattern, bool regex, bool searchCmdlines) {
+        std::string error;
+        if (!search.setPattern(pattern, regex, searchCmdlines, error)) {
+            std::cerr << Color::RED << "Error: Invalid pattern " << pattern << ": " << error
+                      << Color::RESET << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     * Show only processes owned by `user` (a name, or a numeric UID);
+     * prints an error and returns false for an unknown user
+     */
+    bool setUserFilter(const std::string& user) {
+        ownerFilter = user;
+        ownerHasUid = false;
+#ifndef _WIN32
+        uid_t uid;
+        if (!UserNames::findUid(user, uid)) {
+            std::cerr << Color::RED << "Error: Unknown user " << user << Color::RESET << std::endl;
+            return false;
+        }
+        ownerHasUid = true;
+        ownerUid = static_cast<uint32_t>(uid);
+        // Compared against resolved names, so a numeric UID must become one
+        ownerFilter = UserNames::instance().lookup(uid);
+#endif
+        return true;
+    }
+    
+    /**
+     * Show the tree grouped by cgroup (--group-by cgroup)
+     */
+    void setGroupByCgroup(bool enabled) {
+        groupByCgroup = enabled;
+        cgroups.clear();
+    }
+    
+    /**
+     * Keep the static fields of every process in a file between runs
+     * (--cache), so a process seen before is only re-read for what
+     * changes. Takes effect in snapshot().
+     */
+    void setCache(const std::string& path) {
+        cachePath = path;
+    }
+    
+    /**
+     * Processes whose threads are listed under them (--threads)
+     */
+    void setThreadPids(std::vector<int> pids) {
+        std::sort(pids.begin(), pids.end());
+        pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+        threadPids = pids;
+        threadRecords.clear();
+        threadStart.clear();
+    }
+    
+    /**
+     * Set the --top / --min-mem / --min-cpu filter the tree is cut down to
+     */
+    void setFilter(const ResourceFilter& heavy) {
+        filter = heavy;
+    }
+    
+    /**
+     * Redirect progress messages ("Collecting process information...")
+     */
+    void setLogStream(std::ostream& stream) {
+        log = &stream;
+    }
+    
+    /**
+     * Live, top-style watch mode. The tree stays resident and is updated
+     * in place every interval; only terminal rows whose text changed since
+     * the previous frame are repainted. Runs until SIGINT/SIGTERM.
+     *
+     * If the backend has a lifecycle event source and it can be opened
+     * (proc connector, kqueue, ETW; usually needs elevated rights), forks,
+     * execs and exits are applied as they arrive and repainted right
+     * away; interval ticks then only refresh the resource columns and
+     * cost nothing when those aren't shown. Otherwise every tick rescans.
+     */
+    void watch(double intervalSec, int pid = -1) {
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(intervalSec));
+        std::signal(SIGINT, handleStopSignal);
+        std::signal(SIGTERM, handleStopSignal);
+        
+        // Subscribe before the initial scan so nothing falls in between;
+        // events already reflected in the scan are idempotent to replay
+        std::unique_ptr<ProcEventSource> events = collector->eventSource();
+        bool eventDriven = events && events->open();
+        
+        collectProcesses();
+        buildTree();
+        if (eventDriven) {
+            trackAll(*events);
+        }
         
-        for (int i = 0; i < numPids; i++) {
-            if (pids[i] == 0) continue;
+        Frame frames[2];
+        Frame* shown = &frames[0];
+        Frame* next = &frames[1];
+        OutputBuffer out(OutputBuffer::standardOutput());
+        auto lastTick = std::chrono::steady_clock::now();
+        std::cout << "\033[?25l\033[2J" << std::flush;
+        
+        while (!stopRequested) {
+            renderFrame(pid, *next);
+            std::vector<std::string_view>& lines = next->lines;
+            size_t rows = static_cast<size_t>(terminalRows());
+            if (lines.size() > rows - 1) lines.resize(rows - 1);
             
-            ProcessInfo info;
-            if (readProcessInfo(pids[i], info)) {
-                processes[pids[i]] = info;
-                totalProcesses++;
+            for (size_t row = 0; row < lines.size(); row++) {
+                if (row < shown->lines.size() && shown->lines[row] == lines[row]) continue;
+                moveCursor(out, row);
+                out.append(lines[row]);
+                out.append("\033[K");
+            }
+            if (lines.size() < shown->lines.size()) {
+                moveCursor(out, lines.size());
+                out.append("\033[J");
+            }
+            out.flush();
+            std::swap(shown, next);
+            
+            if (!advance(eventDriven ? events.get() : nullptr, interval, lastTick)) break;
+        }
+        
+        moveCursor(out, shown->lines.size());
+        out.append("\033[?25h");
+    }
+    
+#ifndef _WIN32
+    /**
+     * Resident daemon: keep the table current (like watch, without the
+     * screen) and answer queries on a Unix domain socket until
+     * SIGINT/SIGTERM. After every change the table is serialized in the
+     * binary snapshot format and published through a SnapshotExchange;
+     * reader threads answer from the snapshot that was current when each
+     * query arrived. With a shmName every snapshot is also published
+     * into that shared-memory segment (see SharedSegment). Returns false
+     * if the socket or segment can't be set up.
+     */
+    bool serve(const std::string& socketPath, double intervalSec, const std::string& shmName = "") {
+        std::string error;
+        int listener = listenUnixSocket(socketPath, error);
+        if (listener < 0) {
+            std::cerr << Color::RED << "Error: " << error << Color::RESET << std::endl;
+            return false;
+        }
+        // Only once the socket is ours: a second daemon must not touch
+        // the segment of the one already running
+        SharedSnapshotWriter shared;
+        if (!shmName.empty() && !shared.open(shmName, error)) {
+            std::cerr << Color::RED << "Error: " << error << Color::RESET << std::endl;
+            close(listener);
+            unlink(socketPath.c_str());
+            return false;
+        }
+        SharedSnapshotWriter* segment = shmName.empty() ? nullptr : &shared;
+        // Published snapshots carry the totals so --rollup queries are free
+        setRollups(true);
+        
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(intervalSec));
+        std::signal(SIGINT, handleStopSignal);
+        std::signal(SIGTERM, handleStopSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+        
+        std::unique_ptr<ProcEventSource> events = collector->eventSource();
+        bool eventDriven = events && events->open();
+        
+        collectProcesses();
+        buildTree();
+        if (eventDriven) {
+            trackAll(*events);
+        }
+        
+        SnapshotExchange exchange;
+        publish(exchange, segment);
+        *log << palette->green << "Serving process snapshots on " << socketPath
+             << palette->reset << std::endl;
+        
+        unsigned readers = std::min(4u, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < readers; i++) {
+            workers.emplace_back([listener, &exchange] { serveQueries(listener, exchange); });
+        }
+        
+        auto lastTick = std::chrono::steady_clock::now();
+        while (advance(eventDriven ? events.get() : nullptr, interval, lastTick)) {
+            publish(exchange, segment);
+        }
+        
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        close(listener);
+        unlink(socketPath.c_str());
+        return true;
+    }
+#endif
+    
+#ifndef _WIN32
+    /**
+     * What --serve-metrics labels its series with. Per-PID series give
+     * the most detail but one series per process; the others sum the
+     * processes sharing a name, user or cgroup into one series each.
+     */
+    enum MetricLabel { METRICS_BY_NAME, METRICS_BY_USER, METRICS_BY_CGROUP, METRICS_BY_PID };
+    
+    static bool parseMetricLabel(const std::string& name, MetricLabel& label) {
+        if (name == "name") label = METRICS_BY_NAME;
+        else if (name == "user") label = METRICS_BY_USER;
+        else if (name == "cgroup") label = METRICS_BY_CGROUP;
+        else if (name == "pid") label = METRICS_BY_PID;
+        else return false;
+        return true;
+    }
+    
+    /**
+     * Prometheus/OpenMetrics exporter: keep the table current (as the
+     * daemon does) and serve GET /metrics over HTTP at "[HOST]:PORT".
+     * The response body is rendered once per tick and published
+     * through a SnapshotExchange, so a scrape only copies a finished
+     * buffer. Returns false if the port can't be bound.
+     */
+    bool serveMetrics(const std::string& address, double intervalSec, MetricLabel label) {
+        std::string error;
+        int listener = listenTcpSocket(address, error);
+        if (listener < 0) {
+            std::cerr << Color::RED << "Error: " << error << Color::RESET << std::endl;
+            return false;
+        }
+        // Subtree series come from the rollups
+        setRollups(true);
+        
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(intervalSec));
+        std::signal(SIGINT, handleStopSignal);
+        std::signal(SIGTERM, handleStopSignal);
+        std::signal(SIGPIPE, SIG_IGN);
+        
+        std::unique_ptr<ProcEventSource> events = collector->eventSource();
+        bool eventDriven = events && events->open();
+        
+        auto start = std::chrono::steady_clock::now();
+        collectProcesses();
+        buildTree();
+        if (eventDriven) {
+            trackAll(*events);
+        }
+        refreshSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        SnapshotExchange exchange;
+        std::string body;
+        auto render = [&] {
+            OutputBuffer text;
+            text.reuse(std::move(body));
+            renderMetrics(text, label);
+            body = text.release();
+            exchange.publish(body);
+        };
+        render();
+        *log << palette->green << "Serving metrics on " << address << "/metrics"
+             << palette->reset << std::endl;
+        
+        std::thread scraper([listener, &exchange] { serveScrapes(listener, exchange); });
+        
+        // Events keep the table exact; the body is only rendered per tick
+        auto lastTick = std::chrono::steady_clock::now();
+        auto rendered = lastTick;
+        while (advance(eventDriven ? events.get() : nullptr, interval, lastTick)) {
+            if (lastTick != rendered) {
+                render();
+                rendered = lastTick;
+            }
+        }
+        
+        scraper.join();
+        close(listener);
+        return true;
+    }
+    
+    /**
+     * The OpenMetrics text for the current table: per-series process
+     * count, resident memory, threads and CPU, the same for their
+     * subtrees, and the exporter's own collection time and errors
+     */
+    void renderMetrics(OutputBuffer& out, MetricLabel label) {
+        prepareRollups();
+        groupMetrics(label);
+        
+        static const struct {
+            const char* name;
+            const char* unit;
+            bool subtree;
+            const char* help;
+        } families[] = {
+            {"process_tree_processes", nullptr, false, "Processes in the series"},
+            {"process_tree_resident_bytes", "bytes", false, "Resident memory of the processes"},
+            {"process_tree_threads", nullptr, false, "Threads of the processes"},
+            {"process_tree_cpu_percent", nullptr, false, "CPU use of the processes, percent of one core"},
+            {"process_tree_subtree_processes", nullptr, true, "Processes in the subtrees"},
+            {"process_tree_subtree_resident_bytes", "bytes", true, "Resident memory of the subtrees"},
+            {"process_tree_subtree_threads", nullptr, true, "Threads of the subtrees"},
+            {"process_tree_subtree_cpu_percent", nullptr, true, "CPU use of the subtrees, percent of one core"},
+        };
+        for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+            appendMetricHeader(out, families[f].name, "gauge", families[f].unit, families[f].help);
+            for (const MetricGroup& group : metricGroups) {
+                const Rollup& total = families[f].subtree ? group.subtree : group.own;
+                // Per PID, a subtree series only for processes with children
+                if (families[f].subtree && total.processes <= (label == METRICS_BY_PID ? 1u : 0u)) continue;
+                out.append(families[f].name);
+                appendMetricLabels(group.first, label, out);
+                out.append(' ');
+                switch (f % 4) {
+                case 0: out.appendNumber(total.processes); break;
+                case 1: out.appendNumber(static_cast<long long>(total.memory_kb * 1024)); break;
+                case 2: out.appendNumber(static_cast<long long>(total.num_threads)); break;
+                default: out.appendFixed1(total.cpu_percent); break;
+                }
+                out.append('\n');
+            }
+        }
+        
+        char value[32];
+        appendMetricHeader(out, "process_tree_collection_seconds", "gauge", "seconds",
+                           "Time the last collection or refresh took");
+        snprintf(value, sizeof(value), "%.6f", refreshSeconds);
+        out.append("process_tree_collection_seconds ");
+        out.append(value);
+        out.append('\n');
+        appendMetricHeader(out, "process_tree_collection_errors", "counter", nullptr,
+                           "Processes that could not be read");
+        out.append("process_tree_collection_errors_total ");
+        out.appendNumber(collectionErrors);
+        out.append("\n# EOF\n");
+    }
+    
+    /**
+     * Sort the records into metricGroups by label and total each group,
+     * itself and its subtrees. A member's subtree is only added if no
+     * ancestor is a member too, so nested members aren't counted twice.
+     */
+    void groupMetrics(MetricLabel label) {
+        uint32_t n = static_cast<uint32_t>(view.size());
+        metricGroups.clear();
+        if (label == METRICS_BY_PID) {
+            for (uint32_t i = 0; i < n; i++) {
+                metricGroups.push_back({i, ownRollup(view.records[i]), shownRollups[i]});
+            }
+            return;
+        }
+        
+        auto key = [&](uint32_t index) {
+            const ProcessInfo& proc = view.records[index];
+            return view.string(label == METRICS_BY_USER ? proc.username :
+                               label == METRICS_BY_CGROUP ? proc.cgroup : proc.name);
+        };
+        metricOrder.resize(n);
+        for (uint32_t i = 0; i < n; i++) metricOrder[i] = i;
+        std::sort(metricOrder.begin(), metricOrder.end(), [&](uint32_t a, uint32_t b) {
+            int order = std::strcmp(key(a), key(b));
+            return order != 0 ? order < 0 : a < b;
+        });
+        metricGroupOf.resize(n);
+        for (uint32_t k = 0; k < n; k++) {
+            uint32_t index = metricOrder[k];
+            if (k == 0 || std::strcmp(key(metricOrder[k - 1]), key(index)) != 0) {
+                metricGroups.push_back({index, Rollup(), Rollup()});
+            }
+            metricGroupOf[index] = static_cast<uint32_t>(metricGroups.size() - 1);
+            metricGroups.back().own.add(ownRollup(view.records[index]));
+        }
+        
+        // Depth-first over the forest, counting how many members of each
+        // group are on the current path
+        metricOpen.assign(metricGroups.size(), 0);
+        auto enter = [&](uint32_t index) {
+            uint32_t group = metricGroupOf[index];
+            if (metricOpen[group]++ == 0) metricGroups[group].subtree.add(shownRollups[index]);
+            metricStack.push_back({index, 0});
+        };
+        for (uint32_t r = 0; r < view.rootCount; r++) {
+            if (view.roots[r] >= n) continue;
+            metricStack.clear();
+            enter(view.roots[r]);
+            while (!metricStack.empty()) {
+                std::pair<uint32_t, uint32_t>& top = metricStack.back();
+                if (top.second < view.childCount(top.first)) {
+                    uint32_t child = view.childrenBegin(top.first)[top.second++];
+                    if (child < n && metricStack.size() <= n) enter(child);
+                    continue;
+                }
+                metricOpen[metricGroupOf[top.first]]--;
+                metricStack.pop_back();
+            }
+        }
+    }
+    
+    static void appendMetricHeader(OutputBuffer& out, const char* name, const char* type,
+                                   const char* unit, const char* help) {
+        out.append("# TYPE ");
+        out.append(name);
+        out.append(' ');
+        out.append(type);
+        out.append('\n');
+        if (unit) {
+            out.append("# UNIT ");
+            out.append(name);
+            out.append(' ');
+            out.append(unit);
+            out.append('\n');
+        }
+        out.append("# HELP ");
+        out.append(name);
+        out.append(' ');
+        out.append(help);
+        out.append(".\n");
+    }
+    
+    void appendMetricLabels(uint32_t index, MetricLabel label, OutputBuffer& out) {
+        const ProcessInfo& proc = view.records[index];
+        switch (label) {
+        case METRICS_BY_PID:
+            out.append("{pid=\"");
+            out.appendNumber(proc.pid);
+            out.append("\",name=");
+            appendLabelValue(view.name(proc), out);
+            break;
+        case METRICS_BY_USER:
+            out.append("{user=");
+            appendLabelValue(view.string(proc.username), out);
+            break;
+        case METRICS_BY_CGROUP:
+            out.append("{cgroup=");
+            appendLabelValue(view.string(proc.cgroup), out);
+            break;
+        default:
+            out.append("{name=");
+            appendLabelValue(view.name(proc), out);
+            break;
+        }
+        out.append('}');
+    }
+    
+    /**
+     * A quoted label value, escaping backslash, quote and newline
+     */
+    static void appendLabelValue(const char* str, OutputBuffer& out) {
+        out.append('"');
+        for (const char* p = str; *p; p++) {
+            if (*p == '\\' || *p == '"') {
+                out.append('\\');
+                out.append(*p);
+            } else if (*p == '\n') {
+                out.append("\\n");
             } else {
-                collectionErrors++;
+                out.append(*p);
+            }
+        }
+        out.append('"');
+    }
+    
+    /**
+     * One scrape connection of serveScrapes(): the request head read so
+     * far, then the response and how much of it has been sent
+     */
+    struct Scrape {
+        int fd = -1;
+        std::string request;
+        std::string response;
+        size_t sent = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    
+    /**
+     * Scrape thread of serveMetrics(): multiplex up to 64 connections
+     * over one poll loop, answering GET /metrics with a copy of the
+     * published body. Every connection gets five seconds in all to send
+     * its request and take the response, so a slow client can only hold
+     * one slot and never the snapshot
+     */
+    static void serveScrapes(int listener, SnapshotExchange& exchange) {
+        const size_t maxScrapes = 64;
+        std::vector<Scrape> scrapes;
+        std::vector<struct pollfd> fds;
+        while (!stopRequested) {
+            fds.clear();
+            fds.push_back({listener, static_cast<short>(scrapes.size() < maxScrapes ? POLLIN : 0), 0});
+            for (const Scrape& scrape : scrapes) {
+                fds.push_back({scrape.fd, static_cast<short>(scrape.response.empty() ? POLLIN : POLLOUT), 0});
+            }
+            if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR) break;
+            
+            auto now = std::chrono::steady_clock::now();
+            size_t kept = 0;
+            for (size_t i = 0; i < scrapes.size(); i++) {
+                if (now < scrapes[i].deadline && !advanceScrape(scrapes[i], fds[i + 1].revents, exchange)) {
+                    if (kept != i) scrapes[kept] = std::move(scrapes[i]);
+                    kept++;
+                } else {
+                    close(scrapes[i].fd);
+                }
+            }
+            scrapes.resize(kept);
+            
+            while ((fds[0].revents & POLLIN) && scrapes.size() < maxScrapes) {
+                int client = accept(listener, nullptr, nullptr);
+                if (client < 0) break;
+                fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+                int one = 1;
+                setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+                Scrape scrape;
+                scrape.fd = client;
+                scrape.deadline = now + std::chrono::seconds(5);
+                scrapes.push_back(std::move(scrape));
+            }
+        }
+        for (const Scrape& scrape : scrapes) {
+            close(scrape.fd);
+        }
+    }
+    
+    /**
+     * Move one connection along after poll(): read more of its request
+     * head (up to 8 KiB), answer it once complete, and send what the
+     * socket will take. True when the connection is finished with
+     */
+    static bool advanceScrape(Scrape& scrape, short revents, SnapshotExchange& exchange) {
+        bool answered = false;
+        if (scrape.response.empty()) {
+            if (!revents) return false;
+            char buf[4096];
+            ssize_t n = read(scrape.fd, buf, std::min(sizeof(buf), 8192 - scrape.request.size()));
+            if (n < 0) return errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK;
+            if (n > 0) scrape.request.append(buf, static_cast<size_t>(n));
+            if (n > 0 && scrape.request.size() < 8192 && scrape.request.find("\r\n\r\n") == std::string::npos) {
+                return false;
+            }
+            if (scrape.request.find(' ') == std::string::npos) return true;
+            answerScrape(scrape.request, scrape.response, exchange);
+            answered = true;
+        }
+        if (!answered && !revents) return false;
+        while (scrape.sent < scrape.response.size()) {
+            ssize_t n = write(scrape.fd, scrape.response.data() + scrape.sent, scrape.response.size() - scrape.sent);
+            if (n > 0) {
+                scrape.sent += static_cast<size_t>(n);
+                continue;
             }
+            if (n < 0 && errno == EINTR) continue;
+            return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        return true;
+    }
+    
+    /**
+     * The HTTP response to one request head; the body is copied out of
+     * the exchange under a pin held only for the copy
+     */
+    static void answerScrape(const std::string& request, std::string& response, SnapshotExchange& exchange) {
+        OutputBuffer out;
+        bool get = request.compare(0, 4, "GET ") == 0 || request.compare(0, 5, "HEAD ") == 0;
+        size_t pathStart = request.find(' ') + 1;
+        std::string path = request.substr(pathStart, request.find(' ', pathStart) - pathStart);
+        path.resize(std::min(path.size(), path.find('?')));
+        if (!get) {
+            out.append("HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        } else if (path != "/metrics") {
+            out.append("HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+                       "Content-Length: 10\r\nConnection: close\r\n\r\nNot found\n");
+        } else {
+            SnapshotExchange::Pin pin(exchange);
+            out.append("HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                       "Content-Length: ");
+            out.appendNumber(static_cast<long long>(pin.data().size()));
+            out.append("\r\nConnection: close\r\n\r\n");
+            if (request[0] == 'G') out.append(pin.data());
         }
-        
-        std::cout << Color::GREEN << "Collected " << processes.size() << " processes" << Color::RESET << std::endl;
+        response = out.release();
     }
 #endif
-
+    
     /**
-     * Windows-specific: Use CreateToolhelp32Snapshot API
+     * Collect, sample and link one snapshot without displaying it. With a
+     * subtreeRoot only that process and its descendants are collected
+     * (falling back to a full scan where the platform can't list children)
      */
-#ifdef _WIN32
-    std::string wideToString(const WCHAR* wstr) {
-        if (!wstr) return "";
-        int size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, nullptr, 0, nullptr, nullptr);
-        std::string str(size, 0);
-        WideCharToMultiByte(CP_UTF8, 0, wstr, -1, &str[0], size, nullptr, nullptr);
-        return str;
+    void snapshot(int subtreeRoot = -1) {
+        if (!cachePath.empty()) {
+            openCache();
+        }
+        auto collectStart = std::chrono::steady_clock::now();
+        bool full = subtreeRoot < 0 || !collectSubtree(subtreeRoot);
+        if (full) {
+            collectProcesses();
+        }
+        collectThreads();
+        collectCgroups();
+        if (sampleMs > 0 && (fields & FIELD_CPU)) {
+            auto collectEnd = std::chrono::steady_clock::now();
+            sampleCpu(sampleMs, collectStart + (collectEnd - collectStart) / 2);
+            collectThreads();
+            collectCgroups();
+        }
+        buildTree();
+        // A subtree would leave everything else out of the next run's cache
+        if (!cachePath.empty() && full) {
+            saveCache();
+        }
     }
     
-    bool readProcessInfo(DWORD pid, ProcessInfo& info) {
-        info.pid = pid;
-        
-        HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, pid);
-        if (!hProcess) {
+    /**
+     * Main execution flow
+     */
+    void run() {
+        snapshot();
+        display();
+    }
+    
+    /**
+     * Print the header and the full tree of the current snapshot
+     */
+    void display() {
+        std::cout.flush();
+        PhaseTimer timer(*this, "render");
+        OutputBuffer out(OutputBuffer::standardOutput());
+        displayHeader(out);
+        renderForest(out);
+    }
+    
+    /**
+     * Use a saved binary snapshot instead of collecting. The file is
+     * memory-mapped and rendered in place; records are never copied, so
+     * opening costs page faults, not parsing.
+     */
+    bool loadSnapshot(const std::string& filename) {
+        PhaseTimer timer(*this, "load");
+        std::unique_ptr<MappedFile> file(new MappedFile());
+        if (!file->map(filename)) {
+            std::cerr << Color::RED << "Error: Cannot open snapshot " << filename 
+                      << Color::RESET << std::endl;
             return false;
         }
         
-        // Get process name
-        WCHAR processName[MAX_PATH];
-        if (GetModuleBaseNameW(hProcess, nullptr, processName, MAX_PATH)) {
-            info.name = wideToString(processName);
-        }
-        
-        // Get memory info
-        PROCESS_MEMORY_COUNTERS pmc;
-        if (GetProcessMemoryInfo(hProcess, &pmc, sizeof(pmc))) {
-            info.memory_kb = pmc.WorkingSetSize / 1024;
-        }
-        
-        // Get thread count
-        DWORD threadCount = 0;
-        HANDLE hThreadSnap = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
-        if (hThreadSnap != INVALID_HANDLE_VALUE) {
-            THREADENTRY32 te32;
-            te32.dwSize = sizeof(THREADENTRY32);
-            if (Thread32First(hThreadSnap, &te32)) {
-                do {
-                    if (te32.th32OwnerProcessID == pid) {
-                        threadCount++;
-                    }
-                } while (Thread32Next(hThreadSnap, &te32));
-            }
-            CloseHandle(hThreadSnap);
+        ProcessTableView mapped;
+        std::string error;
+        if (!openSnapshot(file->data(), file->size(), mapped, loadedHost, loadedTimestamp, error)) {
+            std::cerr << Color::RED << "Error: " << filename << ": " << error 
+                      << Color::RESET << std::endl;
+            return false;
         }
-        info.num_threads = threadCount;
         
-        CloseHandle(hProcess);
+        loaded = std::move(file);
+        view = mapped;
+        snapshotView = true;
         return true;
     }
     
-    void collectProcesses() {
-        std::cout << Color::CYAN << "Collecting process information..." << Color::RESET << std::endl;
-        
-        HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-        if (hSnapshot == INVALID_HANDLE_VALUE) {
-            std::cerr << Color::RED << "Error: Cannot create process snapshot" << Color::RESET << std::endl;
-            return;
+#ifndef _WIN32
+    /**
+     * Use the snapshot a daemon publishes in shared memory (--shm). It is
+     * copied out under the seqlock once, since rendering and -o have side
+     * effects that can't be retried.
+     */
+    bool attachShared(const std::string& shmName) {
+        PhaseTimer timer(*this, "load");
+        SharedSnapshotReader reader;
+        if (!reader.open(shmName)) {
+            std::cerr << Color::RED << "Error: Cannot open shared snapshot " << shmName << ": "
+                      << std::strerror(errno) << Color::RESET << std::endl;
+            return false;
         }
         
-        PROCESSENTRY32W pe32;
-        pe32.dwSize = sizeof(PROCESSENTRY32W);
-        
-        if (Process32FirstW(hSnapshot, &pe32)) {
-            do {
-                ProcessInfo info;
-                info.pid = pe32.th32ProcessID;
-                info.ppid = pe32.th32ParentProcessID;
-                info.name = wideToString(pe32.szExeFile);
-                info.num_threads = pe32.cntThreads;
-                
-                // Try to get more detailed info
-                readProcessInfo(pe32.th32ProcessID, info);
-                
-                processes[info.pid] = info;
-                totalProcesses++;
-                
-            } while (Process32NextW(hSnapshot, &pe32));
+        std::string copy;
+        if (!reader.read([&](const char* data, size_t size) { copy.assign(data, size); })) {
+            std::cerr << Color::RED << "Error: " << shmName << ": no snapshot published"
+                      << Color::RESET << std::endl;
+            return false;
         }
         
-        CloseHandle(hSnapshot);
-        std::cout << Color::GREEN << "Collected " << processes.size() << " processes" << Color::RESET << std::endl;
+        attached.swap(copy);
+        ProcessTableView mapped;
+        std::string error;
+        if (!openSnapshot(attached.data(), attached.size(), mapped, loadedHost, loadedTimestamp, error)) {
+            std::cerr << Color::RED << "Error: " << shmName << ": " << error 
+                      << Color::RESET << std::endl;
+            return false;
+        }
+        view = mapped;
+        snapshotView = true;
+        return true;
     }
 #endif
-
+    
     /**
-     * Build the hierarchical tree structure
+     * Display header information
      */
-    void buildTree() {
-        // Link children to parents
-        for (auto& [pid, proc] : processes) {
-            if (processes.find(proc.ppid) != processes.end()) {
-                processes[proc.ppid].children.push_back(&proc);
-            } else {
-                // Root process
-                rootProcesses.push_back(&proc);
-            }
-        }
-        
-        // Sort children by PID
-        for (auto& [pid, proc] : processes) {
-            std::sort(proc.children.begin(), proc.children.end(),
-                     [](const ProcessInfo* a, const ProcessInfo* b) {
-                         return a->pid < b->pid;
-                     });
-        }
+    void displayHeader(OutputBuffer& out) {
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append(palette->bright);
+        out.append("======================================================================");
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append(palette->bright);
+        out.append("Process Tree Visualizer");
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append("Created by: Michael Semera");
+        out.append(palette->reset);
+        out.append("\n");
         
-        // Sort root processes
-        std::sort(rootProcesses.begin(), rootProcesses.end(),
-                 [](const ProcessInfo* a, const ProcessInfo* b) {
-                     return a->pid < b->pid;
-                 });
+        time_t now = snapshotView ? static_cast<time_t>(loadedTimestamp) : time(nullptr);
+        out.append(palette->cyan);
+        out.append("Timestamp: ");
+        out.append(formatLocalTime(now));
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append("Total Processes: ");
+        out.appendNumber(static_cast<long long>(view.size()));
+        out.append(palette->reset);
+        out.append("\n");
+        out.append(palette->cyan);
+        out.append(palette->bright);
+        out.append("======================================================================");
+        out.append(palette->reset);
+        out.append("\n\n");
     }
     
     /**
-     * Recursively display process tree
+     * Find process by PID
      */
-    void displayTree(ProcessInfo* proc, const std::string& prefix, 
-                    bool isLast, std::set<int>& visited) {
-        if (!proc || visited.count(proc->pid)) return;
-        visited.insert(proc->pid);
-        
-        std::string connector = isLast ? "└── " : "├── ";
-        
-        // Color code by status
-        std::string nameColor = Color::CYAN;
-        if (proc->status == "R" || proc->status == "running") {
-            nameColor = Color::GREEN;
-        } else if (proc->status == "Z" || proc->status == "zombie") {
-            nameColor = Color::RED;
-        }
-        
-        // Display process info
-        std::cout << prefix << connector 
-                  << nameColor << Color::BRIGHT << proc->name << Color::RESET
-                  << Color::YELLOW << " [PID: " << proc->pid << "]" << Color::RESET;
-        
-        if (showResources) {
-            std::string cpuColor = proc->cpu_percent > 50 ? Color::RED : Color::GREEN;
-            std::string memColor = proc->memory_kb > 500*1024 ? Color::RED : Color::YELLOW;
+    const ProcessInfo* findProcess(int pid) const {
+        uint32_t index = view.indexOf(pid);
+        return index != ProcessTableView::npos ? &view.records[index] : nullptr;
+    }
+    
+    /**
+     * Display process and its subtree
+     */
+    void displayProcessSubtree(int pid) {
+        std::cout.flush();
+        PhaseTimer timer(*this, "render");
+        OutputBuffer out(OutputBuffer::standardOutput());
+        renderSubtree(pid, out);
+    }
+    
+    /**
+     * Display the --find matches and their ancestor chains
+     */
+    void displayMatches() {
+        std::cout.flush();
+        PhaseTimer timer(*this, "render");
+        OutputBuffer out(OutputBuffer::standardOutput());
+        renderMatches(out);
+    }
+    
+    /**
+     * Export tree to file; false (after an error message) if the file
+     * can't be created or written
+     */
+    bool exportToFile(const std::string& filename) {
+        {
+            PhaseTimer timer(*this, "export");
+            OutputBuffer out;
+            if (!out.openFile(filename)) {
+                std::cerr << Color::RED << "Error: Cannot open file " << filename 
+                          << Color::RESET << std::endl;
+                return false;
+            }
             
-            std::cout << " " << cpuColor << "CPU: " << std::fixed << std::setprecision(1) 
-                      << proc->cpu_percent << "%" << Color::RESET
-                      << " " << memColor << "MEM: " << proc->formatMemory() << Color::RESET;
+            // Escape codes are junk in a file
+            const Palette* shown = palette;
+            palette = &PLAIN_PALETTE;
+            displayHeader(out);
+            renderForest(out);
+            palette = shown;
+            if (!finishWrite(out, filename)) return false;
         }
         
-        if (verbose) {
-            std::cout << " " << Color::BLUE << "Threads: " << proc->num_threads << Color::RESET;
-        }
-        
-        std::cout << std::endl;
-        
-        // Display children
-        for (size_t i = 0; i < proc->children.size(); i++) {
-            bool isLastChild = (i == proc->children.size() - 1);
-            std::string extension = isLast ? "    " : "│   ";
-            displayTree(proc->children[i], prefix + extension, isLastChild, visited);
-        }
+        *log << palette->green << "Process tree exported to " << filename 
+             << palette->reset << std::endl;
+        return true;
     }
-
-public:
-    ProcessTree(bool resources = false, bool verb = false) 
-        : showResources(resources), verbose(verb), totalProcesses(0), collectionErrors(0) {}
     
     /**
-     * Main execution flow
+     * Flush an export and report whether every write went through
      */
-    void run() {
-        collectProcesses();
-        buildTree();
-        displayHeader();
-        
-        std::set<int> visited;
-        for (auto* root : rootProcesses) {
-            displayTree(root, "", true, visited);
-        }
+    static bool finishWrite(OutputBuffer& out, const std::string& filename) {
+        out.flush();
+        if (out.good()) return true;
+        std::cerr << Color::RED << "Error: Cannot write " << filename << ": " << std::strerror(errno)
+                  << Color::RESET << std::endl;
+        return false;
     }
     
+    enum ExportFormat { FORMAT_TEXT, FORMAT_JSON, FORMAT_NDJSON, FORMAT_BIN };
+    
     /**
-     * Display header information
+     * Parse a --format name; returns false if it is not recognized
      */
-    void displayHeader() {
-        std::cout << "\n" << Color::CYAN << Color::BRIGHT 
-                  << "======================================================================" 
-                  << Color::RESET << "\n";
-        std::cout << Color::CYAN << Color::BRIGHT << "Process Tree Visualizer" << Color::RESET << "\n";
-        std::cout << Color::CYAN << "Created by: Michael Semera" << Color::RESET << "\n";
-        
-        time_t now = time(nullptr);
-        char buf[80];
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-        std::cout << Color::CYAN << "Timestamp: " << buf << Color::RESET << "\n";
-        std::cout << Color::CYAN << "Total Processes: " << processes.size() << Color::RESET << "\n";
-        std::cout << Color::CYAN << Color::BRIGHT 
-                  << "======================================================================" 
-                  << Color::RESET << "\n\n";
+    static bool parseFormat(const std::string& name, ExportFormat& format) {
+        if (name == "text") format = FORMAT_TEXT;
+        else if (name == "json") format = FORMAT_JSON;
+        else if (name == "ndjson") format = FORMAT_NDJSON;
+        else if (name == "bin") format = FORMAT_BIN;
+        else return false;
+        return true;
     }
     
     /**
-     * Find process by PID
+     * Stream the snapshot in a machine-readable format. Each record goes
+     * straight from the table to the buffered writer; nothing is built in
+     * between.
      */
-    ProcessInfo* findProcess(int pid) {
-        auto it = processes.find(pid);
-        return it != processes.end() ? &it->second : nullptr;
+    void exportSnapshot(OutputBuffer& out, ExportFormat format) {
+        PhaseTimer timer(*this, "export");
+        beginRender();
+        switch (format) {
+        case FORMAT_TEXT:
+            displayHeader(out);
+            renderForest(out);
+            break;
+        case FORMAT_JSON:
+            out.append("{\"version\":");
+            out.appendNumber(Snapshot::VERSION);
+            out.append(",\"timestamp\":");
+            out.appendNumber(static_cast<long long>(snapshotView ? loadedTimestamp : time(nullptr)));
+            out.append(",\"host\":");
+            out.appendJsonString(snapshotView ? view.string(loadedHost) : hostName().c_str());
+            out.append(",\"processes\":[");
+            for (size_t i = 0; i < view.size(); i++) {
+                if (i > 0) out.append(',');
+                out.append("\n");
+                appendJsonRecord(static_cast<uint32_t>(i), out);
+            }
+            out.append("\n]}\n");
+            break;
+        case FORMAT_NDJSON:
+            for (size_t i = 0; i < view.size(); i++) {
+                appendJsonRecord(static_cast<uint32_t>(i), out);
+                out.append('\n');
+            }
+            break;
+        case FORMAT_BIN:
+            writeBinarySnapshot(out);
+            break;
+        }
+        out.flush();
     }
     
     /**
-     * Display process and its subtree
+     * Export the snapshot to a file in the given format
      */
-    void displayProcessSubtree(int pid) {
-        ProcessInfo* proc = findProcess(pid);
-        if (!proc) {
-            std::cout << Color::RED << "Process with PID " << pid << " not found" 
-                      << Color::RESET << std::endl;
-            return;
+    bool exportToFile(const std::string& filename, ExportFormat format) {
+        if (format == FORMAT_TEXT) {
+            return exportToFile(filename);
         }
         
-        std::cout << "\n" << Color::CYAN << "Process Subtree for: " << Color::BRIGHT 
-                  << proc->name << Color::RESET << "\n";
-        std::cout << Color::CYAN << "======================================================================" 
-                  << Color::RESET << "\n\n";
+        {
+            OutputBuffer out;
+            if (!out.openFile(filename)) {
+                std::cerr << Color::RED << "Error: Cannot open file " << filename 
+                          << Color::RESET << std::endl;
+                return false;
+            }
+            exportSnapshot(out, format);
+            if (!finishWrite(out, filename)) return false;
+        }
         
-        std::set<int> visited;
-        displayTree(proc, "", true, visited);
+        *log << palette->green << "Snapshot exported to " << filename 
+             << palette->reset << std::endl;
+        return true;
     }
     
     /**
-     * Export tree to file
+     * Print --stats: phase timings (repeated phases are summed), the
+     * collection counts and the I/O and allocation counters. As one JSON
+     * line (times in microseconds) when json is set, else as a table.
      */
-    void exportToFile(const std::string& filename) {
-        std::ofstream outFile(filename);
-        if (!outFile.is_open()) {
-            std::cerr << Color::RED << "Error: Cannot open file " << filename 
-                      << Color::RESET << std::endl;
+    void printStats(std::ostream& out, bool json) {
+        std::vector<std::pair<const char*, double>> totals;
+        for (const auto& phase : phases) {
+            auto it = std::find_if(totals.begin(), totals.end(), [&](const std::pair<const char*, double>& t) {
+                return std::strcmp(t.first, phase.first) == 0;
+            });
+            if (it != totals.end()) {
+                it->second += phase.second;
+            } else {
+                totals.push_back(phase);
+            }
+        }
+        
+        unsigned long long files = Stats::filesOpened.load();
+        unsigned long long bytes = Stats::bytesRead.load();
+        unsigned long long entries = Stats::dirEntries.load();
+        double ioMs = Stats::ioNanos.load() / 1e6;
+        unsigned long long allocs = Stats::allocations.load();
+        unsigned long long allocBytes = Stats::allocatedBytes.load();
+        unsigned long long frees = Stats::frees.load();
+        unsigned long long lookups = Stats::userLookups.load();
+        unsigned long long ticks = Stats::ticks;
+        // Refreshes after the first one: what steady state costs
+        unsigned long long tickAllocs = ticks > 0 ? allocs - Stats::warmAllocations : 0;
+        uint64_t residentKb = 0, peakKb = 0;
+        Stats::memoryUsage(residentKb, peakKb);
+        unsigned long long startKb = Stats::startResidentKb;
+        char line[200];
+        
+        if (json) {
+            OutputBuffer text;
+            text.append("{\"phases_us\":{");
+            for (size_t i = 0; i < totals.size(); i++) {
+                if (i > 0) text.append(',');
+                text.appendJsonString(totals[i].first);
+                text.append(':');
+                text.appendNumber(static_cast<long long>(totals[i].second * 1000));
+            }
+            snprintf(line, sizeof(line),
+                     "},\"processes\":%d,\"errors\":%d,\"files_opened\":%llu,\"bytes_read\":%llu,"
+                     "\"dir_entries\":%llu,\"io_us\":%lld,\"cached\":%d,", totalProcesses, collectionErrors,
+                     files, bytes, entries, static_cast<long long>(ioMs * 1000), cachedProcesses);
+            text.append(line);
+            snprintf(line, sizeof(line), "\"allocations\":%llu,\"allocated_bytes\":%llu,\"frees\":%llu,"
+                     "\"ticks\":%llu,\"tick_allocations\":%llu,", allocs, allocBytes, frees, ticks, tickAllocs);
+            text.append(line);
+            snprintf(line, sizeof(line), "\"rss_start_kb\":%llu,\"rss_end_kb\":%llu,\"rss_peak_kb\":%llu,"
+                     "\"user_lookups\":%llu}\n", startKb, static_cast<unsigned long long>(residentKb),
+                     static_cast<unsigned long long>(peakKb), lookups);
+            text.append(line);
+            out << text.str() << std::flush;
             return;
         }
         
-        // Redirect cout to file
-        std::streambuf* coutbuf = std::cout.rdbuf();
-        std::cout.rdbuf(outFile.rdbuf());
+        out << Color::CYAN << Color::BRIGHT << "Statistics" << Color::RESET << "\n";
+        for (const auto& phase : totals) {
+            snprintf(line, sizeof(line), "  %-20s %10.3f ms\n", phase.first, phase.second);
+            out << line;
+        }
+        snprintf(line, sizeof(line), "  %-20s %10d\n  %-20s %10d\n", "processes", totalProcesses,
+                 "collection errors", collectionErrors);
+        out << line;
+        if (!cachePath.empty()) {
+            snprintf(line, sizeof(line), "  %-20s %10d of %d\n", "cached processes",
+                     cachedProcesses, totalProcesses);
+            out << line;
+        }
+        snprintf(line, sizeof(line), "  %-20s %10llu\n  %-20s %10llu\n  %-20s %10llu\n",
+                 "files opened", files, "bytes read", bytes, "directory entries", entries);
+        out << line;
+        snprintf(line, sizeof(line), "  %-20s %10.3f ms (all threads)\n", "open/read time", ioMs);
+        out << line;
+        snprintf(line, sizeof(line), "  %-20s %10llu (%llu bytes)\n  %-20s %10llu\n", "allocations", allocs,
+                 allocBytes, "frees", frees);
+        out << line;
+        if (ticks > 0) {
+            snprintf(line, sizeof(line), "  %-20s %10llu (%.1f allocations each after the first)\n", "refreshes",
+                     ticks, static_cast<double>(tickAllocs) / static_cast<double>(ticks));
+            out << line;
+        }
+        snprintf(line, sizeof(line), "  %-20s %10llu KB at start, %llu KB at end, %llu KB peak\n", "resident memory",
+                 startKb, static_cast<unsigned long long>(residentKb), static_cast<unsigned long long>(peakKb));
+        out << line;
+        snprintf(line, sizeof(line), "  %-20s %10llu\n", "user lookups", lookups);
+        out << line << std::flush;
+    }
+
+private:
+    static std::string hostName() {
+        char buf[256] = {0};
+#ifdef _WIN32
+        DWORD size = sizeof(buf);
+        if (!GetComputerNameA(buf, &size)) return "";
+#else
+        if (gethostname(buf, sizeof(buf) - 1) != 0) return "";
+#endif
+        return buf;
+    }
+    
+    void appendJsonRecord(uint32_t index, OutputBuffer& out) {
+        const ProcessInfo& proc = view.records[index];
+        char cpu[32];
+        snprintf(cpu, sizeof(cpu), "%.2f", proc.cpu_percent);
+        char status[2] = {static_cast<char>(proc.status), '\0'};
         
-        displayHeader();
-        std::set<int> visited;
-        for (auto* root : rootProcesses) {
-            displayTree(root, "", true, visited);
+        out.append("{\"pid\":");
+        out.appendNumber(proc.pid);
+        out.append(",\"ppid\":");
+        out.appendNumber(proc.ppid);
+        out.append(",\"name\":");
+        out.appendJsonString(view.string(proc.name));
+        out.append(",\"user\":");
+        out.appendJsonString(view.string(proc.username));
+        out.append(",\"cmdline\":");
+        out.appendJsonString(view.string(proc.cmdline));
+        if (proc.cgroup) {
+            out.append(",\"cgroup\":");
+            out.appendJsonString(view.string(proc.cgroup));
+        }
+        out.append(",\"status\":");
+        out.appendJsonString(status);
+        out.append(",\"cpu_percent\":");
+        out.append(cpu);
+        out.append(",\"memory_kb\":");
+        out.appendNumber(static_cast<long long>(proc.memory_kb));
+        out.append(",\"num_threads\":");
+        out.appendNumber(proc.num_threads);
+        out.append(",\"cpu_time_us\":");
+        out.appendNumber(static_cast<long long>(proc.cpu_time_us));
+        out.append(",\"start_time\":");
+        out.appendNumber(static_cast<long long>(proc.start_time));
+        if (shownRollups) {
+            const Rollup& total = shownRollups[index];
+            snprintf(cpu, sizeof(cpu), "%.2f", total.cpu_percent);
+            out.append(",\"subtree\":{\"processes\":");
+            out.appendNumber(total.processes);
+            out.append(",\"memory_kb\":");
+            out.appendNumber(static_cast<long long>(total.memory_kb));
+            out.append(",\"cpu_percent\":");
+            out.append(cpu);
+            out.append(",\"num_threads\":");
+            out.appendNumber(static_cast<long long>(total.num_threads));
+            out.append('}');
+        }
+        out.append('}');
+    }
+    
+    static void appendSection(OutputBuffer& out, uint32_t type, const void* payload, size_t length) {
+        static const char padding[8] = {0};
+        Snapshot::Section section = {type, 0, length};
+        out.append(reinterpret_cast<const char*>(&section), sizeof(section));
+        out.append(static_cast<const char*>(payload), length);
+        out.append(padding, (8 - length % 8) % 8);
+    }
+    
+#ifndef _WIN32
+    /**
+     * Serialize the table and hand it to the daemon's readers (and the
+     * shared-memory segment, if there is one)
+     */
+    void publish(SnapshotExchange& exchange, SharedSnapshotWriter* segment) {
+        // Totals kept up by rollupDelta() between topology changes
+        prepareRollups();
+        OutputBuffer blob;
+        blob.reuse(std::move(retiredSnapshot));
+        // Readers key their find caches on the generation: the pool
+        // only grows between changes of it
+        uint64_t generation = table.strings.generation();
+        writeBinarySnapshot(blob, nullptr, &generation);
+        retiredSnapshot = blob.release();
+        if (segment) {
+            bool published = segment->publish(retiredSnapshot);
+            if (!published && !segmentFailing) {
+                std::cerr << Color::YELLOW << "Warning: cannot publish to shm " << segment->segmentName() << ": "
+                          << std::strerror(errno) << " (retrying)" << Color::RESET << std::endl;
+            }
+            segmentFailing = !published;
+        }
+        exchange.publish(retiredSnapshot);
+    }
+#endif
+    
+    void writeBinarySnapshot(OutputBuffer& out, const Snapshot::Collection* collection = nullptr,
+                             const uint64_t* generation = nullptr) {
+        uint32_t host = loadedHost;
+        if (!snapshotView) {
+            // Interning may move the pool, so refresh the view after it
+            host = table.strings.intern(hostName());
+            view = table.view();
         }
         
-        // Restore cout
-        std::cout.rdbuf(coutbuf);
-        outFile.close();
+        Snapshot::Header header;
+        std::memcpy(header.magic, Snapshot::MAGIC, sizeof(header.magic));
+        header.version = Snapshot::VERSION;
+        header.byteOrder = Snapshot::ORDER_MARK;
+        header.timestamp = snapshotView ? loadedTimestamp : static_cast<uint64_t>(time(nullptr));
+        header.recordSize = sizeof(ProcessInfo);
+        header.recordCount = view.count;
+        header.host = host;
+        header.sectionCount = 5 + (shownRollups ? 1 : 0) + (collection ? 1 : 0) + (generation ? 1 : 0);
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
         
-        std::cout << Color::GREEN << "Process tree exported to " << filename 
-                  << Color::RESET << std::endl;
+        appendSection(out, Snapshot::SECTION_RECORDS, view.records,
+                      view.size() * sizeof(ProcessInfo));
+        appendSection(out, Snapshot::SECTION_STRINGS, view.strings, view.stringsSize);
+        appendSection(out, Snapshot::SECTION_CHILD_START, view.childStart,
+                      (view.size() + 1) * sizeof(uint32_t));
+        appendSection(out, Snapshot::SECTION_CHILD_INDEX, view.childIndex,
+                      view.childStart[view.count] * sizeof(uint32_t));
+        appendSection(out, Snapshot::SECTION_ROOTS, view.roots,
+                      view.rootCount * sizeof(uint32_t));
+        if (shownRollups) {
+            appendSection(out, Snapshot::SECTION_ROLLUPS, shownRollups, view.size() * sizeof(Rollup));
+        }
+        if (collection) {
+            appendSection(out, Snapshot::SECTION_COLLECTION, collection, sizeof(*collection));
+        }
+        if (generation) {
+            appendSection(out, Snapshot::SECTION_GENERATION, generation, sizeof(*generation));
+        }
     }
 };
 
+volatile std::sig_atomic_t ProcessTree::stopRequested = 0;
+
+// Building with -DPROCESS_TREE_NO_MAIN leaves out the command line tool,
+// so the file can be included by process_tree_bench.cpp
+#ifndef PROCESS_TREE_NO_MAIN
+#ifndef _WIN32
+/**
+ * --client: send one query to a --daemon and copy the answer to stdout
+ */
+static int queryDaemon(const std::string& socketPath, const std::string& query) {
+    int fd = connectUnixSocket(socketPath);
+    if (fd < 0) {
+        std::cerr << Color::RED << "Error: Cannot connect to " << socketPath << ": "
+                  << std::strerror(errno) << Color::RESET << std::endl;
+        return 1;
+    }
+    
+    // The daemon can't see our stdout, so it is told whether to color
+    std::string request = query + (colorTerminal() ? " --color\n" : "\n");
+    OutputBuffer(fd).append(request);
+    shutdown(fd, SHUT_WR);
+    
+    OutputBuffer out(OutputBuffer::standardOutput());
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out.append(buf, static_cast<size_t>(n));
+    }
+    close(fd);
+    return 0;
+}
+#endif
+
 /**
  * Display usage information
  */
@@ -500,13 +7270,68 @@ void printUsage(const char* progName) {
     std::cout << "  -h, --help         Show this help message\n";
     std::cout << "  -r, --resources    Show CPU and memory usage\n";
     std::cout << "  -v, --verbose      Show verbose process information\n";
+    std::cout << "  --threads PID[,..] List the threads of these processes (implies -v)\n";
+    std::cout << "  --rollup           Show CPU, memory and thread totals for each subtree\n";
     std::cout << "  -p, --pid PID      Show specific process and its children\n";
-    std::cout << "  -o, --output FILE  Export process tree to file\n\n";
+    std::cout << "  --find PATTERN     Show only processes whose name contains PATTERN,\n";
+    std::cout << "                     with their ancestors (also with -w)\n";
+    std::cout << "  --regex            Treat the --find pattern as a regular expression\n";
+    std::cout << "  --cmdline          Match --find against full command lines too\n";
+    std::cout << "  --top N            Show only the N heaviest processes, with their ancestors\n";
+    std::cout << "  --sort KEY         Weight for --top: mem (default), cpu or threads\n";
+    std::cout << "  --min-mem SIZE     Show only processes using at least SIZE (KB, or K/M/G)\n";
+    std::cout << "  --min-cpu PCT      Show only processes using at least PCT% CPU\n";
+    std::cout << "  --user NAME        Show only processes owned by NAME (or a numeric UID)\n";
+    std::cout << "  -o, --output FILE  Export process tree to file\n";
+    std::cout << "  --format FMT       Export format: text, json, ndjson or bin\n";
+    std::cout << "                     (written to stdout when -o is not given)\n";
+    std::cout << "  --load FILE        Display a saved bin snapshot instead of this host\n";
+    std::cout << "  --diff A B         List processes added, removed or changed from snapshot\n";
+    std::cout << "                     A to B (--find narrows, --format ndjson for data)\n";
+    std::cout << "  --merge DIR        Like --diff, for each host's oldest and newest snapshot\n";
+    std::cout << "                     among the files in DIR (-j sets threads, default all)\n";
+    std::cout << "  -j, --jobs N       Collect with N threads (0 = all cores)\n";
+    std::cout << "  --cache FILE       Keep names, command lines and owners in FILE between runs;\n";
+    std::cout << "                     processes seen before are only re-read for what changes\n";
+    std::cout << "  --sample MS        CPU sampling interval for -r (default 250, 0 = off)\n";
+    std::cout << "  --stats[=json]     Print phase timings and I/O/allocation counters to stderr\n";
+    std::cout << "  -w, --watch SECS   Refresh the tree every SECS seconds until Ctrl+C\n";
+#ifdef __linux__
+    std::cout << "  --proc-root DIR    Read processes from DIR instead of /proc\n";
+    std::cout << "  --group-by cgroup  Group processes under their cgroup (container), with\n";
+    std::cout << "                     each group's own memory and CPU use\n";
+#endif
+#ifndef _WIN32
+    std::cout << "  --daemon SOCKET    Stay resident and answer queries on a Unix socket\n";
+    std::cout << "                     (refreshed every -w SECS, default 1)\n";
+    std::cout << "  --shm NAME         With --daemon, also publish into shared memory NAME\n";
+    std::cout << "  --attach NAME      Display a daemon's shared-memory snapshot (like --load)\n";
+    std::cout << "  --client SOCKET [QUERY]\n";
+    std::cout << "                     Ask a daemon: tree [--format FMT], subtree PID,\n";
+    std::cout << "                     find TEXT or top N, each with optional -r/-v\n";
+    std::cout << "  --serve-metrics [HOST]:PORT\n";
+    std::cout << "                     Serve OpenMetrics at /metrics over HTTP (refreshed\n";
+    std::cout << "                     every -w SECS, default 1)\n";
+    std::cout << "  --metrics-labels L Label series by name (default), user, cgroup or pid\n";
+#endif
+    std::cout << "\n";
     std::cout << "Examples:\n";
     std::cout << "  " << progName << "                    # Display full process tree\n";
     std::cout << "  " << progName << " -r                 # Show with resource usage\n";
     std::cout << "  " << progName << " -p 1234            # Show specific process\n";
-    std::cout << "  " << progName << " -o tree.txt        # Export to file\n\n";
+    std::cout << "  " << progName << " -o tree.txt        # Export to file\n";
+    std::cout << "  " << progName << " --format bin -o s.bin # Save a binary snapshot\n";
+    std::cout << "  " << progName << " --load s.bin -p 1  # Inspect a saved snapshot\n";
+    std::cout << "  " << progName << " --merge snaps/ --find sshd # Hosts with new sshd children\n";
+    std::cout << "  " << progName << " -j 0               # Collect using all cores\n";
+    std::cout << "  " << progName << " --find sshd        # Where are the sshd processes?\n";
+    std::cout << "  " << progName << " -w 1 -r            # Live view, updated every second\n";
+#ifndef _WIN32
+    std::cout << "  " << progName << " --daemon /tmp/pt.sock &\n";
+    std::cout << "  " << progName << " --client /tmp/pt.sock top 10 -r # Ask the daemon\n";
+    std::cout << "  " << progName << " --serve-metrics :9256 # Prometheus scrape target\n";
+#endif
+    std::cout << "\n";
 }
 
 /**
@@ -516,7 +7341,38 @@ int main(int argc, char* argv[]) {
     bool showResources = false;
     bool verbose = false;
     int targetPid = -1;
+    unsigned jobs = 1;
+    bool jobsGiven = false;
+    int sampleMs = -1;
+    double watchInterval = 0.0;
     std::string outputFile;
+    std::string loadFile;
+    std::string cacheFile;
+    std::string diffBefore;
+    std::string diffAfter;
+    std::string mergeDir;
+    ProcessTree::ExportFormat format = ProcessTree::FORMAT_TEXT;
+    bool formatGiven = false;
+    std::string procRoot;
+    bool stats = false;
+    bool statsJson = false;
+    std::string findPattern;
+    bool findRegex = false;
+    bool findCmdlines = false;
+    bool rollup = false;
+    ResourceFilter filter;
+    std::vector<int> threadPids;
+    std::string user;
+    bool groupByCgroup = false;
+    std::string daemonSocket;
+    std::string shmName;
+    std::string attachName;
+    std::string clientSocket;
+    std::string query;
+#ifndef _WIN32
+    std::string metricsAddress;
+    ProcessTree::MetricLabel metricLabel = ProcessTree::METRICS_BY_NAME;
+#endif
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -529,10 +7385,117 @@ int main(int argc, char* argv[]) {
             showResources = true;
         } else if (arg == "-v" || arg == "--verbose") {
             verbose = true;
+        } else if (arg == "--rollup") {
+            rollup = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            const char* list = argv[++i];
+            while (*list) {
+                char* end = nullptr;
+                long pid = std::strtol(list, &end, 10);
+                if (end == list || pid <= 0 || (*end && *end != ',')) {
+                    std::cerr << "Invalid --threads PID list: " << argv[i] << std::endl;
+                    return 1;
+                }
+                threadPids.push_back(static_cast<int>(pid));
+                list = *end ? end + 1 : end;
+            }
+            verbose = true;
         } else if ((arg == "-p" || arg == "--pid") && i + 1 < argc) {
             targetPid = std::atoi(argv[++i]);
+        } else if (arg == "--find" && i + 1 < argc) {
+            findPattern = argv[++i];
+            if (findPattern.empty()) {
+                std::cerr << "--find needs a non-empty pattern" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--regex") {
+            findRegex = true;
+        } else if (arg == "--cmdline") {
+            findCmdlines = true;
+        } else if (arg == "--top" && i + 1 < argc) {
+            int top = std::atoi(argv[++i]);
+            if (top <= 0) {
+                std::cerr << "Invalid --top count: " << argv[i] << std::endl;
+                return 1;
+            }
+            filter.top = static_cast<size_t>(top);
+        } else if (arg == "--sort" && i + 1 < argc) {
+            if (!ResourceFilter::parseKey(argv[++i], filter.key)) {
+                std::cerr << "Unknown sort key: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--min-mem" && i + 1 < argc) {
+            if (!ResourceFilter::parseSize(argv[++i], filter.minMemoryKb)) {
+                std::cerr << "Invalid size: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--min-cpu" && i + 1 < argc) {
+            filter.minCpu = std::max(0.0, std::atof(argv[++i]));
+        } else if (arg == "--user" && i + 1 < argc) {
+            user = argv[++i];
         } else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
             outputFile = argv[++i];
+        } else if (arg == "--diff" && i + 2 < argc) {
+            diffBefore = argv[++i];
+            diffAfter = argv[++i];
+        } else if (arg == "--merge" && i + 1 < argc) {
+            mergeDir = argv[++i];
+        } else if (arg == "--load" && i + 1 < argc) {
+            loadFile = argv[++i];
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheFile = argv[++i];
+        } else if (arg == "--format" && i + 1 < argc) {
+            if (!ProcessTree::parseFormat(argv[++i], format)) {
+                std::cerr << "Unknown format: " << argv[i] << std::endl;
+                return 1;
+            }
+            formatGiven = true;
+        } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+            jobsGiven = true;
+        } else if (arg == "--stats" || arg == "--stats=json") {
+            stats = true;
+            statsJson = arg == "--stats=json";
+        } else if (arg == "--sample" && i + 1 < argc) {
+            sampleMs = std::max(0, std::atoi(argv[++i]));
+        } else if ((arg == "-w" || arg == "--watch") && i + 1 < argc) {
+            watchInterval = std::atof(argv[++i]);
+            if (watchInterval <= 0) {
+                std::cerr << "Invalid watch interval: " << argv[i] << std::endl;
+                return 1;
+            }
+#ifdef __linux__
+        } else if (arg == "--proc-root" && i + 1 < argc) {
+            procRoot = argv[++i];
+        } else if (arg == "--group-by" && i + 1 < argc) {
+            if (std::string(argv[++i]) != "cgroup") {
+                std::cerr << "Unknown grouping: " << argv[i] << " (only cgroup)" << std::endl;
+                return 1;
+            }
+            groupByCgroup = true;
+#endif
+#ifndef _WIN32
+        } else if (arg == "--daemon" && i + 1 < argc) {
+            daemonSocket = argv[++i];
+        } else if (arg == "--shm" && i + 1 < argc) {
+            shmName = argv[++i];
+        } else if (arg == "--attach" && i + 1 < argc) {
+            attachName = argv[++i];
+        } else if (arg == "--client" && i + 1 < argc) {
+            clientSocket = argv[++i];
+            // The rest of the command line is the query
+            while (++i < argc) {
+                if (!query.empty()) query += ' ';
+                query += argv[i];
+            }
+        } else if (arg == "--serve-metrics" && i + 1 < argc) {
+            metricsAddress = argv[++i];
+        } else if (arg == "--metrics-labels" && i + 1 < argc) {
+            if (!ProcessTree::parseMetricLabel(argv[++i], metricLabel)) {
+                std::cerr << "Unknown metrics label: " << argv[i] << " (name, user, cgroup or pid)" << std::endl;
+                return 1;
+            }
+#endif
         } else {
             std::cerr << "Unknown option: " << arg << std::endl;
             printUsage(argv[0]);
@@ -540,16 +7503,171 @@ int main(int argc, char* argv[]) {
         }
     }
     
+#ifndef _WIN32
+    if (!clientSocket.empty()) {
+        return queryDaemon(clientSocket, query.empty() ? "tree" : query);
+    }
+#endif
+    
+    // Snapshot comparison never looks at this host
+    if (!diffBefore.empty() || !mergeDir.empty()) {
+        if (formatGiven && format != ProcessTree::FORMAT_TEXT && format != ProcessTree::FORMAT_NDJSON) {
+            std::cerr << "--diff and --merge write text or ndjson" << std::endl;
+            return 1;
+        }
+        SnapshotDiff diff;
+        diff.setJson(format == ProcessTree::FORMAT_NDJSON);
+        diff.setColor(colorTerminal());
+        diff.setJobs(jobsGiven ? jobs : 0);
+        if (!findPattern.empty() && !diff.setSearch(findPattern, findRegex, findCmdlines)) {
+            return 1;
+        }
+        return mergeDir.empty() ? diff.diff(diffBefore, diffAfter) : diff.merge(mergeDir);
+    }
+    
+    // Decided before anything is collected, so the counters see it all
+    Stats::enabled = stats;
+    if (stats) {
+        uint64_t peakKb = 0;
+        Stats::memoryUsage(Stats::startResidentKb, peakKb);
+    }
+    
     try {
         ProcessTree tree(showResources, verbose);
-        tree.run();
+#ifdef __linux__
+        if (!procRoot.empty()) {
+            tree.setCollector(std::unique_ptr<ProcessCollector>(new LinuxCollector(procRoot)));
+        }
+#endif
+        tree.setJobs(jobs);
+        // CPU% needs two samples; only pay for the wait when it's shown
+        if (sampleMs < 0) {
+            sampleMs = showResources || rollup || !threadPids.empty() || (filter.fields() & FIELD_CPU) ? 250 : 0;
+        }
+        tree.setSampleInterval(static_cast<unsigned>(sampleMs));
+        
+        // Read only what will be shown; machine formats carry every field
+        uint32_t fields = FIELD_BASIC;
+        if (showResources) fields |= FIELD_MEMORY | FIELD_CPU;
+        if (verbose) fields |= FIELD_THREADS | FIELD_USER;
+        if (!user.empty()) fields |= FIELD_USER;
+        if (!threadPids.empty()) fields |= FIELD_CPU;
+        if (rollup) fields |= FIELD_MEMORY | FIELD_CPU | FIELD_THREADS;
+        if (findCmdlines) fields |= FIELD_CMDLINE;
+        fields |= filter.fields();
+        if (groupByCgroup) fields |= FIELD_CGROUP;
+        if (format != ProcessTree::FORMAT_TEXT) fields = FIELD_ALL | (fields & FIELD_CGROUP);
+        // Static fields are read once per process lifetime with a cache,
+        // so read them all and any later run can use it
+        if (!cacheFile.empty()) fields |= FIELD_CMDLINE | FIELD_USER;
+        tree.setFields(fields);
+        tree.setCache(cacheFile);
+        tree.setRollups(rollup);
+        tree.setFilter(filter);
+        tree.setThreadPids(threadPids);
+        tree.setGroupByCgroup(groupByCgroup);
+        if (!user.empty() && !tree.setUserFilter(user)) {
+            return 1;
+        }
+        
+        if (!findPattern.empty() && !tree.setSearch(findPattern, findRegex, findCmdlines)) {
+            return 1;
+        }
+        
+#ifndef _WIN32
+        if (!daemonSocket.empty()) {
+            // Queries can ask for any column
+            tree.setFields(FIELD_ALL);
+            bool served = tree.serve(daemonSocket, watchInterval > 0 ? watchInterval : 1.0, shmName);
+            if (stats) {
+                tree.printStats(std::cerr, statsJson);
+            }
+            return served ? 0 : 1;
+        }
+        if (!metricsAddress.empty()) {
+            uint32_t metricFields = FIELD_BASIC | FIELD_MEMORY | FIELD_CPU | FIELD_THREADS;
+            if (metricLabel == ProcessTree::METRICS_BY_USER) metricFields |= FIELD_USER;
+            if (metricLabel == ProcessTree::METRICS_BY_CGROUP) metricFields |= FIELD_CGROUP;
+            tree.setFields(metricFields);
+            bool served = tree.serveMetrics(metricsAddress, watchInterval > 0 ? watchInterval : 1.0, metricLabel);
+            if (stats) {
+                tree.printStats(std::cerr, statsJson);
+            }
+            return served ? 0 : 1;
+        }
+#endif
+        
+        // --load and --attach display a saved or published snapshot
+        bool fromSnapshot = !loadFile.empty() || !attachName.empty();
+        
+        if (watchInterval > 0) {
+            if (fromSnapshot) {
+                std::cerr << "--watch cannot be combined with --load or --attach" << std::endl;
+                return 1;
+            }
+            tree.watch(watchInterval, targetPid);
+            if (stats) {
+                tree.printStats(std::cerr, statsJson);
+            }
+            return 0;
+        }
+        
+        // A machine-readable format without -o streams to stdout instead
+        // of the tree, so progress messages must stay off stdout
+        bool dataToStdout = formatGiven && outputFile.empty() && format != ProcessTree::FORMAT_TEXT;
+        if (dataToStdout) {
+            tree.setLogStream(std::cerr);
+        }
+        
+        // -p on its own only needs the target's subtree
+        bool selecting = !findPattern.empty() || filter.active();
+        bool subtreeOnly = targetPid >= 0 && !fromSnapshot && outputFile.empty() && !selecting;
         
-        if (targetPid >= 0) {
+        if (!loadFile.empty()) {
+            if (!tree.loadSnapshot(loadFile)) {
+                return 1;
+            }
+#ifndef _WIN32
+        } else if (!attachName.empty()) {
+            if (!tree.attachShared(attachName)) {
+                return 1;
+            }
+#endif
+        } else {
+            tree.snapshot(subtreeOnly ? targetPid : -1);
+        }
+        
+        bool exported = true;
+        if (dataToStdout) {
+            OutputBuffer out(OutputBuffer::standardOutput());
+            tree.exportSnapshot(out, format);
+            exported = ProcessTree::finishWrite(out, "standard output");
+        } else if (subtreeOnly) {
             tree.displayProcessSubtree(targetPid);
+        } else if (selecting) {
+            tree.displayMatches();
+            
+            if (!outputFile.empty()) {
+                exported = tree.exportToFile(outputFile, format);
+            }
+        } else {
+            tree.display();
+            
+            if (targetPid >= 0) {
+                tree.displayProcessSubtree(targetPid);
+            }
+            
+            if (!outputFile.empty()) {
+                exported = tree.exportToFile(outputFile, format);
+            }
         }
         
-        if (!outputFile.empty()) {
-            tree.exportToFile(outputFile);
+        // On stderr, so stdout stays clean for data and pipes
+        if (stats) {
+            tree.printStats(std::cerr, statsJson);
+        }
+        if (!exported) {
+            return 1;
         }
         
     } catch (const std::exception& e) {
@@ -558,4 +7676,5 @@ int main(int argc, char* argv[]) {
     }
     
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,496 @@
+/*
+ * Process Tree Visualizer - Benchmarks
+ * Created by: Michael Semera
+ *
+ * Times each phase of a snapshot on its own: collection, tree building,
+ * rendering and every export format. On Linux the input is a synthetic
+ * /proc tree of configurable size, depth and fan-out, written to a
+ * scratch directory and read back through LinuxCollector, so results do
+ * not depend on what the build host happens to be running. Elsewhere
+ * collection is timed against the live system and the other phases run
+ * on the same synthetic shape built in memory.
+ *
+ * Results can be saved as JSON lines (--json) and compared against a
+ * previous run (--baseline FILE); any phase slower than the tolerance
+ * makes the run exit with status 2.
+ */
+
+#define PROCESS_TREE_NO_MAIN
+#include "process_tree.cpp"
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+
+namespace fs = std::filesystem;
+
+/**
+ * One process of the synthetic shape
+ */
+struct BenchNode {
+    int pid;
+    int ppid;
+    const char* name;
+};
+
+/**
+ * Build a forest of `count` processes: breadth-first trees in which every
+ * node above `depth` gets `fanout` children. When a tree is full the next
+ * one starts as a new root.
+ */
+static std::vector<BenchNode> makeShape(int count, int depth, int fanout) {
+    static const char* const names[] = {
+        "systemd", "bash", "php-fpm: pool www", "java", "nginx: worker process",
+        "postgres", "kworker/0:1-events", "python3", "sshd", "containerd-shim"
+    };
+    const int nameCount = static_cast<int>(sizeof(names) / sizeof(names[0]));
+    
+    std::vector<BenchNode> nodes;
+    nodes.reserve(count);
+    std::vector<std::pair<int, int>> level;  // (pid, depth)
+    std::vector<std::pair<int, int>> nextLevel;
+    int pid = 1;
+    
+    while (pid <= count) {
+        nodes.push_back(BenchNode{pid, 0, names[0]});
+        level.assign(1, std::make_pair(pid, 0));
+        pid++;
+        while (!level.empty() && pid <= count) {
+            nextLevel.clear();
+            for (const auto& parent : level) {
+                if (parent.second >= depth) continue;
+                for (int c = 0; c < fanout && pid <= count; c++) {
+                    nodes.push_back(BenchNode{pid, parent.first, names[1 + pid % (nameCount - 1)]});
+                    nextLevel.push_back(std::make_pair(pid, parent.second + 1));
+                    pid++;
+                }
+            }
+            level.swap(nextLevel);
+        }
+    }
+    return nodes;
+}
+
+static bool writeFile(const fs::path& path, const std::string& text) {
+    std::FILE* f = std::fopen(path.string().c_str(), "wb");
+    if (!f) return false;
+    bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    return std::fclose(f) == 0 && ok;
+}
+
+/**
+ * Write the shape as a /proc lookalike: <root>/<pid>/stat, status,
+ * cmdline, cgroup and task/<pid>/children, with just the fields
+ * LinuxCollector parses
+ */
+static bool writeProcFixture(const fs::path& root, const std::vector<BenchNode>& nodes) {
+    // "/a-b" and "/a.slice" sort between "/a" and "/a/b" as plain strings
+    static const char* const cgroups[] = {"/a", "/a-b", "/a.slice", "/a/b"};
+    
+    std::map<int, std::string> children;
+    for (const BenchNode& node : nodes) {
+        if (node.ppid > 0) {
+            children[node.ppid] += std::to_string(node.pid) + " ";
+        }
+    }
+    
+    std::mt19937 rng(42);
+    for (const BenchNode& node : nodes) {
+        fs::path dir = root / std::to_string(node.pid);
+        fs::path task = dir / "task" / std::to_string(node.pid);
+        std::error_code ec;
+        fs::create_directories(task, ec);
+        if (ec) return false;
+        
+        unsigned threads = 1 + rng() % 16;
+        unsigned long long rssPages = 256 + rng() % 65536;
+        unsigned long long utime = rng() % 100000;
+        unsigned long long stime = rng() % 10000;
+        // pid (comm) state ppid pgrp session tty tpgid flags minflt cminflt
+        // majflt cmajflt utime stime cutime cstime priority nice
+        // num_threads itrealvalue starttime vsize rss
+        std::string stat = std::to_string(node.pid) + " (" + node.name + ") S " +
+            std::to_string(node.ppid) + " 1 1 0 -1 4194560 100 0 0 0 " +
+            std::to_string(utime) + " " + std::to_string(stime) + " 0 0 20 0 " +
+            std::to_string(threads) + " 0 " + std::to_string(1000 + node.pid) + " 10485760 " +
+            std::to_string(rssPages) + " 18446744073709551615\n";
+        std::string status = std::string("Name:\t") + node.name + "\nState:\tS (sleeping)\n" +
+            "Pid:\t" + std::to_string(node.pid) + "\nPPid:\t" + std::to_string(node.ppid) + "\n" +
+            "Uid:\t1000\t1000\t1000\t1000\n" +
+            "VmRSS:\t" + std::to_string(rssPages * 4) + " kB\n" +
+            "Threads:\t" + std::to_string(threads) + "\n";
+        std::string cmdline = std::string(node.name) + '\0' + "--instance=" + std::to_string(node.pid) + '\0';
+        std::string cgroup = std::string("0::") + cgroups[node.pid % 4] + "\n";
+        
+        auto it = children.find(node.pid);
+        if (!writeFile(dir / "stat", stat) ||
+            !writeFile(dir / "status", status) ||
+            !writeFile(dir / "cmdline", cmdline) ||
+            !writeFile(dir / "cgroup", cgroup) ||
+            !writeFile(task / "children", it != children.end() ? it->second : std::string())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct BenchResult {
+    std::string name;
+    int iterations;
+    double medianMs;
+    double minMs;
+    double meanMs;
+};
+
+/**
+ * Run `setup` (untimed) and `body` (timed) until both the minimum
+ * iteration count and the minimum total time are reached
+ */
+template <typename Setup, typename Body>
+static BenchResult measure(const std::string& name, int minIterations, double minTotalMs,
+                           Setup setup, Body body) {
+    std::vector<double> samples;
+    double total = 0;
+    while (static_cast<int>(samples.size()) < minIterations || total < minTotalMs) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count();
+        samples.push_back(ms);
+        total += ms;
+        if (samples.size() >= 1000) break;
+    }
+    
+    BenchResult result;
+    result.name = name;
+    result.iterations = static_cast<int>(samples.size());
+    result.meanMs = total / samples.size();
+    std::sort(samples.begin(), samples.end());
+    result.minMs = samples.front();
+    result.medianMs = samples[samples.size() / 2];
+    return result;
+}
+
+/**
+ * Drives ProcessTree's private phases (friend of ProcessTree)
+ */
+struct ProcessTreeBench {
+    ProcessTree tree;
+    std::vector<ProcessInfo> raw;  // collected, not yet sorted or linked
+    
+    ProcessTreeBench() : tree(true, true) {}
+    
+    void collect() {
+        tree.table.clear();
+        tree.totalProcesses = 0;
+        tree.collectionErrors = 0;
+        tree.collectProcesses();
+    }
+    
+    void fillFromShape(const std::vector<BenchNode>& nodes) {
+        tree.table.clear();
+        for (const BenchNode& node : nodes) {
+            ProcessInfo info;
+            info.pid = node.pid;
+            info.ppid = node.ppid;
+            info.name = tree.table.strings.intern(node.name);
+            info.status = STATE_SLEEPING;
+            info.num_threads = 1 + node.pid % 16;
+            info.memory_kb = 1024 + static_cast<uint64_t>(node.pid % 65536) * 4;
+            info.cpu_time_us = static_cast<uint64_t>(node.pid) * 1000;
+            tree.table.records.push_back(info);
+        }
+    }
+    
+    void keepRaw() {
+        raw = tree.table.records;
+        // readdir order is not PID order; make the build pay for a real sort
+        std::shuffle(raw.begin(), raw.end(), std::mt19937(7));
+    }
+    
+    void restoreRaw() {
+        tree.table.records = raw;
+    }
+    
+    void build() {
+        tree.buildTree();
+    }
+    
+    void render(OutputBuffer& out) {
+        tree.renderForest(out);
+    }
+    
+    void exportTo(const std::string& filename, ProcessTree::ExportFormat format) {
+        tree.exportToFile(filename, format);
+    }
+    
+    void find(const std::string& pattern, bool regex, bool cmdlines) {
+        tree.setSearch(pattern, regex, cmdlines);
+    }
+    
+    size_t match() {
+        return tree.markMatches();
+    }
+    
+    void top(size_t count) {
+        ResourceFilter filter;
+        filter.top = count;
+        tree.setFilter(filter);
+    }
+    
+    void renderSelected(OutputBuffer& out) {
+        tree.renderMatches(out);
+    }
+    
+    /**
+     * Collect with cgroups and count the group nodes that don't hang
+     * under the group their path names as parent
+     */
+    size_t misplacedCgroups() {
+        tree.setFields(FIELD_ALL | FIELD_CGROUP);
+        collect();
+        tree.buildTree();
+        tree.buildCgroupNodes(tree.table.view());
+        tree.setFields(FIELD_ALL);
+        
+        size_t wrong = 0;
+        for (const auto& node : tree.cgroups) {
+            size_t slash = node.path.find_last_of('/');
+            std::string expected = node.path == "/" ? "" : node.path.substr(0, slash == 0 ? 1 : slash);
+            std::string actual = node.parent == ProcessTableView::npos ? "" : tree.cgroups[node.parent].path;
+            if (actual != expected) wrong++;
+        }
+        return wrong;
+    }
+};
+
+static void printUsage(const char* progName) {
+    std::cout << "Process Tree Visualizer - Benchmarks\n\n";
+    std::cout << "Usage: " << progName << " [OPTIONS]\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -h, --help           Show this help message\n";
+    std::cout << "  --procs N            Synthetic process count (default 10000)\n";
+    std::cout << "  --depth D            Tree depth (default 6)\n";
+    std::cout << "  --fanout F           Children per process (default 8)\n";
+    std::cout << "  --iterations N       Minimum runs per benchmark (default 10)\n";
+    std::cout << "  -j, --jobs N         Threads for the parallel collection case (0 = all cores)\n";
+#ifdef __linux__
+    std::cout << "  --proc-root DIR      Benchmark an existing /proc-style tree (e.g. /proc)\n";
+    std::cout << "  --generate DIR       Only write the synthetic /proc tree to DIR\n";
+#endif
+    std::cout << "  --json               Print results as JSON lines\n";
+    std::cout << "  --baseline FILE      Compare medians with a previous --json run\n";
+    std::cout << "  --tolerance PCT      Allowed slowdown against the baseline (default 10)\n\n";
+}
+
+/**
+ * Median per benchmark name from a previous --json run
+ */
+static std::map<std::string, double> readBaseline(const std::string& filename) {
+    std::map<std::string, double> medians;
+    std::ifstream in(filename);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t nameAt = line.find("\"name\":\"");
+        size_t medianAt = line.find("\"median_ms\":");
+        if (nameAt == std::string::npos || medianAt == std::string::npos) continue;
+        nameAt += 8;
+        std::string name = line.substr(nameAt, line.find('"', nameAt) - nameAt);
+        medians[name] = std::atof(line.c_str() + medianAt + 12);
+    }
+    return medians;
+}
+
+int main(int argc, char* argv[]) {
+    int procs = 10000;
+    int depth = 6;
+    int fanout = 8;
+    int iterations = 10;
+    unsigned jobs = 0;
+    bool json = false;
+    double tolerance = 10.0;
+    std::string baselineFile;
+    std::string procRoot;
+    std::string generateDir;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if (arg == "--procs" && i + 1 < argc) {
+            procs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--depth" && i + 1 < argc) {
+            depth = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--fanout" && i + 1 < argc) {
+            fanout = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max(1, std::atoi(argv[++i]));
+        } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+#ifdef __linux__
+        } else if (arg == "--proc-root" && i + 1 < argc) {
+            procRoot = argv[++i];
+        } else if (arg == "--generate" && i + 1 < argc) {
+            generateDir = argv[++i];
+#endif
+        } else if (arg == "--json") {
+            json = true;
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baselineFile = argv[++i];
+        } else if (arg == "--tolerance" && i + 1 < argc) {
+            tolerance = std::atof(argv[++i]);
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    
+    std::vector<BenchNode> shape = makeShape(procs, depth, fanout);
+    if (!generateDir.empty()) {
+        if (!writeProcFixture(generateDir, shape)) {
+            std::cerr << "Cannot write fixture to " << generateDir << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << shape.size() << " processes to " << generateDir << std::endl;
+        return 0;
+    }
+    
+    fs::path scratch = fs::temp_directory_path() / ("process_tree_bench." + std::to_string(getpid()));
+    std::error_code ec;
+    fs::create_directories(scratch, ec);
+    
+    std::ostream quiet(nullptr);
+    ProcessTreeBench bench;
+    bench.tree.setLogStream(quiet);
+    std::vector<BenchResult> results;
+
+#ifdef __linux__
+    bool fixture = procRoot.empty();
+    if (fixture) {
+        procRoot = (scratch / "proc").string();
+        if (!writeProcFixture(procRoot, shape)) {
+            std::cerr << "Cannot write fixture to " << procRoot << std::endl;
+            fs::remove_all(scratch, ec);
+            return 1;
+        }
+    }
+    bench.tree.setCollector(std::unique_ptr<ProcessCollector>(new LinuxCollector(procRoot)));
+    if (fixture) {
+        size_t misplaced = bench.misplacedCgroups();
+        if (misplaced > 0) {
+            std::cerr << misplaced << " cgroup nodes under the wrong parent" << std::endl;
+            fs::remove_all(scratch, ec);
+            return 1;
+        }
+    }
+#endif
+
+    unsigned parallelJobs = jobs > 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    bench.tree.setJobs(1);
+    results.push_back(measure("collectProcesses/jobs:1", iterations, 200, [] {}, [&] { bench.collect(); }));
+    if (parallelJobs > 1) {
+        bench.tree.setJobs(parallelJobs);
+        results.push_back(measure("collectProcesses/jobs:" + std::to_string(parallelJobs), iterations, 200,
+                                  [] {}, [&] { bench.collect(); }));
+    }
+
+#ifndef __linux__
+    // Collection ran against the live system; time the rest on the shape
+    bench.fillFromShape(shape);
+#endif
+    bench.keepRaw();
+    size_t processCount = bench.raw.size();
+    
+    results.push_back(measure("buildTree", iterations, 200,
+                              [&] { bench.restoreRaw(); }, [&] { bench.build(); }));
+    
+    std::string nullDevice =
+#ifdef _WIN32
+        "NUL";
+#else
+        "/dev/null";
+#endif
+    results.push_back(measure("displayTree", iterations, 200, [] {}, [&] {
+        OutputBuffer out;
+        out.openFile(nullDevice);
+        bench.render(out);
+    }));
+    
+    const std::pair<const char*, ProcessTree::ExportFormat> formats[] = {
+        { "text", ProcessTree::FORMAT_TEXT },
+        { "json", ProcessTree::FORMAT_JSON },
+        { "ndjson", ProcessTree::FORMAT_NDJSON },
+        { "bin", ProcessTree::FORMAT_BIN }
+    };
+    std::string exportFile = (scratch / "export.out").string();
+    for (const auto& format : formats) {
+        results.push_back(measure(std::string("exportToFile/") + format.first, iterations, 200, [] {},
+                                  [&] { bench.exportTo(exportFile, format.second); }));
+    }
+    
+    // Only the heaviest processes and their ancestor chains are walked
+    bench.top(10);
+    results.push_back(measure("displayTree/top:10", iterations, 200, [] {}, [&] {
+        OutputBuffer out;
+        out.openFile(nullDevice);
+        bench.renderSelected(out);
+    }));
+    bench.top(0);
+    
+    // Cold: a new pattern scans the whole pool; warm: a repeat search on
+    // an unchanged pool only re-checks the records
+    const struct { const char* name; const char* pattern; bool regex; bool cmdlines; } searches[] = {
+        { "find/substring", "nginx", false, false },
+        { "find/cmdline", "=4242", false, true },
+        { "find/regex", "^p(ython|ostgres)", true, false }
+    };
+    for (const auto& s : searches) {
+        results.push_back(measure(std::string(s.name) + "/cold", iterations, 200,
+                                  [&] { bench.find(s.pattern, s.regex, s.cmdlines); }, [&] { bench.match(); }));
+        results.push_back(measure(std::string(s.name) + "/warm", iterations, 200,
+                                  [] {}, [&] { bench.match(); }));
+    }
+    
+    fs::remove_all(scratch, ec);
+    
+    if (json) {
+        for (const BenchResult& r : results) {
+            std::printf("{\"name\":\"%s\",\"processes\":%zu,\"iterations\":%d,"
+                        "\"median_ms\":%.3f,\"min_ms\":%.3f,\"mean_ms\":%.3f}\n",
+                        r.name.c_str(), processCount, r.iterations, r.medianMs, r.minMs, r.meanMs);
+        }
+    } else {
+        std::printf("%zu processes, depth %d, fan-out %d\n\n", processCount, depth, fanout);
+        std::printf("%-28s %8s %12s %12s %12s\n", "benchmark", "iters", "median ms", "min ms", "mean ms");
+        for (const BenchResult& r : results) {
+            std::printf("%-28s %8d %12.3f %12.3f %12.3f\n",
+                        r.name.c_str(), r.iterations, r.medianMs, r.minMs, r.meanMs);
+        }
+    }
+    
+    if (baselineFile.empty()) {
+        return 0;
+    }
+    
+    std::map<std::string, double> baseline = readBaseline(baselineFile);
+    if (baseline.empty()) {
+        std::cerr << "No results in baseline " << baselineFile << std::endl;
+        return 1;
+    }
+    int regressions = 0;
+    for (const BenchResult& r : results) {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second <= 0) continue;
+        double change = (r.medianMs - it->second) * 100.0 / it->second;
+        if (change > tolerance) {
+            std::fprintf(stderr, "REGRESSION %s: %.3f ms -> %.3f ms (%+.1f%%)\n",
+                         r.name.c_str(), it->second, r.medianMs, change);
+            regressions++;
+        }
+    }
+    return regressions > 0 ? 2 : 0;
+}